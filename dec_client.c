@@ -5,6 +5,10 @@
 #include <sys/types.h>  
 #include <sys/socket.h> 
 #include <netdb.h>      
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "otp_proto.h"
+#include "otp_client.h"
 
 #define BUFFER_SIZE 70000
 const int bool = 0;
@@ -34,181 +38,155 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber, char* hostn
 // -- Helper Functions --
 // ----------------------------------------------------------------------------------------------
 
-// Function: 
-void sendMessage(int socketFD, char *message) {
-    int totalSent = 0;
-    int messageLength = strlen(message);
-
-    while (totalSent < messageLength) {
-        int sentAmount = send(socketFD, message + totalSent, messageLength - totalSent, 0);
-        if (sentAmount < 0) {
-            perror("ERROR sending message");
-            close(socketFD);
-            exit(1);
-        }
-        totalSent += sentAmount;
-    }
-
-    // Send a termination signal (`\n`) to mark end of message
-    char endSignal = '\n';
-    send(socketFD, &endSignal, 1, 0);
-
-    // printf("Sent full message: \"%s\"\n", message);
-}
+// Function: Connect to the server on localhost, or to its Unix socket for a unix: or shm:
+// endpoint, exiting on failure
+int connectToServer(const char *port) {
+    struct sockaddr_in serverAddress;
 
-// Function: 
-void receiveMessage(int socketFD, char *buffer, int bufferSize) {
-    memset(buffer, '\0', bufferSize);
-    int totalReceived = 0;
-    int charsRead;
-    char tempBuffer[2];
-
-    while (totalReceived < bufferSize - 1) {
-        charsRead = recv(socketFD, tempBuffer, 1, 0); // Read 1 byte at a time
-        if (charsRead < 0) {
-            perror("ERROR reading from socket");
-            close(socketFD);
-            exit(1);
-        }
-        if (charsRead == 0 || tempBuffer[0] == '\n') { // End if client closed or newline received
-            break;
+    int sharedMemory;
+    const char *socketPath = localEndpointPath(port, &sharedMemory);
+    if (socketPath != NULL) {
+        int socketFD = connectUnixSocket(socketPath);
+        if (socketFD < 0) {
+            error("CLIENT: ERROR connecting");
         }
-        buffer[totalReceived] = tempBuffer[0];
-        totalReceived++;
+        return socketFD;
     }
 
-    buffer[totalReceived] = '\0'; // Null-terminate the received message
-    // printf("Received full message: \"%s\"\n", buffer);
-
-}
-
-// Function: Gets file size 
-long getFileSize(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: could not open file %s\n", filename);
-        exit(1);
+    // Create a socket
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0); 
+    if (socketFD < 0){
+        error("CLIENT: ERROR opening socket");
     }
 
-    fseek(file, 0, SEEK_END);  // Move to the end of the file
-    long size = ftell(file);   // Get the current position (file size)
-    fclose(file);
-
-    return size;
-}
-
-// Function: Checks if length key >= plaintext
-void validateKeyLength(const char *plaintextFileName, const char *keyFileName) {
-    long plaintextSize = getFileSize(plaintextFileName);
-    long keySize = getFileSize(keyFileName);
+    // Set up the server address struct
+    setupAddressStruct(&serverAddress, atoi(port), "localhost");
 
-    // Check if key is shorter than plaintext
-    if (keySize < plaintextSize) {
-        fprintf(stderr, "Error: key '%s' is too short\n", keyFileName);
-        exit(1);
+    // Connect to server
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+        error("CLIENT: ERROR connecting");
     }
+    return socketFD;
 }
 
-// Function: Copy contens of files to variable 
-void readFileContents(const char *filename, char *buffer, int maxSize) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: could not open %s\n", filename);
+// Function: One request over the original newline protocol, printing the reply. The message
+// is gathered straight from the mapped files: ciphertext, newline, key, newline, terminator
+void runLegacyRequest(int socketFD, const StreamJob *job) {
+    // These servers read the whole message into one BUFFER_SIZE buffer
+    if (2 * job->textLength + 3 > BUFFER_SIZE) {
+        fprintf(stderr, "Error: %s is too long for this server\n", job->textPath);
+        close(socketFD);
         exit(1);
     }
-    fgets(buffer, maxSize, file);
-    fclose(file);
-
-    // Strip newline character if present
-    buffer[strcspn(buffer, "\n")] = '\0';
-}
 
-// Function: 
-void performHandshake(int socketFD, const char *clientType, const char *expectedServerType, int port) {
-    char handshakeMsg[16];
-    memset(handshakeMsg, '\0', sizeof(handshakeMsg));
-
-    // Send client identifier (ENC_CLIENT or DEC_CLIENT)
-    int charsWritten = send(socketFD, clientType, strlen(clientType), 0);
-    if (charsWritten < 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
+    // ** Step 3: Send ciphertext + key
+    struct iovec message[] = {
+        { (char *) job->text, job->textLength },
+        { "\n", 1 },
+        { (char *) job->key, job->textLength },
+        { "\n\n", 2 }
+    };
+    if (sendAllVector(socketFD, message, 4) < 0) {
+        perror("ERROR sending message");
         close(socketFD);
-        exit(2);  // Exit with status 2 as required
+        exit(1);
     }
 
-    // Receive server confirmation
-    int charsRead = recv(socketFD, handshakeMsg, sizeof(handshakeMsg) - 1, 0);
-    if (charsRead < 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
+    // ** Step 4: Stream the plaintext to stdout as it arrives
+    if (relayLineReply(socketFD, job->outFD >= 0 ? job->outFD : STDOUT_FILENO) < 0) {
+        perror("ERROR reading from socket");
         close(socketFD);
-        exit(2);
+        exit(1);
     }
+}
 
-    // Validate that the server is the correct one
-    if (strncmp(handshakeMsg, expectedServerType, strlen(expectedServerType)) != 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
-        close(socketFD);
-        exit(2);
+// Function: Open `count` connections for a pool, `firstSocket` (already handshaken) being the
+// first, exiting when any cannot be made
+void openConnectionPool(const char *port, int firstSocket, int count, int *sockets) {
+    unsigned serverOps;
+    sockets[0] = firstSocket;
+    for (int i = 1; i < count; i++) {
+        sockets[i] = connectToServer(port);
+        performHandshake(sockets[i], "DEC_CLIENT", "DEC_SERVER", port, OTP_OP_DECRYPT, &serverOps);
     }
 }
 
 // ----------------------------------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
-    int socketFD;
-    struct sockaddr_in serverAddress;
-    char buffer[BUFFER_SIZE] = {0};
-
-    if (argc < 4) { 
-        fprintf(stderr, "USAGE: %s plaintext key port\n", argv[0]); 
-        exit(1);
-    }
-
-    // Create a socket
-    socketFD = socket(AF_INET, SOCK_STREAM, 0); 
-    if (socketFD < 0){
-        error("CLIENT: ERROR opening socket");
-    }
-
-    // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]), "localhost");
+    StreamJob *jobs;
+    size_t jobCount;
+    const char *port;
+    int sharedMemory;
+    ClientOptions options;
 
+    parseClientArgs(argc, argv, "ciphertext", &jobs, &jobCount, &options, &port);
 
-    // Connect to server
-    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
-        error("CLIENT: ERROR connecting");
-    }
+    int socketFD = connectToServer(port);
+    localEndpointPath(port, &sharedMemory);
 
     // ** Step 0: Check Correct Client and Server Connection **
-    performHandshake(socketFD, "DEC_CLIENT", "DEC_SERVER", atoi(argv[3]));
+    unsigned serverOps;
+    int framed = performHandshake(socketFD, "DEC_CLIENT", "DEC_SERVER", port, OTP_OP_DECRYPT, &serverOps);
 
-     // ** Step 1: Check legnth of key >= plaintext **
-    validateKeyLength(argv[1], argv[2]);  
-    
-    // ** Step 2: Copy key and ciphertext
-    char ciphertext[BUFFER_SIZE] = {0};
-    char key[BUFFER_SIZE] = {0};
-
-    readFileContents(argv[1], ciphertext, sizeof(ciphertext));
-    readFileContents(argv[2], key, sizeof(key));
-
-    // ** Step 3: Prepare message for sending
-    strncat(buffer, ciphertext, BUFFER_SIZE - 2);
-    strncat(buffer, "\n", BUFFER_SIZE - strlen(buffer) - 1);
-    strncat(buffer, key, BUFFER_SIZE - strlen(buffer) - 1);
-    strncat(buffer, "\n", BUFFER_SIZE - strlen(buffer) - 1);
+    // ** Step 1: Map and check every pair before anything is sent **
+    for (size_t i = 0; i < jobCount; i++) {
+        loadJob(&jobs[i], jobs[i].op == OTP_OP_ENCRYPT || jobs[i].op == OTP_OP_VERIFY);
+    }
 
-     // ** Step 4: Send plaintext + key
-    sendMessage(socketFD, buffer);
+    // With -o every job gets its own output file
+    if (options.outDir != NULL) {
+        openJobOutputs(jobs, jobCount, options.outDir);
+    }
 
-     // ** Step 5: Receive ciphertext
-    receiveMessage(socketFD, buffer, sizeof(buffer));
+    // Framed servers take a whole session of ciphertext/key pairs in sized chunks over this
+    // connection, so neither the count nor the size of messages is limited by BUFFER_SIZE
+    if (framed) {
+        if (checkJobOps(jobs, jobCount, serverOps) < 0) {
+            exit(1);
+        }
+        // -z packs the payload 5 bits a character, if the server takes that
+        if (options.packed) {
+            usePackedFormat(jobs, jobCount, serverOps);
+        }
+        // Over shm: the payload goes through memory shared with the server, when it offers that;
+        // -c and -q spread the jobs over a pool of connections instead of this one
+        int verifyFailures;
+        if (sharedMemory && sharedMemoryUsable(jobs, jobCount, serverOps)) {
+            verifyFailures = shmSession(socketFD, jobs, jobCount, STDOUT_FILENO);
+        } else if (options.connections > 1 || options.inFlight > 0) {
+            int sockets[OTP_POOL_MAX_CONNECTIONS];
+            openConnectionPool(port, socketFD, options.connections, sockets);
+            verifyFailures = poolSession(sockets, options.connections, jobs, jobCount, options.inFlight,
+                                         STDOUT_FILENO);
+            for (int i = 1; i < options.connections; i++) {
+                close(sockets[i]);
+            }
+        } else {
+            verifyFailures = streamSession(socketFD, jobs, jobCount, STDOUT_FILENO);
+        }
+        if (verifyFailures < 0) {
+            fprintf(stderr, "CLIENT: ERROR streaming to port %s\n", port);
+            exit(1);
+        }
+        close(socketFD);
+        return verifyFailures > 0 ? 1 : 0;
+    }
 
-    // Print ciphertext to stdout 
-    printf("%s\n", buffer);
+    // Older servers answer one message per connection and only run their own operation
+    if (checkJobOps(jobs, jobCount, 1u << OTP_OP_DECRYPT) < 0) {
+        exit(1);
+    }
+    for (size_t i = 0; i < jobCount; i++) {
+        if (i > 0) {
+            socketFD = connectToServer(port);
+            performHandshake(socketFD, "DEC_CLIENT", "DEC_SERVER", port, OTP_OP_DECRYPT, &serverOps);
+        }
+        runLegacyRequest(socketFD, &jobs[i]);
 
-    // Close the socket
-    close(socketFD); 
+        // Close the socket
+        close(socketFD); 
+    }
 
     return 0;
 }
@@ -6,6 +6,10 @@
 #include <sys/types.h>  
 #include <sys/socket.h> 
 #include <netdb.h>      
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "otp_proto.h"
+#include "otp_client.h"
 
 #define BUFFER_SIZE 70000
 const int bool = 0;
@@ -34,205 +38,155 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber, char* hostn
 // -- Helper Functions --
 // ----------------------------------------------------------------------------------------------
 
-// Function: 
-void sendMessage(int socketFD, char *message) {
-    int totalSent = 0;
-    int messageLength = strlen(message);
+// Function: Connect to the server on localhost, or to its Unix socket for a unix: or shm:
+// endpoint, exiting on failure
+int connectToServer(const char *port) {
+    struct sockaddr_in serverAddress;
 
-    while (totalSent < messageLength) {
-        int sentAmount = send(socketFD, message + totalSent, messageLength - totalSent, 0);
-        if (sentAmount < 0) {
-            perror("ERROR sending message");
-            close(socketFD);
-            exit(1);
+    int sharedMemory;
+    const char *socketPath = localEndpointPath(port, &sharedMemory);
+    if (socketPath != NULL) {
+        int socketFD = connectUnixSocket(socketPath);
+        if (socketFD < 0) {
+            error("CLIENT: ERROR connecting");
         }
-        totalSent += sentAmount;
+        return socketFD;
     }
 
-    // Send a termination signal (`\n`) to mark end of message
-    char endSignal = '\n';
-    send(socketFD, &endSignal, 1, 0);
-
-    // printf("Sent full message: \"%s\"\n", message);
-}
-
-// Function: 
-void receiveMessage(int socketFD, char *buffer, int bufferSize) {
-    memset(buffer, '\0', bufferSize);
-    int totalReceived = 0;
-    int charsRead;
-    char tempBuffer[2];
-
-    while (totalReceived < bufferSize - 1) {
-        charsRead = recv(socketFD, tempBuffer, 1, 0); // Read 1 byte at a time
-        if (charsRead < 0) {
-            perror("ERROR reading from socket");
-            close(socketFD);
-            exit(1);
-        }
-        if (charsRead == 0 || tempBuffer[0] == '\n') { // End if client closed or newline received
-            break;
-        }
-        buffer[totalReceived] = tempBuffer[0];
-        totalReceived++;
+    // Create a socket
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0); 
+    if (socketFD < 0){
+        error("CLIENT: ERROR opening socket");
     }
 
-    buffer[totalReceived] = '\0'; // Null-terminate the received message
-    // printf("Received full message: \"%s\"\n", buffer);
+    // Set up the server address struct
+    setupAddressStruct(&serverAddress, atoi(port), "localhost");
 
+    // Connect to server
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
+        error("CLIENT: ERROR connecting");
+    }
+    return socketFD;
 }
 
-// Function: Gets file size 
-long getFileSize(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: could not open file %s\n", filename);
+// Function: One request over the original newline protocol, printing the reply. The message
+// is gathered straight from the mapped files: plaintext, newline, key, newline, terminator
+void runLegacyRequest(int socketFD, const StreamJob *job) {
+    // These servers read the whole message into one BUFFER_SIZE buffer
+    if (2 * job->textLength + 3 > BUFFER_SIZE) {
+        fprintf(stderr, "Error: %s is too long for this server\n", job->textPath);
+        close(socketFD);
         exit(1);
     }
 
-    fseek(file, 0, SEEK_END);  // Move to the end of the file
-    long size = ftell(file);   // Get the current position (file size)
-    fclose(file);
-
-    return size;
-}
-
-// Function: Checks if length key >= plaintext
-void validateKeyLength(const char *plaintextFileName, const char *keyFileName) {
-    long plaintextSize = getFileSize(plaintextFileName);
-    long keySize = getFileSize(keyFileName);
-
-    // Check if key is shorter than plaintext
-    if (keySize < plaintextSize) {
-        fprintf(stderr, "Error: key '%s' is too short\n", keyFileName);
+    // ** Step 3: Send plaintext + key
+    struct iovec message[] = {
+        { (char *) job->text, job->textLength },
+        { "\n", 1 },
+        { (char *) job->key, job->textLength },
+        { "\n\n", 2 }
+    };
+    if (sendAllVector(socketFD, message, 4) < 0) {
+        perror("ERROR sending message");
+        close(socketFD);
         exit(1);
     }
-}
 
-// Function to validate the plaintext file for only valid characters
-void validatePlaintext(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: could not open file %s\n", filename);
+    // ** Step 4: Stream the ciphertext to stdout as it arrives
+    if (relayLineReply(socketFD, job->outFD >= 0 ? job->outFD : STDOUT_FILENO) < 0) {
+        perror("ERROR reading from socket");
+        close(socketFD);
         exit(1);
     }
+}
 
-    char c;
-    while ((c = fgetc(file)) != EOF) {
-        // Allow only uppercase A-Z, space, and newline
-        if (!( (c >= 'A' && c <= 'Z') || c == ' ' || c == '\n' )) {
-            fprintf(stderr, "ERROR: input contains bad characters in %s\n", filename);
-            fclose(file);
-            exit(1);
-        }
+// Function: Open `count` connections for a pool, `firstSocket` (already handshaken) being the
+// first, exiting when any cannot be made
+void openConnectionPool(const char *port, int firstSocket, int count, int *sockets) {
+    unsigned serverOps;
+    sockets[0] = firstSocket;
+    for (int i = 1; i < count; i++) {
+        sockets[i] = connectToServer(port);
+        performHandshake(sockets[i], "ENC_CLIENT", "ENC_SERVER", port, OTP_OP_ENCRYPT, &serverOps);
     }
-
-    fclose(file);
 }
 
+// ----------------------------------------------------------------------------------------------
 
-// Function: Copy contens of files to variable 
-void readFileContents(const char *filename, char *buffer, int maxSize) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error: could not open %s\n", filename);
-        exit(1);
-    }
-    fgets(buffer, maxSize, file);
-    fclose(file);
+int main(int argc, char *argv[]) {
+    StreamJob *jobs;
+    size_t jobCount;
+    const char *port;
+    int sharedMemory;
+    ClientOptions options;
 
-    // Strip newline character if present
-    buffer[strcspn(buffer, "\n")] = '\0';
-}
+    parseClientArgs(argc, argv, "plaintext", &jobs, &jobCount, &options, &port);
 
-// Function: 
-void performHandshake(int socketFD, const char *clientType, const char *expectedServerType, int port) {
-    char handshakeMsg[16];
-    memset(handshakeMsg, '\0', sizeof(handshakeMsg));
+    int socketFD = connectToServer(port);
+    localEndpointPath(port, &sharedMemory);
 
-    // Send client identifier (ENC_CLIENT or DEC_CLIENT)
-    int charsWritten = send(socketFD, clientType, strlen(clientType), 0);
-    if (charsWritten < 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
-        close(socketFD);
-        exit(2);  // Exit with status 2 as required
+    // ** Step 0: Check Correct Client and Server Connection **
+    unsigned serverOps;
+    int framed = performHandshake(socketFD, "ENC_CLIENT", "ENC_SERVER", port, OTP_OP_ENCRYPT, &serverOps);
+
+    // ** Step 1: Map and check every pair before anything is sent **
+    for (size_t i = 0; i < jobCount; i++) {
+        loadJob(&jobs[i], jobs[i].op != OTP_OP_DECRYPT);
     }
 
-    // Receive server confirmation
-    int charsRead = recv(socketFD, handshakeMsg, sizeof(handshakeMsg) - 1, 0);
-    if (charsRead < 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
-        close(socketFD);
-        exit(2);
+    // With -o every job gets its own output file
+    if (options.outDir != NULL) {
+        openJobOutputs(jobs, jobCount, options.outDir);
     }
 
-    // Validate that the server is the correct one
-    if (strncmp(handshakeMsg, expectedServerType, strlen(expectedServerType)) != 0) {
-        fprintf(stderr, "Error: could not contact %s on port %d\n", expectedServerType, port);
+    // Framed servers take a whole session of plaintext/key pairs in sized chunks over this
+    // connection, so neither the count nor the size of messages is limited by BUFFER_SIZE
+    if (framed) {
+        if (checkJobOps(jobs, jobCount, serverOps) < 0) {
+            exit(1);
+        }
+        // -z packs the payload 5 bits a character, if the server takes that
+        if (options.packed) {
+            usePackedFormat(jobs, jobCount, serverOps);
+        }
+        // Over shm: the payload goes through memory shared with the server, when it offers that;
+        // -c and -q spread the jobs over a pool of connections instead of this one
+        int verifyFailures;
+        if (sharedMemory && sharedMemoryUsable(jobs, jobCount, serverOps)) {
+            verifyFailures = shmSession(socketFD, jobs, jobCount, STDOUT_FILENO);
+        } else if (options.connections > 1 || options.inFlight > 0) {
+            int sockets[OTP_POOL_MAX_CONNECTIONS];
+            openConnectionPool(port, socketFD, options.connections, sockets);
+            verifyFailures = poolSession(sockets, options.connections, jobs, jobCount, options.inFlight,
+                                         STDOUT_FILENO);
+            for (int i = 1; i < options.connections; i++) {
+                close(sockets[i]);
+            }
+        } else {
+            verifyFailures = streamSession(socketFD, jobs, jobCount, STDOUT_FILENO);
+        }
+        if (verifyFailures < 0) {
+            fprintf(stderr, "CLIENT: ERROR streaming to port %s\n", port);
+            exit(1);
+        }
         close(socketFD);
-        exit(2);
+        return verifyFailures > 0 ? 1 : 0;
     }
-}
-
-// ----------------------------------------------------------------------------------------------
 
-int main(int argc, char *argv[]) {
-    int socketFD;
-    struct sockaddr_in serverAddress;
-    char buffer[BUFFER_SIZE] = {0};
-
-    if (argc < 4) { 
-        fprintf(stderr, "USAGE: %s plaintext key port\n", argv[0]); 
+    // Older servers answer one message per connection and only run their own operation
+    if (checkJobOps(jobs, jobCount, 1u << OTP_OP_ENCRYPT) < 0) {
         exit(1);
     }
+    for (size_t i = 0; i < jobCount; i++) {
+        if (i > 0) {
+            socketFD = connectToServer(port);
+            performHandshake(socketFD, "ENC_CLIENT", "ENC_SERVER", port, OTP_OP_ENCRYPT, &serverOps);
+        }
+        runLegacyRequest(socketFD, &jobs[i]);
 
-    // Create a socket
-    socketFD = socket(AF_INET, SOCK_STREAM, 0); 
-    if (socketFD < 0){
-        error("CLIENT: ERROR opening socket");
-    }
-
-    // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]), "localhost");
-
-    // Connect to server
-    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
-        error("CLIENT: ERROR connecting");
+        // Close the socket
+        close(socketFD); 
     }
 
-    // ** Step 0: Check Correct Client and Server Connection **
-    performHandshake(socketFD, "ENC_CLIENT", "ENC_SERVER", atoi(argv[3]));
-
-     // ** Step 1: Check legnth of key >= plaintext **
-    validateKeyLength(argv[1], argv[2]);  
-
-     // ** Step 2: check if plaintext has any invalid characters 
-    validatePlaintext(argv[1]);
-    
-    // ** Step 3: Copy key and plaintext
-    char plaintext[BUFFER_SIZE] = {0};
-    char key[BUFFER_SIZE] = {0};
-
-    readFileContents(argv[1], plaintext, sizeof(plaintext));
-    readFileContents(argv[2], key, sizeof(key));
-
-    // ** Step 4: Prepare message for sending
-    strncat(buffer, plaintext, BUFFER_SIZE - 2);
-    strncat(buffer, "\n", BUFFER_SIZE - strlen(buffer) - 1);
-    strncat(buffer, key, BUFFER_SIZE - strlen(buffer) - 1);
-    strncat(buffer, "\n", BUFFER_SIZE - strlen(buffer) - 1);
-
-    // ** Step 5: Send plaintext + key
-    sendMessage(socketFD, buffer);
-
-    // ** Step 6: Receive ciphertext
-    receiveMessage(socketFD, buffer, sizeof(buffer));
-
-    // Print ciphertext to stdout 
-    printf("%s\n", buffer);
-
-    // Close the socket
-    close(socketFD); 
-
     return 0;
-}
\ No newline at end of file
+}
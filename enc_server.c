@@ -5,269 +5,38 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_service.h"
+#include "otp_server.h"
 
 #define BUFFER_SIZE 70000
 const int bool = 0;
 
-// Error function used for reporting issues
-void error(const char *msg) {
-  perror(msg);
-  exit(1);
-} 
-
-// Set up the address struct for the server socket
-void setupAddressStruct(struct sockaddr_in* address, 
-                        int portNumber){
- 
-  // Clear out the address struct
-  memset((char*) address, '\0', sizeof(*address)); 
-
-  // The address should be network capable
-  address->sin_family = AF_INET;
-  // Store the port number
-  address->sin_port = htons(portNumber);
-  // Allow a client at any address to connect to this server
-  address->sin_addr.s_addr = INADDR_ANY;
-}
-
-
-// -- Helper Functions --
+// -- Service --
 // ----------------------------------------------------------------------------------------------
 
-// Function: 
-void sendMessage(int socketFD, char *message) {
-  int totalSent = 0;
-  int messageLength = strlen(message);
-
-  while (totalSent < messageLength) {
-      int sentAmount = send(socketFD, message + totalSent, messageLength - totalSent, 0);
-      if (sentAmount < 0) {
-          perror("ERROR sending message");
-          close(socketFD);
-          exit(1);
-      }
-      totalSent += sentAmount;
-  }
-
-  // Send a termination signal (`\n`) to mark end of message
-  char endSignal = '\n';
-  send(socketFD, &endSignal, 1, 0);
-
-}
-
-// Function: 
-void receiveMessage(int socketFD, char *buffer, int bufferSize) {
-  memset(buffer, '\0', bufferSize);
-  int totalReceived = 0;
-  int charsRead;
-
-  while (totalReceived < bufferSize - 1) {
-      charsRead = recv(socketFD, buffer + totalReceived, bufferSize - totalReceived - 1, 0);
-      
-      if (charsRead < 0) {
-          perror("ERROR reading from socket");
-          close(socketFD);
-          exit(1);
-      }
-      if (charsRead == 0) {  // Stop if connection closes
-          break;
-      }
-
-      totalReceived += charsRead;
-
-      // ** Check if two newlines exist (plaintext + key) **
-      char *firstNewline = strchr(buffer, '\n');
-      if (firstNewline != NULL) {
-          char *secondNewline = strchr(firstNewline + 1, '\n');  // Look for second newline
-          if (secondNewline != NULL) {
-              break;  // We have received both lines
-          }
-      }
-  }
-
-  buffer[totalReceived] = '\0';  // Ensure null termination
-}
-
-// Function: 
-void extractPlaintext(char *buffer, char *plaintext, int connectionSocket) {
-  memset(plaintext, '\0', BUFFER_SIZE);
-
-  char *newlinePos = strchr(buffer, '\n');
-  if (newlinePos != NULL) {
-      size_t plaintextLength = newlinePos - buffer;
-      strncpy(plaintext, buffer, plaintextLength);
-      plaintext[plaintextLength] = '\0';  // Null-terminate
-  } else {
-      // printf("SERVER ERROR: No newline found in received message!\n");
-      fflush(stdout);
-      close(connectionSocket);
-      exit(1);
-  }
-}
-
-// Function: 
-void extractKey(char *buffer, char *key, int connectionSocket) {
-  memset(key, '\0', BUFFER_SIZE);
-
-  
-  char *newlinePos = strchr(buffer, '\n');
-  if (newlinePos != NULL) {
-      char *keyStart = newlinePos + 1;  
-      strncpy(key, keyStart, 1023);  
-      key[1023] = '\0'; 
-
-  } else {
-      // printf("SERVER ERROR: No newline found when extracting key!\n");
-      fflush(stdout);
-      close(connectionSocket);
-      exit(1);
-  }
-}
-
-// Function: 
-void parseMessage(char *buffer, char *plaintext, char *key, int connectionSocket) {
-  extractPlaintext(buffer, plaintext, connectionSocket);
-  extractKey(buffer, key, connectionSocket);
-}
-
-// Function: 
-void verifyClient(int connectionSocket, const char *expectedClientType, const char *serverType) {
-  char clientType[16];
-  memset(clientType, '\0', sizeof(clientType));
+// ENC_CLIENT only; every request encrypts, and framed ones may ask for the encryption to be
+// verified (OTP_OP_VERIFY). Connection handling lives in otp_service.h
+static const ServiceRole roles[] = {
+  { "ENC_CLIENT", "ENC_SERVER", OTP_OP_ENCRYPT }
+};
 
-  // Receive client identifier
-  int checkClient = recv(connectionSocket, clientType, sizeof(clientType) - 1, 0);
-  if (checkClient < 0) {
-      fprintf(stderr, "SERVER: ERROR reading handshake\n");
-      close(connectionSocket);
-      exit(1);
-  }
-
-  // Validate client type (ENC_CLIENT or DEC_CLIENT)
-  if (strncmp(clientType, expectedClientType, strlen(expectedClientType)) != 0) {
-      fprintf(stderr, "SERVER: ERROR - incorrect client type\n");
-      close(connectionSocket);
-      exit(1);
-  }
-
-  // Send server confirmation (ENC_SERVER or DEC_SERVER)
-  int handshakeSent = send(connectionSocket, serverType, strlen(serverType), 0);
-  if (handshakeSent < 0) {
-      fprintf(stderr, "SERVER: ERROR sending handshake response\n");
-      close(connectionSocket);
-      exit(1);
-  }
-}
-
-// FUnction: 
-void encryptMessage(const char *plaintext, const char *key, char *ciphertext) {
-  int length = strlen(plaintext);
-
-  // Ignore newline at the end if present
-  if (length > 0 && plaintext[length - 1] == '\n') {
-      length--;
-  }
-
-  for (int i = 0; i < length; i++) {
-      int plainVal, keyVal, cipherVal;
-
-      // Convert plaintext character to numeric value
-      plainVal = (plaintext[i] == ' ') ? 26 : (plaintext[i] - 'A');
-      keyVal = (key[i] == ' ') ? 26 : (key[i] - 'A');
-
-      // Apply the One-Time Pad encryption formula: (plainVal + keyVal) % 27
-      cipherVal = (plainVal + keyVal) % 27;
-
-      // Convert numeric value back to character
-      ciphertext[i] = (cipherVal == 26) ? ' ' : ('A' + cipherVal);
-
-  }
-
-  // Add newline at the end (per project requirements)
-  ciphertext[length] = '\n';
-  ciphertext[length + 1] = '\0';  // Ensure null termination
-}
+static const ServiceSpec service = { roles, 1, (1u << OTP_OP_ENCRYPT) | (1u << OTP_OP_VERIFY) };
 
 // ----------------------------------------------------------------------------------------------
 
 int main(int argc, char *argv[]){
-  int connectionSocket, charsRead;
-  char buffer[BUFFER_SIZE];
-  struct sockaddr_in serverAddress, clientAddress;
-  socklen_t sizeOfClientInfo = sizeof(clientAddress);
+  ServerConfig config;
+  parseServerArgs(argc, argv, &config);
 
-  // Check usage & args
-  if (argc < 2) { 
-    fprintf(stderr,"USAGE: %s port\n", argv[0]); 
-    exit(1);
-  } 
-  
-  // Create the socket that will listen for connections
-  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenSocket < 0) {
-    error("ERROR opening socket");
-  }
+  // Pick the cipher kernel once so every worker inherits the choice
+  initCipher();
 
-  // Set up the address struct for the server socket
-  setupAddressStruct(&serverAddress, atoi(argv[1]));
+  int listenSocket = openListenSocket(&config);
+  runServer(listenSocket, &config, &service);
 
-  // Associate the socket to the port
-  if (bind(listenSocket, 
-          (struct sockaddr *)&serverAddress, 
-          sizeof(serverAddress)) < 0){
-    error("ERROR on binding");
-  }
-
-  // Start listening for connetions. Allow up to 5 connections to queue up
-  listen(listenSocket, 5); 
-  
-  // Accept a connection, blocking if one is not available until one connects
-  while (1) {
-
-    connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
-    if (connectionSocket < 0) {
-        error("ERROR on accept");
-    }
-
-    // Concurrency Handling 
-    pid_t spawnPid = fork();
-    switch (spawnPid) {
-        case -1:  // Fork failed
-            printf("ERROR on fork\n");
-            break;
-
-        case 0:  // Child Process
-
-          close(listenSocket); 
-
-          // ** Step 0: Check Correct Client and Server Connection **
-          verifyClient(connectionSocket, "ENC_CLIENT", "ENC_SERVER");  
-
-          // ** Step 1: Receive the full message from the client **
-          char buffer[BUFFER_SIZE];
-          receiveMessage(connectionSocket, buffer, sizeof(buffer));
-
-          // ** Step 2: Parse plaintext and key **
-          char plaintext[BUFFER_SIZE], key[BUFFER_SIZE];
-          parseMessage(buffer, plaintext, key, connectionSocket);
-  
-          // ** Step 3: Encrpty Message **
-          char ciphertext[BUFFER_SIZE] = {0}; 
-          encryptMessage(plaintext, key, ciphertext);
-
-          // ** Step 4: Send the full message to the client ***
-          sendMessage(connectionSocket, ciphertext);
-
-          close(connectionSocket);
-          exit(0);
-
-        default:  // Parent Process
-            close(connectionSocket); // Parent closes the connection socket
-            break;
-    }
-  }
-  
   // Close the listening socket
   close(listenSocket); 
   return 0;
-}
\ No newline at end of file
+}
@@ -1,48 +1,174 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otp_proto.h"
+#include "otp_keygen.h"
+
 const int bool = 0;
 
+// Key generator: `keygen length [-o file] [-t threads]`.
+//
+// Key characters come from getrandom() through the unbiased mapping in
+// otp_keygen.h. Blocks are claimed from a shared cursor, so any number of
+// threads can fill them. With -o the key is written straight into a mapping of
+// the output file; otherwise each block goes to stdout in one write.
+
+#define KEYGEN_BLOCK_SIZE (1 << 20)
+
+typedef struct {
+    size_t keyLength;
+    char *mapping;           // Output file mapping (-o), or NULL for stdout
+    size_t nextBlock;        // Start of the next unclaimed block
+    pthread_mutex_t lock;    // Guards nextBlock, failed and stdout writes
+    int failed;
+} KeygenJob;
+
+// -- Workers --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Claim the next block of the key. Returns 0 with its range, or -1 when all are taken
+static int claimBlock(KeygenJob *job, size_t *start, size_t *length) {
+    pthread_mutex_lock(&job->lock);
+    *start = job->nextBlock;
+    int claimed = *start < job->keyLength && !job->failed;
+    if (claimed) {
+        *length = job->keyLength - *start < KEYGEN_BLOCK_SIZE ? job->keyLength - *start : KEYGEN_BLOCK_SIZE;
+        job->nextBlock += *length;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return claimed ? 0 : -1;
+}
+
+// Function: Record a failed block; claimBlock() then hands out no more
+static void markFailed(KeygenJob *job) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *keygenWorker(void *arg) {
+    KeygenJob *job = arg;
+    char *block = job->mapping == NULL ? malloc(KEYGEN_BLOCK_SIZE) : NULL;
+    if (job->mapping == NULL && block == NULL) {
+        markFailed(job);
+        return NULL;
+    }
+
+    size_t start, length;
+    while (claimBlock(job, &start, &length) == 0) {
+        // Mapped output is filled in place; stdout gets whole blocks, in whatever order
+        // they finish, which keeps the key uniformly random
+        char *out = job->mapping != NULL ? job->mapping + start : block;
+        int status = fillKey(out, length);
+        if (status == 0 && job->mapping == NULL) {
+            pthread_mutex_lock(&job->lock);
+            status = writeAll(STDOUT_FILENO, block, length);
+            pthread_mutex_unlock(&job->lock);
+        }
+        if (status < 0) {
+            markFailed(job);
+        }
+    }
+
+    free(block);
+    return NULL;
+}
+
+// Function: Remove a key file that was not filled completely, so a partly zero pad can never be
+// used. Nothing to do for stdout
+static void discardOutput(const char *path) {
+    if (path != NULL) {
+        fprintf(stderr, "Error: could not generate the key; removed %s\n", path);
+        unlink(path);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------
+
 int main(int argc, char* argv[]) {
 
-    // Check if two arguments provided
-    if(argc != 2) {
+    // Check if a length was provided
+    if(argc < 2 || argv[1][0] == '-') {
         printf("Error: Must provide one argument! \n");
-        return 1; 
+        printf("USAGE: %s length [-o file] [-t threads]\n", argv[0]);
+        return 1;
     }
 
     // Check for valid length
-    int keyLength = atoi(argv[1]);
-    if(keyLength <= 0) {
+    char *end;
+    errno = 0;
+    unsigned long long keyLength = strtoull(argv[1], &end, 10);
+    if(errno != 0 || *end != '\0' || keyLength == 0) {
         printf("Error: provide a valid length");
         return 1;
     }
 
-    // Seed random generator
-    srand(time(NULL));
+    const char *outputPath = NULL;
+    int threads = 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads <= 0) {
+                printf("Error: thread count must be positive\n");
+                return 1;
+            }
+        } else {
+            printf("Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
 
-    // Allocate space for key 
-    char* key = malloc((keyLength + 1)* sizeof(char));
-    if(key == NULL) {
-        printf("Error: Malloc failed \n");
-        return 1; 
+    KeygenJob job;
+    memset(&job, 0, sizeof(job));
+    job.keyLength = keyLength;
+    pthread_mutex_init(&job.lock, NULL);
+
+    // The key plus its trailing newline go straight into the file's pages
+    if (outputPath != NULL) {
+        job.mapping = mapOutputFile(outputPath, keyLength + 1);
+        if (job.mapping == NULL) {
+            fprintf(stderr, "Error: could not write %s\n", outputPath);
+            return 1;
+        }
     }
 
     // Generate random key
-    for(int i = 0; i < keyLength; i++) {
-        int val = rand() % 27;
-        if(val < 26) {
-            key[i] = (val + 'A');
-        }
-        else {
-            key[i] = ' '; 
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if(workers == NULL) {
+        printf("Error: Malloc failed \n");
+        discardOutput(outputPath);
+        return 1;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, keygenWorker, &job) != 0) {
+            printf("Error: could not start thread\n");
+            discardOutput(outputPath);
+            return 1;
         }
     }
+    keygenWorker(&job);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
 
-    // Add string terminator 
-    key[keyLength] = '\0';
-    printf("%s\n", key);
-    free(key);
+    // Add the line terminator
+    if (job.mapping != NULL) {
+        job.mapping[keyLength] = '\n';
+        munmap(job.mapping, keyLength + 1);
+        if (job.failed) {
+            discardOutput(outputPath);
+        }
+    } else if (!job.failed && writeAll(STDOUT_FILENO, "\n", 1) < 0) {
+        job.failed = 1;
+    }
 
-    return 0; 
+    return job.failed ? 1 : 0;
 }
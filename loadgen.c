@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "otp_proto.h"
+#include "otp_client.h"
+
+// Load generator for enc_server / dec_server / otp_server.
+//
+// Each client thread sends framed requests over loopback and times every one
+// of them. With -r 1 (the default) each request gets its own connection, so the
+// measured rate covers everything a server does per connection (accept, fork or
+// dispatch, handshake, cipher, reply); with -r N a connection carries N
+// requests, which isolates the per-request cost. -s, -c and -r take
+// comma-separated lists and every combination is run:
+//
+//   ./enc_server 5000 -e &   ./loadgen 5000 -s 64,65536 -c 1,8,64 -r 1,100
+//
+// One line per combination, as key=value pairs:
+//   size= concurrency= reuse= requests= failures= busy= seconds= req_per_sec= mb_per_sec=
+//   p50_us= p99_us= p999_us=
+// Latency is measured per request; with -r 1 it includes connect and handshake.
+// busy= counts requests the server turned away (-c); they are not failures.
+
+#define LOADGEN_MAX_LIST 16
+
+typedef struct {
+    int port;
+    int concurrency;
+    int requests;        // Per client thread
+    int reuse;           // Requests per connection
+    size_t messageSize;
+    const char *clientType;
+    const char *serverType;
+} LoadConfig;
+
+typedef struct {
+    const LoadConfig *config;
+    char *text;
+    char *reply;
+    double *latencies;   // Microseconds, one per completed request
+    int completed;
+    int failures;
+    int busy;            // Turned away with OTP_BUSY_REPLY
+} ClientThread;
+
+// Function: Parse a comma-separated list of positive numbers. Returns how many were read
+int parseList(const char *arg, unsigned long long *values) {
+    int count = 0;
+    char *copy = strdup(arg);
+    for (char *item = strtok(copy, ","); item != NULL && count < LOADGEN_MAX_LIST; item = strtok(NULL, ",")) {
+        values[count] = strtoull(item, NULL, 10);
+        if (values[count] > 0) {
+            count++;
+        }
+    }
+    free(copy);
+    return count;
+}
+
+// -- Requests --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Connect and perform the framed handshake. Returns the socket, -2 when the server
+// turned us away busy, or -1 on any other failure
+int openConnection(const LoadConfig *config) {
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(config->port);
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0) {
+        return -1;
+    }
+    setNoDelay(socketFD);
+
+    if (connect(socketFD, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
+        close(socketFD);
+        return -1;
+    }
+    unsigned serverOps;
+    int framed = clientHandshake(socketFD, config->clientType, config->serverType, &serverOps);
+    if (framed != 1) {
+        close(socketFD);
+        return framed == OTP_HANDSHAKE_BUSY ? -2 : -1;
+    }
+    return socketFD;
+}
+
+// Function: One framed request and its full response. Returns 0 on success
+int runOneRequest(int socketFD, const LoadConfig *config, const char *text, char *reply) {
+    // The text doubles as the key; only the transform cost matters here
+    if (sendHeader(socketFD, OTP_MSG_REQUEST, 0, config->messageSize, config->messageSize) < 0) {
+        return -1;
+    }
+    size_t offset = 0;
+    while (offset < config->messageSize) {
+        size_t length = config->messageSize - offset;
+        if (length > OTP_CHUNK_SIZE) {
+            length = OTP_CHUNK_SIZE;
+        }
+        if (sendAll(socketFD, text + offset, length) < 0 || sendAll(socketFD, text + offset, length) < 0) {
+            return -1;
+        }
+        offset += length;
+    }
+
+    FrameHeader response;
+    if (recvHeader(socketFD, &response) < 0 ||
+        response.type != OTP_MSG_RESPONSE || response.textLength != config->messageSize) {
+        return -1;
+    }
+    return recvAll(socketFD, reply, config->messageSize);
+}
+
+void *clientThreadMain(void *arg) {
+    ClientThread *thread = arg;
+    const LoadConfig *config = thread->config;
+    int socketFD = -1;
+    int used = 0;
+
+    for (int i = 0; i < config->requests; i++) {
+        double start = nowSeconds();
+        if (socketFD < 0) {
+            socketFD = openConnection(config);
+            used = 0;
+        }
+
+        if (socketFD == -2) {
+            thread->busy++;
+        } else if (socketFD >= 0 && runOneRequest(socketFD, config, thread->text, thread->reply) == 0) {
+            thread->latencies[thread->completed++] = (nowSeconds() - start) * 1e6;
+            used++;
+        } else {
+            thread->failures++;
+            used = config->reuse;  // Start over on a fresh connection
+        }
+
+        if (socketFD >= 0 && used >= config->reuse) {
+            close(socketFD);
+            socketFD = -1;
+        }
+    }
+    if (socketFD >= 0) {
+        close(socketFD);
+    }
+    return NULL;
+}
+
+// -- Reporting --
+// ----------------------------------------------------------------------------------------------
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Function: Nearest-rank percentile of sorted samples
+double percentile(const double *sorted, int count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (int) (fraction * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+// Function: Run one size / concurrency / reuse combination and print its line. Returns the
+// number of failed requests
+int runScenario(const LoadConfig *config) {
+    ClientThread *threads = calloc(config->concurrency, sizeof(ClientThread));
+    pthread_t *ids = calloc(config->concurrency, sizeof(pthread_t));
+    if (threads == NULL || ids == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < config->concurrency; i++) {
+        threads[i].config = config;
+        threads[i].text = malloc(config->messageSize + 1);
+        threads[i].reply = malloc(config->messageSize + 1);
+        threads[i].latencies = malloc(sizeof(double) * config->requests);
+        if (threads[i].text == NULL || threads[i].reply == NULL || threads[i].latencies == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        fillRandomText(threads[i].text, config->messageSize, i + 1);
+    }
+
+    double start = nowSeconds();
+    for (int i = 0; i < config->concurrency; i++) {
+        pthread_create(&ids[i], NULL, clientThreadMain, &threads[i]);
+    }
+    int completed = 0, failures = 0, busy = 0;
+    for (int i = 0; i < config->concurrency; i++) {
+        pthread_join(ids[i], NULL);
+        completed += threads[i].completed;
+        failures += threads[i].failures;
+        busy += threads[i].busy;
+    }
+    double elapsed = nowSeconds() - start;
+
+    // Merge every thread's samples for the percentiles
+    double *latencies = malloc(sizeof(double) * (completed > 0 ? completed : 1));
+    if (latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int merged = 0;
+    for (int i = 0; i < config->concurrency; i++) {
+        memcpy(latencies + merged, threads[i].latencies, sizeof(double) * threads[i].completed);
+        merged += threads[i].completed;
+        free(threads[i].text);
+        free(threads[i].reply);
+        free(threads[i].latencies);
+    }
+    qsort(latencies, merged, sizeof(double), compareDoubles);
+
+    printf("size=%zu concurrency=%d reuse=%d requests=%d failures=%d busy=%d seconds=%.3f "
+           "req_per_sec=%.1f mb_per_sec=%.2f p50_us=%.1f p99_us=%.1f p999_us=%.1f\n",
+           config->messageSize, config->concurrency, config->reuse, completed, failures, busy, elapsed,
+           completed / elapsed, (double) completed * config->messageSize / elapsed / 1e6,
+           percentile(latencies, merged, 0.50), percentile(latencies, merged, 0.99),
+           percentile(latencies, merged, 0.999));
+    fflush(stdout);
+
+    free(latencies);
+    free(threads);
+    free(ids);
+    return failures;
+}
+
+// ----------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    LoadConfig config = { 0, 8, 1000, 1, 64, "ENC_CLIENT", "ENC_SERVER" };
+    unsigned long long sizes[LOADGEN_MAX_LIST] = { 64 };
+    unsigned long long concurrencies[LOADGEN_MAX_LIST] = { 8 };
+    unsigned long long reuses[LOADGEN_MAX_LIST] = { 1 };
+    int sizeCount = 1, concurrencyCount = 1, reuseCount = 1;
+
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "USAGE: %s port [-c concurrency,...] [-n requests-per-client] [-s size,...] "
+                        "[-r requests-per-connection,...] [-d]\n", argv[0]);
+        exit(1);
+    }
+    config.port = atoi(argv[1]);
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            concurrencyCount = parseList(argv[++i], concurrencies);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            config.requests = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            sizeCount = parseList(argv[++i], sizes);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            reuseCount = parseList(argv[++i], reuses);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            config.clientType = "DEC_CLIENT";
+            config.serverType = "DEC_SERVER";
+        } else {
+            fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+            exit(1);
+        }
+    }
+    if (concurrencyCount == 0 || sizeCount == 0 || reuseCount == 0 || config.requests <= 0) {
+        fprintf(stderr, "%s: sizes, concurrency, reuse and requests must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    int failures = 0;
+    for (int s = 0; s < sizeCount; s++) {
+        for (int c = 0; c < concurrencyCount; c++) {
+            for (int r = 0; r < reuseCount; r++) {
+                config.messageSize = sizes[s];
+                config.concurrency = concurrencies[c];
+                config.reuse = reuses[r];
+                failures += runScenario(&config);
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,54 @@
+#ifndef OTP_ARENA_H
+#define OTP_ARENA_H
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Per-worker scratch memory.
+//
+// Every worker (forked child, pool process or thread) reserves one arena when
+// it starts and carves the buffers each request needs out of it: right-sized,
+// aligned to a cache line, and handed back wholesale with arenaReset() before
+// the next request. The reservation is an anonymous mapping, so only the pages
+// a request actually touches are ever backed, and they stay warm for the next
+// one. Nothing is zero-filled: a forked child serving a 10-byte message touches
+// a page or two instead of clearing four 70 KB arrays.
+
+#define OTP_ARENA_ALIGN 64
+
+typedef struct {
+  char *base;
+  size_t capacity;
+  size_t used;
+} WorkerArena;
+
+// Function: Reserve `capacity` bytes for an arena. Returns 0 on success, -1 on error
+static inline int arenaInit(WorkerArena *arena, size_t capacity) {
+  void *base = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+  arena->base = base;
+  arena->capacity = capacity;
+  arena->used = 0;
+  return 0;
+}
+
+// Function: Take `size` bytes, aligned to a cache line, from the arena. The contents are
+// whatever the previous request left there. Returns NULL when the arena is exhausted
+static inline void *arenaAlloc(WorkerArena *arena, size_t size) {
+  size_t start = (arena->used + OTP_ARENA_ALIGN - 1) & ~(size_t) (OTP_ARENA_ALIGN - 1);
+  if (start > arena->capacity || size > arena->capacity - start) {
+    return NULL;
+  }
+  arena->used = start + size;
+  return arena->base + start;
+}
+
+// Function: Release everything allocated since the arena was set up
+static inline void arenaReset(WorkerArena *arena) {
+  arena->used = 0;
+}
+
+#endif
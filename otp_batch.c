@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_client.h"
+
+// Batch mode: encrypt or decrypt many files in one run, without a process,
+// connection and handshake per file.
+//
+//   otp_batch enc|dec|verify (-m manifest | -d dir) [-o outdir] [-t threads] [-a ahead]
+//             [-s port [-c connections] [-q requests] [-z]]
+//
+// Jobs come from a manifest in the client format ("text key [enc|dec|verify]") or from
+// a directory, where every file NAME with a NAME.key beside it is a job. A
+// job's output is what enc_client / dec_client would print for it: the
+// transformed first line and a newline. With -o it is written to outdir/NAME;
+// otherwise every job's line goes to stdout, in job order.
+//
+// By default the jobs run in-process on -t threads with the kernels the servers
+// use. A worker maps a job's files, transforms text and key straight into the
+// output (a mapping of the output file with -o) and unmaps them. Meanwhile the
+// files of the job -a places ahead are handed to the kernel for read-ahead
+// (POSIX_FADV_WILLNEED), so disk reads overlap with the cipher. With -s port the
+// jobs go instead to a framed server on localhost, all over one pipelined
+// connection; the port may also be unix:PATH or shm:PATH, as for the clients.
+// With -o, -c spreads them over a pool of connections from one thread and -q
+// caps the requests in flight (poolSession in otp_client.h); each job's file is
+// written as soon as its reply is complete. Manifest jobs keyed by a server pad ("pad:ID:OFFSET", see
+// otp_client.h) can only run that way. verify encrypts and checks every job's
+// ciphertext decrypts back to its text (OTP_OP_VERIFY); a job that fails the
+// check counts as failed. -z sends the jobs in the packed format (otp_pack.h)
+// when the server takes it.
+//
+// A summary goes to stderr at the end, as key=value pairs:
+//   mode= jobs= failed= bytes= seconds= mb_per_sec=
+
+typedef struct {
+    StreamJob *jobs;
+    size_t jobCount;
+    int defaultOp;
+    const char *outDir;      // NULL for stdout
+    size_t readAhead;
+    int connections;         // Server mode: connection pool size
+    size_t inFlight;         // Server mode: requests outstanding at most, 0 for no limit
+    int packed;              // Server mode: send in the packed format when offered
+
+    pthread_mutex_t lock;    // Guards everything below
+    pthread_cond_t finished; // A job has finished; wakes the stdout writer
+    size_t nextJob;
+    char **outputs;          // Stdout mode: each job's line once it is done
+    int *status;             // Per job: 0 pending, 1 done, -1 failed
+    uint64_t bytes;          // Text bytes transformed
+    size_t failed;
+} BatchRun;
+
+// Function: Print usage and exit
+void batchUsage(const char *program) {
+    fprintf(stderr, "USAGE: %s enc|dec|verify (-m manifest | -d dir) [-o outdir] [-t threads] [-a ahead] "
+                    "[-s port [-c connections] [-q requests] [-z]]\n", program);
+    exit(1);
+}
+
+// Function: Add a job for every NAME in a directory that has a NAME.key beside it, in name order
+void readDirectory(const char *dirPath, StreamJob **jobs, size_t *jobCount, size_t *capacity) {
+    struct dirent **entries;
+    int entryCount = scandir(dirPath, &entries, NULL, alphasort);
+    if (entryCount < 0) {
+        fprintf(stderr, "Error: could not read directory %s\n", dirPath);
+        exit(1);
+    }
+
+    for (int i = 0; i < entryCount; i++) {
+        const char *name = entries[i]->d_name;
+        size_t nameLength = strlen(name);
+        if (name[0] != '.' && (nameLength < 4 || strcmp(name + nameLength - 4, ".key") != 0)) {
+            size_t pathSize = strlen(dirPath) + nameLength + 6;
+            char *textPath = malloc(pathSize);
+            char *keyPath = malloc(pathSize);
+            if (textPath == NULL || keyPath == NULL) {
+                perror("Error allocating jobs");
+                exit(1);
+            }
+            snprintf(textPath, pathSize, "%s/%s", dirPath, name);
+            snprintf(keyPath, pathSize, "%s/%s.key", dirPath, name);
+
+            struct stat textInfo, keyInfo;
+            if (stat(textPath, &textInfo) == 0 && S_ISREG(textInfo.st_mode) &&
+                stat(keyPath, &keyInfo) == 0 && S_ISREG(keyInfo.st_mode)) {
+                addJob(jobs, jobCount, capacity, textPath, keyPath, OTP_OP_DEFAULT);
+            } else {
+                free(textPath);
+                free(keyPath);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+// Function: Ask the kernel to start reading a job's files into the page cache
+void prefetchJob(const StreamJob *job) {
+    const char *paths[2] = { job->textPath, job->keyPath };
+    for (int i = 0; i < 2; i++) {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+}
+
+// -- In-Process --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Transform one job from its mapped inputs straight into its output. Returns 0 on
+// success, -1 after printing what went wrong
+int runJob(BatchRun *run, size_t index) {
+    StreamJob *job = &run->jobs[index];
+    int op = job->op != OTP_OP_DEFAULT ? job->op : run->defaultOp;
+    if (job->usePad) {
+        fprintf(stderr, "Error: %s is keyed by a pad; pads need a server (-s)\n", job->textPath);
+        return -1;
+    }
+    // Only when the scalar kernel is selected (OTP_CIPHER=scalar, or a CPU without SSE2): it can
+    // check its input as it goes, so an encryption maps the text unchecked and validates its line
+    // in the cipher's own pass. Whatever follows the line's newline is scanned here, before any
+    // output exists. Every other kernel has mapJob() scan the whole file first
+    int checkInPass = op == OTP_OP_ENCRYPT && initCipher()->encrypt == encryptScalar;
+    if (mapJob(job, op != OTP_OP_DECRYPT && !checkInPass) < 0) {
+        return -1;
+    }
+    size_t lineLength;
+    if (checkInPass &&
+        scanInput(job->text + job->textLength, job->textMapped - job->textLength, 1, &lineLength) < 0) {
+        fprintf(stderr, "ERROR: input contains bad characters in %s\n", job->textPath);
+        unloadJob(job);
+        return -1;
+    }
+
+    // The output is the transformed line plus its newline
+    size_t outputLength = job->textLength + 1;
+    char *output;
+    char *path = NULL;
+    if (run->outDir != NULL) {
+        path = outputPath(run->outDir, job->textPath);
+        output = path != NULL ? mapOutputFile(path, outputLength) : NULL;
+        if (output == NULL) {
+            fprintf(stderr, "Error: could not write %s\n", path != NULL ? path : job->textPath);
+        }
+    } else {
+        output = malloc(outputLength);
+    }
+    if (output == NULL) {
+        free(path);
+        unloadJob(job);
+        return -1;
+    }
+
+    uint64_t mismatches = 0;
+    int badInput = 0;
+    if (checkInPass) {
+        // A -1 may come from the key, which no other path checks; only the text decides
+        badInput = encryptScalarChecked(job->text, job->key, output, job->textLength) < 0 &&
+                   scanInput(job->text, job->textLength, 1, &lineLength) < 0;
+    } else if (op == OTP_OP_ENCRYPT) {
+        cipherEncrypt(job->text, job->key, output, job->textLength);
+    } else if (op == OTP_OP_VERIFY) {
+        mismatches = cipherVerify(job->text, job->key, output, job->textLength);
+    } else {
+        cipherDecrypt(job->text, job->key, output, job->textLength);
+    }
+    output[job->textLength] = '\n';
+
+    if (run->outDir != NULL) {
+        munmap(output, outputLength);
+        if (badInput) {
+            unlink(path);  // Rejected text leaves no output, as when mapJob() rejects it
+        }
+    } else if (mismatches == 0 && !badInput) {
+        run->outputs[index] = output;
+    } else {
+        free(output);
+    }
+    free(path);
+    unloadJob(job);
+    if (badInput) {
+        fprintf(stderr, "ERROR: input contains bad characters in %s\n", job->textPath);
+        return -1;
+    }
+    if (mismatches > 0) {
+        fprintf(stderr, "Error: %s failed verification, %llu bytes did not survive the round trip\n",
+                job->textPath, (unsigned long long) mismatches);
+        return -1;
+    }
+    return 0;
+}
+
+void *batchWorker(void *arg) {
+    BatchRun *run = arg;
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        size_t index = run->nextJob++;
+        pthread_mutex_unlock(&run->lock);
+        if (index >= run->jobCount) {
+            return NULL;
+        }
+
+        // Keep the read-ahead window full while this job computes
+        if (index + run->readAhead < run->jobCount) {
+            prefetchJob(&run->jobs[index + run->readAhead]);
+        }
+        int status = runJob(run, index);
+
+        pthread_mutex_lock(&run->lock);
+        run->status[index] = status == 0 ? 1 : -1;
+        if (status == 0) {
+            run->bytes += run->jobs[index].textLength;
+        } else {
+            run->failed++;
+        }
+        pthread_cond_broadcast(&run->finished);
+        pthread_mutex_unlock(&run->lock);
+    }
+}
+
+// Function: Run every job on `threads` workers. In stdout mode this thread prints each job's line
+// as soon as it and every job before it are done
+void runInProcess(BatchRun *run, int threads) {
+    initCipher();  // Pick the kernel once, before the workers race for it
+    for (size_t i = 0; i < run->readAhead && i < run->jobCount; i++) {
+        prefetchJob(&run->jobs[i]);
+    }
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if (workers == NULL) {
+        perror("Error starting workers");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, batchWorker, run) != 0) {
+            perror("Error starting workers");
+            exit(1);
+        }
+    }
+
+    for (size_t i = 0; run->outDir == NULL && i < run->jobCount; i++) {
+        pthread_mutex_lock(&run->lock);
+        while (run->status[i] == 0) {
+            pthread_cond_wait(&run->finished, &run->lock);
+        }
+        pthread_mutex_unlock(&run->lock);
+
+        if (run->status[i] > 0) {
+            if (writeAll(STDOUT_FILENO, run->outputs[i], run->jobs[i].textLength + 1) < 0) {
+                perror("Error writing output");
+                exit(1);
+            }
+            free(run->outputs[i]);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+// -- Over a Server --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Connect to a framed server on localhost, or on its Unix socket for a unix: or shm:
+// endpoint, and handshake for `op`. Returns the socket with *serverOps set to the operations it
+// offers, OTP_HANDSHAKE_BUSY when it is at its connection limit, or -1 on any other failure
+int connectServer(const char *port, int op, unsigned *serverOps) {
+    const char *clientType = op != OTP_OP_DECRYPT ? "ENC_CLIENT" : "DEC_CLIENT";
+    const char *serverType = op != OTP_OP_DECRYPT ? "ENC_SERVER" : "DEC_SERVER";
+
+    int sharedMemory;
+    const char *socketPath = localEndpointPath(port, &sharedMemory);
+    int socketFD = socketPath != NULL ? connectUnixSocket(socketPath) : socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(atoi(port));
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (socketPath == NULL) {
+        setNoDelay(socketFD);
+        if (connect(socketFD, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
+            close(socketFD);
+            return -1;
+        }
+    }
+
+    // Batches need the framed protocol; an older server cannot take them
+    int framed = clientHandshake(socketFD, clientType, serverType, serverOps);
+    if (framed != 1) {
+        close(socketFD);
+        return framed == OTP_HANDSHAKE_BUSY ? OTP_HANDSHAKE_BUSY : -1;
+    }
+    if (*serverOps == 0) {
+        *serverOps = 1u << op;
+    }
+    return socketFD;
+}
+
+// Function: Send every job that loads to the server as one pipelined session. Jobs that fail to
+// load are counted and left out
+void runOverServer(BatchRun *run, const char *port) {
+    StreamJob *ready = malloc(sizeof(StreamJob) * run->jobCount);
+    size_t readyCount = 0;
+    if (ready == NULL) {
+        perror("Error allocating jobs");
+        exit(1);
+    }
+
+    // Map and check every job first; read-ahead keeps the disk busy while earlier ones are scanned
+    for (size_t i = 0; i < run->readAhead && i < run->jobCount; i++) {
+        prefetchJob(&run->jobs[i]);
+    }
+    for (size_t i = 0; i < run->jobCount; i++) {
+        StreamJob *job = &run->jobs[i];
+        if (i + run->readAhead < run->jobCount) {
+            prefetchJob(&run->jobs[i + run->readAhead]);
+        }
+        int op = job->op != OTP_OP_DEFAULT ? job->op : run->defaultOp;
+        if (mapJob(job, op != OTP_OP_DECRYPT) < 0) {
+            run->failed++;
+            continue;
+        }
+        if (run->outDir != NULL && openJobOutput(job, run->outDir) < 0) {
+            unloadJob(job);
+            run->failed++;
+            continue;
+        }
+        ready[readyCount] = *job;
+        ready[readyCount++].op = op == OTP_OP_VERIFY ? op : job->op;  // Not the role's default
+    }
+
+    // Shared memory already keeps the payload off the socket; a pool only helps the socket paths
+    int sharedMemory;
+    localEndpointPath(port, &sharedMemory);
+    int sockets[OTP_POOL_MAX_CONNECTIONS];
+    unsigned serverOps;
+    sockets[0] = connectServer(port, run->defaultOp, &serverOps);
+    int connections = sockets[0] >= 0 ? 1 : 0;
+    int lastResult = sockets[0];
+    int pooled = !sharedMemory && (run->connections > 1 || run->inFlight > 0);
+    while (pooled && connections > 0 && connections < run->connections) {
+        unsigned ops;
+        lastResult = sockets[connections] = connectServer(port, run->defaultOp, &ops);
+        if (sockets[connections] < 0) {
+            break;
+        }
+        connections++;
+    }
+    if (connections == 0 || connections < (pooled ? run->connections : 1)) {
+        if (lastResult == OTP_HANDSHAKE_BUSY) {
+            fprintf(stderr, "Error: server on port %s is busy, try again later\n", port);
+        } else {
+            fprintf(stderr, "Error: could not contact a framed server on port %s\n", port);
+        }
+        exit(2);
+    }
+    if (checkJobOps(ready, readyCount, serverOps) < 0) {
+        exit(1);
+    }
+    if (run->packed) {
+        usePackedFormat(ready, readyCount, serverOps);
+    }
+
+    int verifyFailures;
+    if (sharedMemory && sharedMemoryUsable(ready, readyCount, serverOps)) {
+        verifyFailures = shmSession(sockets[0], ready, readyCount, STDOUT_FILENO);
+    } else if (pooled) {
+        verifyFailures = poolSession(sockets, connections, ready, readyCount, run->inFlight, STDOUT_FILENO);
+    } else {
+        verifyFailures = streamSession(sockets[0], ready, readyCount, STDOUT_FILENO);
+    }
+    if (verifyFailures < 0) {
+        fprintf(stderr, "Error: session with port %s failed\n", port);
+        exit(1);
+    }
+    run->failed += verifyFailures;
+    for (int i = 0; i < connections; i++) {
+        close(sockets[i]);
+    }
+
+    for (size_t i = 0; i < readyCount; i++) {
+        run->bytes += ready[i].textLength;
+        if (ready[i].outFD >= 0) {
+            close(ready[i].outFD);
+        }
+        unloadJob(&ready[i]);
+    }
+    free(ready);
+}
+
+// ----------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    BatchRun run;
+    memset(&run, 0, sizeof(run));
+    run.readAhead = 4;
+    run.connections = 1;
+    int threads = 1;
+    const char *port = NULL;
+    size_t capacity = 0;
+
+    if (argc < 2) {
+        batchUsage(argv[0]);
+    }
+    if (strcmp(argv[1], "enc") == 0) {
+        run.defaultOp = OTP_OP_ENCRYPT;
+    } else if (strcmp(argv[1], "dec") == 0) {
+        run.defaultOp = OTP_OP_DECRYPT;
+    } else if (strcmp(argv[1], "verify") == 0) {
+        run.defaultOp = OTP_OP_VERIFY;
+    } else {
+        batchUsage(argv[0]);
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            readManifest(argv[++i], &run.jobs, &run.jobCount, &capacity);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            readDirectory(argv[++i], &run.jobs, &run.jobCount, &capacity);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            run.outDir = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads <= 0) {
+                batchUsage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            run.readAhead = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            run.connections = atoi(argv[++i]);
+            if (run.connections <= 0 || run.connections > OTP_POOL_MAX_CONNECTIONS) {
+                batchUsage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            run.inFlight = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-z") == 0) {
+            run.packed = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else {
+            batchUsage(argv[0]);
+        }
+    }
+    if (run.jobCount == 0) {
+        fprintf(stderr, "Error: nothing to do\n");
+        exit(1);
+    }
+
+    if (run.outDir != NULL && mkdir(run.outDir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create %s\n", run.outDir);
+        exit(1);
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.finished, NULL);
+    run.outputs = calloc(run.jobCount, sizeof(char *));
+    run.status = calloc(run.jobCount, sizeof(int));
+    if (run.outputs == NULL || run.status == NULL) {
+        perror("Error allocating jobs");
+        exit(1);
+    }
+
+    double start = nowSeconds();
+    if (port != NULL) {
+        runOverServer(&run, port);
+    } else {
+        runInProcess(&run, threads);
+    }
+    double elapsed = nowSeconds() - start;
+
+    fprintf(stderr, "mode=%s jobs=%zu failed=%zu bytes=%llu seconds=%.3f mb_per_sec=%.1f\n",
+            port != NULL ? "server" : "local", run.jobCount, run.failed, (unsigned long long) run.bytes,
+            elapsed, elapsed > 0 ? run.bytes / elapsed / 1e6 : 0.0);
+    return run.failed == 0 ? 0 : 1;
+}
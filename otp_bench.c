@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_service.h"
+#include "otp_pack.h"
+#include "otp_keygen.h"
+
+// Microbenchmarks for the cipher kernels, the newline-protocol message functions,
+// the packed wire format and key generation. One line per case, as key=value pairs:
+//
+//   bench=kernel impl=avx2 op=encrypt size=65536 iterations=... seconds=... mb_per_sec=...
+//   bench=kernel impl=reference op=encrypt ...      (the arithmetic the tables replace)
+//   bench=kernel impl=scalar-checked op=encrypt ... (scalar, validating as otp_batch does)
+//   bench=message op=encrypt size=4096 ...
+//   bench=pack impl=avx2 op=pack size=65536 ...       (size counts symbols)
+//   bench=pack impl=avx2 op=encrypt ...              (transformPacked(), a packed request's cipher)
+//   bench=keygen stage=convert size=1048576 ...      (random bytes already in memory)
+//   bench=keygen stage=getrandom size=1048576 ...    (what keygen itself does)
+//
+// Usage: otp_bench [-t seconds-per-case]
+
+typedef void (*BenchCase)(void *context, size_t size);
+
+typedef struct {
+    char *text;
+    char *key;
+    char *out;
+    CipherKernel kernel;
+    int (*checkedKernel)(const char *text, const char *key, char *out, size_t length);
+    unsigned char *random;
+    PackKernel pack;
+    UnpackKernel unpack;
+    unsigned char *packedText;
+    unsigned char *packedKey;
+} BenchContext;
+
+static const size_t benchSizes[] = { 64, 4096, 65536, 1 << 20 };
+#define BENCH_SIZE_COUNT (sizeof(benchSizes) / sizeof(benchSizes[0]))
+#define BENCH_MAX_SIZE (1 << 20)
+
+// Function: Run one case repeatedly for about `seconds` and print its throughput. Iterations
+// double until a batch is long enough to time reliably
+void runCase(const char *label, BenchCase benchCase, void *context, size_t size, double seconds) {
+    long iterations = 1;
+    double elapsed = 0;
+    long total = 0;
+
+    benchCase(context, size);  // Warm caches and page in buffers
+    while (elapsed < seconds) {
+        double start = nowSeconds();
+        for (long i = 0; i < iterations; i++) {
+            benchCase(context, size);
+        }
+        elapsed += nowSeconds() - start;
+        total += iterations;
+        if (iterations < (1L << 30)) {
+            iterations *= 2;
+        }
+    }
+
+    printf("%s size=%zu iterations=%ld seconds=%.3f mb_per_sec=%.1f\n", label, size, total, elapsed,
+           (double) size * total / elapsed / 1e6);
+    fflush(stdout);
+}
+
+// -- Cases --
+// ----------------------------------------------------------------------------------------------
+
+void kernelCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    context->kernel(context->text, context->key, context->out, size);
+}
+
+void checkedKernelCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    if (context->checkedKernel(context->text, context->key, context->out, size) < 0) {
+        exit(1);
+    }
+}
+
+void encryptMessageCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    encryptMessage(context->text, size, context->key, context->out);
+}
+
+void decryptMessageCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    decryptMessage(context->text, size, context->key, context->out);
+}
+
+void packCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    context->pack(context->text, size, context->packedText);
+}
+
+void unpackCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    context->unpack(context->packedKey, size, context->out);
+}
+
+void packedEncryptCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    transformPacked(context->packedText, context->packedKey, size, cipherEncrypt, 0);
+}
+
+void convertCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    convertRandom(context->random, size, context->out);
+}
+
+void getrandomCase(void *arg, size_t size) {
+    BenchContext *context = arg;
+    if (fillKey(context->out, size) < 0) {
+        exit(1);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    double seconds = 0.2;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "USAGE: %s [-t seconds-per-case]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    BenchContext context;
+    context.text = malloc(BENCH_MAX_SIZE + 1);
+    context.key = malloc(BENCH_MAX_SIZE + 1);
+    context.out = malloc(BENCH_MAX_SIZE + 2);
+    context.random = malloc(BENCH_MAX_SIZE);
+    context.packedText = malloc(packedLength(BENCH_MAX_SIZE));
+    context.packedKey = malloc(packedLength(BENCH_MAX_SIZE));
+    if (!context.text || !context.key || !context.out || !context.random || !context.packedText ||
+        !context.packedKey) {
+        perror("malloc");
+        exit(1);
+    }
+    fillRandomText(context.text, BENCH_MAX_SIZE + 1, 1);
+    fillRandomText(context.key, BENCH_MAX_SIZE + 1, 2);
+    for (size_t i = 0; i < BENCH_MAX_SIZE; i++) {
+        context.random[i] = (unsigned char) context.key[i] * 7;
+    }
+
+    char label[128];
+
+    // ** Step 1: Every kernel this CPU supports **
+    for (size_t impl = 0; impl < OTP_CIPHER_IMPL_COUNT; impl++) {
+        if (!cipherImpls[impl].supported()) {
+            continue;
+        }
+        for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+            context.kernel = cipherImpls[impl].encrypt;
+            snprintf(label, sizeof(label), "bench=kernel impl=%s op=encrypt", cipherImpls[impl].name);
+            runCase(label, kernelCase, &context, benchSizes[s], seconds);
+            context.kernel = cipherImpls[impl].decrypt;
+            snprintf(label, sizeof(label), "bench=kernel impl=%s op=decrypt", cipherImpls[impl].name);
+            runCase(label, kernelCase, &context, benchSizes[s], seconds);
+        }
+    }
+
+    // ** Step 2: The scalar kernel against the byte-at-a-time arithmetic, and with validation **
+    for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+        context.kernel = encryptReference;
+        runCase("bench=kernel impl=reference op=encrypt", kernelCase, &context, benchSizes[s], seconds);
+        context.kernel = decryptReference;
+        runCase("bench=kernel impl=reference op=decrypt", kernelCase, &context, benchSizes[s], seconds);
+        context.checkedKernel = encryptScalarChecked;
+        runCase("bench=kernel impl=scalar-checked op=encrypt", checkedKernelCase, &context, benchSizes[s],
+                seconds);
+    }
+
+    // ** Step 3: Newline-protocol message functions through the dispatched kernel **
+    initCipher();
+    for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+        snprintf(label, sizeof(label), "bench=message impl=%s op=encrypt", activeCipher->name);
+        runCase(label, encryptMessageCase, &context, benchSizes[s], seconds);
+        snprintf(label, sizeof(label), "bench=message impl=%s op=decrypt", activeCipher->name);
+        runCase(label, decryptMessageCase, &context, benchSizes[s], seconds);
+    }
+
+    // ** Step 4: Packing, and the cipher over packed data, with every pack kernel **
+    packScalar(context.key, BENCH_MAX_SIZE, context.packedKey);
+    for (size_t impl = 0; impl < OTP_PACK_IMPL_COUNT; impl++) {
+        if (!packImpls[impl].supported()) {
+            continue;
+        }
+        activePack = &packImpls[impl];
+        context.pack = packImpls[impl].pack;
+        context.unpack = packImpls[impl].unpack;
+        for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+            snprintf(label, sizeof(label), "bench=pack impl=%s op=pack", packImpls[impl].name);
+            runCase(label, packCase, &context, benchSizes[s], seconds);
+            snprintf(label, sizeof(label), "bench=pack impl=%s op=unpack", packImpls[impl].name);
+            runCase(label, unpackCase, &context, benchSizes[s], seconds);
+            snprintf(label, sizeof(label), "bench=pack impl=%s op=encrypt", packImpls[impl].name);
+            runCase(label, packedEncryptCase, &context, benchSizes[s], seconds);
+        }
+    }
+
+    // ** Step 5: Key generation **
+    for (size_t s = 0; s < BENCH_SIZE_COUNT; s++) {
+        runCase("bench=keygen stage=convert", convertCase, &context, benchSizes[s], seconds);
+        runCase("bench=keygen stage=getrandom", getrandomCase, &context, benchSizes[s], seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,470 @@
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OTP_CIPHER_X86 1
+#endif
+
+// Shared mod-27 cipher kernels for the enc/dec servers.
+//
+// Characters map to values with v(c) = min((unsigned char) (c - 'A'), 26), so
+// 'A'..'Z' become 0..25 and ' ' (like any other byte outside A-Z) becomes 26.
+// Sums are reduced with r = min(s, s - 27) on unsigned bytes, which needs no
+// branch and no divide. That arithmetic is spelled out once, a byte at a time,
+// in encryptReference()/decryptReference(); the vector kernels do it 16 to 64
+// bytes per step. The portable scalar kernel looks everything up in tables
+// built at compile time instead, which is about twice as fast as the reference
+// one byte at a time. Every kernel is bit-for-bit identical on any input;
+// initCipher() re-checks that at startup against the reference, scalar
+// included, and runs the reference itself if no kernel passes.
+
+typedef void (*CipherKernel)(const char *text, const char *key, char *out, size_t length);
+
+typedef struct {
+  const char *name;
+  int (*supported)(void);
+  CipherKernel encrypt;
+  CipherKernel decrypt;
+} CipherImpl;
+
+// -- Reference Arithmetic --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Map a character to its 0..26 value
+static inline unsigned char charToValue(char c) {
+  unsigned char value = (unsigned char) (c - 'A');
+  return value > 26 ? 26 : value;
+}
+
+// Function: Map a 0..26 value back to its character
+static inline char valueToChar(unsigned char value) {
+  return value == 26 ? ' ' : (char) ('A' + value);
+}
+
+// Function: Reduce a 0..53 sum to 0..26
+static inline unsigned char reduceMod27(unsigned char sum) {
+  unsigned char wrapped = (unsigned char) (sum - 27);
+  return wrapped < sum ? wrapped : sum;
+}
+
+// Function: Reference encrypt, (text + key) mod 27, one byte at a time in the vector kernels'
+// arithmetic. The self test holds every kernel to it. `out` may alias `text`
+static inline void encryptReference(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    out[i] = valueToChar(reduceMod27(charToValue(text[i]) + charToValue(key[i])));
+  }
+}
+
+// Function: Reference decrypt, (text - key) mod 27. `out` may alias `text`
+static inline void decryptReference(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    out[i] = valueToChar(reduceMod27(charToValue(text[i]) + 27 - charToValue(key[i])));
+  }
+}
+
+// -- Scalar Kernel (lookup tables) --
+// ----------------------------------------------------------------------------------------------
+
+// Every table is a static initializer, so it is built by the compiler and lives in .rodata:
+// nothing to set up at startup and nothing for forked workers to copy.
+//
+// cipherCharValues maps each byte to its value, with OTP_CHAR_INVALID set on bytes that are not
+// A-Z or space; masked with OTP_CHAR_VALUE_MASK they become 26, as v(c) makes them. The 27 x 27
+// tables hold finished characters, so a step is three loads: two values and the result.
+
+#define OTP_CHAR_INVALID 0x80
+#define OTP_CHAR_VALUE_MASK 0x1F
+
+static const unsigned char cipherCharValues[256] = {
+  [0 ... 255] = OTP_CHAR_INVALID | 26,
+  ['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3, ['E'] = 4, ['F'] = 5, ['G'] = 6, ['H'] = 7,
+  ['I'] = 8, ['J'] = 9, ['K'] = 10, ['L'] = 11, ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
+  ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+  ['Y'] = 24, ['Z'] = 25, [' '] = 26,
+};
+
+// Row a, column b of a 27 x 27 table is ENTRY(a, b)
+#define OTP_VALUE_CHAR(v) ((v) == 26 ? ' ' : 'A' + (v))
+#define OTP_ADD_ENTRY(a, b) OTP_VALUE_CHAR(((a) + (b)) % 27)
+#define OTP_SUB_ENTRY(a, b) OTP_VALUE_CHAR(((a) + 27 - (b)) % 27)
+#define OTP_COLUMNS3(ENTRY, a, b) ENTRY(a, b), ENTRY(a, (b) + 1), ENTRY(a, (b) + 2)
+#define OTP_COLUMNS9(ENTRY, a, b) \
+  OTP_COLUMNS3(ENTRY, a, b), OTP_COLUMNS3(ENTRY, a, (b) + 3), OTP_COLUMNS3(ENTRY, a, (b) + 6)
+#define OTP_ROW(ENTRY, a) { OTP_COLUMNS9(ENTRY, a, 0), OTP_COLUMNS9(ENTRY, a, 9), OTP_COLUMNS9(ENTRY, a, 18) }
+#define OTP_ROWS3(ENTRY, a) OTP_ROW(ENTRY, a), OTP_ROW(ENTRY, (a) + 1), OTP_ROW(ENTRY, (a) + 2)
+#define OTP_ROWS9(ENTRY, a) OTP_ROWS3(ENTRY, a), OTP_ROWS3(ENTRY, (a) + 3), OTP_ROWS3(ENTRY, (a) + 6)
+#define OTP_TABLE27(ENTRY) { OTP_ROWS9(ENTRY, 0), OTP_ROWS9(ENTRY, 9), OTP_ROWS9(ENTRY, 18) }
+
+static const char cipherAddTable[27][27] = OTP_TABLE27(OTP_ADD_ENTRY);
+static const char cipherSubTable[27][27] = OTP_TABLE27(OTP_SUB_ENTRY);
+
+// Function: Scalar encrypt, (text + key) mod 27, by table. `out` may alias `text`
+static inline void encryptScalar(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char t = cipherCharValues[(unsigned char) text[i]] & OTP_CHAR_VALUE_MASK;
+    unsigned char k = cipherCharValues[(unsigned char) key[i]] & OTP_CHAR_VALUE_MASK;
+    out[i] = cipherAddTable[t][k];
+  }
+}
+
+// Function: Scalar decrypt, (text - key) mod 27, by table. `out` may alias `text`
+static inline void decryptScalar(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char t = cipherCharValues[(unsigned char) text[i]] & OTP_CHAR_VALUE_MASK;
+    unsigned char k = cipherCharValues[(unsigned char) key[i]] & OTP_CHAR_VALUE_MASK;
+    out[i] = cipherSubTable[t][k];
+  }
+}
+
+// Function: encryptScalar that also checks its input in the same pass, for callers that would
+// otherwise scan the text first (otp_batch with the scalar kernel selected). The output is the same
+// either way. Returns 0, or -1 when the text or key held a byte other than A-Z or space
+static inline int encryptScalarChecked(const char *text, const char *key, char *out, size_t length) {
+  unsigned char seen = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char t = cipherCharValues[(unsigned char) text[i]];
+    unsigned char k = cipherCharValues[(unsigned char) key[i]];
+    seen |= t | k;
+    out[i] = cipherAddTable[t & OTP_CHAR_VALUE_MASK][k & OTP_CHAR_VALUE_MASK];
+  }
+  return (seen & OTP_CHAR_INVALID) ? -1 : 0;
+}
+
+static inline int scalarSupported(void) {
+  return 1;
+}
+
+#ifdef OTP_CIPHER_X86
+
+// -- SSE2 Kernel (16 bytes per step) --
+// ----------------------------------------------------------------------------------------------
+
+__attribute__((target("sse2")))
+static inline __m128i toValuesSse2(__m128i chars) {
+  return _mm_min_epu8(_mm_sub_epi8(chars, _mm_set1_epi8('A')), _mm_set1_epi8(26));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i toCharsSse2(__m128i values) {
+  // 26 maps to 'A' + 26 == '[', pull it down to ' '
+  __m128i isSpace = _mm_cmpeq_epi8(values, _mm_set1_epi8(26));
+  __m128i chars = _mm_add_epi8(values, _mm_set1_epi8('A'));
+  return _mm_sub_epi8(chars, _mm_and_si128(isSpace, _mm_set1_epi8('[' - ' ')));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i reduceSse2(__m128i sum) {
+  return _mm_min_epu8(sum, _mm_sub_epi8(sum, _mm_set1_epi8(27)));
+}
+
+__attribute__((target("sse2")))
+static void encryptSse2(const char *text, const char *key, char *out, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i t = toValuesSse2(_mm_loadu_si128((const __m128i *) (text + i)));
+    __m128i k = toValuesSse2(_mm_loadu_si128((const __m128i *) (key + i)));
+    _mm_storeu_si128((__m128i *) (out + i), toCharsSse2(reduceSse2(_mm_add_epi8(t, k))));
+  }
+  encryptScalar(text + i, key + i, out + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static void decryptSse2(const char *text, const char *key, char *out, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i t = toValuesSse2(_mm_loadu_si128((const __m128i *) (text + i)));
+    __m128i k = toValuesSse2(_mm_loadu_si128((const __m128i *) (key + i)));
+    __m128i diff = _mm_sub_epi8(_mm_add_epi8(t, _mm_set1_epi8(27)), k);
+    _mm_storeu_si128((__m128i *) (out + i), toCharsSse2(reduceSse2(diff)));
+  }
+  decryptScalar(text + i, key + i, out + i, length - i);
+}
+
+static inline int sse2Supported(void) {
+  return __builtin_cpu_supports("sse2");
+}
+
+// -- AVX2 Kernel (32 bytes per step) --
+// ----------------------------------------------------------------------------------------------
+
+__attribute__((target("avx2")))
+static inline __m256i toValuesAvx2(__m256i chars) {
+  return _mm256_min_epu8(_mm256_sub_epi8(chars, _mm256_set1_epi8('A')), _mm256_set1_epi8(26));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i toCharsAvx2(__m256i values) {
+  __m256i isSpace = _mm256_cmpeq_epi8(values, _mm256_set1_epi8(26));
+  __m256i chars = _mm256_add_epi8(values, _mm256_set1_epi8('A'));
+  return _mm256_sub_epi8(chars, _mm256_and_si256(isSpace, _mm256_set1_epi8('[' - ' ')));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reduceAvx2(__m256i sum) {
+  return _mm256_min_epu8(sum, _mm256_sub_epi8(sum, _mm256_set1_epi8(27)));
+}
+
+__attribute__((target("avx2")))
+static void encryptAvx2(const char *text, const char *key, char *out, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i t = toValuesAvx2(_mm256_loadu_si256((const __m256i *) (text + i)));
+    __m256i k = toValuesAvx2(_mm256_loadu_si256((const __m256i *) (key + i)));
+    _mm256_storeu_si256((__m256i *) (out + i), toCharsAvx2(reduceAvx2(_mm256_add_epi8(t, k))));
+  }
+  encryptSse2(text + i, key + i, out + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void decryptAvx2(const char *text, const char *key, char *out, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i t = toValuesAvx2(_mm256_loadu_si256((const __m256i *) (text + i)));
+    __m256i k = toValuesAvx2(_mm256_loadu_si256((const __m256i *) (key + i)));
+    __m256i diff = _mm256_sub_epi8(_mm256_add_epi8(t, _mm256_set1_epi8(27)), k);
+    _mm256_storeu_si256((__m256i *) (out + i), toCharsAvx2(reduceAvx2(diff)));
+  }
+  decryptSse2(text + i, key + i, out + i, length - i);
+}
+
+static inline int avx2Supported(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+// -- AVX-512 Kernel (64 bytes per step, masked tail) --
+// ----------------------------------------------------------------------------------------------
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i toValuesAvx512(__m512i chars) {
+  return _mm512_min_epu8(_mm512_sub_epi8(chars, _mm512_set1_epi8('A')), _mm512_set1_epi8(26));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i toCharsAvx512(__m512i values) {
+  __mmask64 isSpace = _mm512_cmpeq_epi8_mask(values, _mm512_set1_epi8(26));
+  __m512i chars = _mm512_add_epi8(values, _mm512_set1_epi8('A'));
+  return _mm512_mask_mov_epi8(chars, isSpace, _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i reduceAvx512(__m512i sum) {
+  return _mm512_min_epu8(sum, _mm512_sub_epi8(sum, _mm512_set1_epi8(27)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void encryptAvx512(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i += 64) {
+    size_t left = length - i;
+    __mmask64 lanes = left >= 64 ? ~(__mmask64) 0 : (((__mmask64) 1 << left) - 1);
+    __m512i t = toValuesAvx512(_mm512_maskz_loadu_epi8(lanes, text + i));
+    __m512i k = toValuesAvx512(_mm512_maskz_loadu_epi8(lanes, key + i));
+    _mm512_mask_storeu_epi8(out + i, lanes, toCharsAvx512(reduceAvx512(_mm512_add_epi8(t, k))));
+  }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void decryptAvx512(const char *text, const char *key, char *out, size_t length) {
+  for (size_t i = 0; i < length; i += 64) {
+    size_t left = length - i;
+    __mmask64 lanes = left >= 64 ? ~(__mmask64) 0 : (((__mmask64) 1 << left) - 1);
+    __m512i t = toValuesAvx512(_mm512_maskz_loadu_epi8(lanes, text + i));
+    __m512i k = toValuesAvx512(_mm512_maskz_loadu_epi8(lanes, key + i));
+    __m512i diff = _mm512_sub_epi8(_mm512_add_epi8(t, _mm512_set1_epi8(27)), k);
+    _mm512_mask_storeu_epi8(out + i, lanes, toCharsAvx512(reduceAvx512(diff)));
+  }
+}
+
+static inline int avx512Supported(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+#endif
+
+// -- Dispatch --
+// ----------------------------------------------------------------------------------------------
+
+// Kernels in order of preference; the scalar kernel is always last and always available
+static const CipherImpl cipherImpls[] = {
+#ifdef OTP_CIPHER_X86
+  { "avx512", avx512Supported, encryptAvx512, decryptAvx512 },
+  { "avx2", avx2Supported, encryptAvx2, decryptAvx2 },
+  { "sse2", sse2Supported, encryptSse2, decryptSse2 },
+#endif
+  { "scalar", scalarSupported, encryptScalar, decryptScalar },
+};
+
+#define OTP_CIPHER_IMPL_COUNT (sizeof(cipherImpls) / sizeof(cipherImpls[0]))
+
+static const CipherImpl *activeCipher = NULL;
+
+// Function: Hold encryptScalarChecked() to the reference: the same output and 0 on valid input of
+// every length, and -1 with the same output for one bad byte in the text, in the key, or in the
+// last byte of the run. Returns 1 when it behaves
+static inline int checkedSelfTest(void) {
+  enum { TEST_SIZE = 100 };
+  char text[TEST_SIZE], key[TEST_SIZE], expected[TEST_SIZE], actual[TEST_SIZE];
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  // Just outside the alphabet on either side, lower case, newline and high bytes
+  static const char strays[] = { '@', '[', 'a', '\n', '\0', (char) 0x80, (char) 0xC1, (char) 0xFF };
+  static const size_t positions[] = { 0, TEST_SIZE / 2, TEST_SIZE - 1 };
+
+  for (size_t n = 0; n < TEST_SIZE; n++) {
+    text[n] = alphabet[n % 27];
+    key[n] = alphabet[(n * 7 + 3) % 27];
+  }
+  for (size_t length = 0; length <= TEST_SIZE; length++) {
+    encryptReference(text, key, expected, length);
+    if (encryptScalarChecked(text, key, actual, length) != 0 || memcmp(expected, actual, length) != 0) {
+      return 0;
+    }
+  }
+
+  for (size_t s = 0; s < sizeof(strays); s++) {
+    for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+      for (int inKey = 0; inKey < 2; inKey++) {
+        char *target = inKey ? key : text;
+        char saved = target[positions[p]];
+        target[positions[p]] = strays[s];
+        encryptReference(text, key, expected, TEST_SIZE);
+        int status = encryptScalarChecked(text, key, actual, TEST_SIZE);
+        target[positions[p]] = saved;
+        if (status != -1 || memcmp(expected, actual, TEST_SIZE) != 0) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// Function: Compare a kernel with the reference arithmetic over every value pair, arbitrary bytes,
+// and every tail length up to two 64-byte vectors. The scalar kernel's checked form is held to it
+// too. Returns 1 when they agree bit for bit
+static inline int cipherSelfTest(const CipherImpl *impl) {
+  enum { TEST_SIZE = 27 * 27 + 256 + 131 };
+  char text[TEST_SIZE], key[TEST_SIZE], expected[TEST_SIZE], actual[TEST_SIZE];
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+  // Every alphabet pair, then every raw byte, then a pseudo-random tail
+  size_t n = 0;
+  for (int a = 0; a < 27; a++) {
+    for (int b = 0; b < 27; b++, n++) {
+      text[n] = alphabet[a];
+      key[n] = alphabet[b];
+    }
+  }
+  for (int c = 0; c < 256; c++, n++) {
+    text[n] = (char) c;
+    key[n] = (char) (255 - c);
+  }
+  unsigned int seed = 2463534242u;
+  for (; n < TEST_SIZE; n++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    text[n] = alphabet[seed % 27];
+    key[n] = alphabet[(seed >> 8) % 27];
+  }
+
+  for (int direction = 0; direction < 2; direction++) {
+    CipherKernel reference = direction == 0 ? encryptReference : decryptReference;
+    CipherKernel candidate = direction == 0 ? impl->encrypt : impl->decrypt;
+
+    reference(text, key, expected, TEST_SIZE);
+    candidate(text, key, actual, TEST_SIZE);
+    if (memcmp(expected, actual, TEST_SIZE) != 0) {
+      return 0;
+    }
+
+    // Short lengths and odd offsets exercise the tail paths
+    for (size_t length = 0; length <= 128; length++) {
+      size_t offset = length % 7;
+      reference(text + offset, key + offset, expected, length);
+      candidate(text + offset, key + offset, actual, length);
+      if (memcmp(expected, actual, length) != 0) {
+        return 0;
+      }
+    }
+  }
+  return impl->encrypt != encryptScalar || checkedSelfTest();
+}
+
+// The last resort when even the scalar kernel fails its self test
+static const CipherImpl cipherReferenceImpl = {
+  "reference", scalarSupported, encryptReference, decryptReference
+};
+
+// Function: Pick the fastest kernel this CPU supports that passes the self test, falling back to
+// the reference arithmetic when none does. OTP_CIPHER=<name> in the environment restricts the
+// choice to that kernel (or scalar, then the reference)
+static inline const CipherImpl *initCipher(void) {
+  if (activeCipher != NULL) {
+    return activeCipher;
+  }
+
+  const char *forced = getenv("OTP_CIPHER");
+  const CipherImpl *chosen = &cipherReferenceImpl;
+
+  for (size_t i = 0; i < OTP_CIPHER_IMPL_COUNT; i++) {
+    const CipherImpl *impl = &cipherImpls[i];
+    // A forced kernel still falls back to scalar when it is missing or wrong
+    if (forced != NULL && strcmp(forced, impl->name) != 0 && i + 1 < OTP_CIPHER_IMPL_COUNT) {
+      continue;
+    }
+    if (!impl->supported()) {
+      continue;
+    }
+    if (!cipherSelfTest(impl)) {
+      fprintf(stderr, "CIPHER: %s kernel disagrees with the reference, skipping it\n", impl->name);
+      continue;
+    }
+    chosen = impl;
+    break;
+  }
+
+  activeCipher = chosen;
+  return activeCipher;
+}
+
+// Function: Encrypt with the selected kernel. `out` may alias `text`
+static inline void cipherEncrypt(const char *text, const char *key, char *out, size_t length) {
+  initCipher()->encrypt(text, key, out, length);
+}
+
+// Function: Decrypt with the selected kernel. `out` may alias `text`
+static inline void cipherDecrypt(const char *text, const char *key, char *out, size_t length) {
+  initCipher()->decrypt(text, key, out, length);
+}
+
+#define OTP_VERIFY_BLOCK 4096   // Round trip granule: text, ciphertext and check stay in L1
+
+// Function: Encrypt, and decrypt the ciphertext again to check it gives back the text, one
+// OTP_VERIFY_BLOCK at a time so the round trip never leaves L1. `out` gets the ciphertext and may
+// alias `text`. Returns the number of text bytes that did not come back; bytes other than A-Z and
+// space always count, since they encrypt as spaces
+static inline uint64_t cipherVerify(const char *text, const char *key, char *out, size_t length) {
+  char cipher[OTP_VERIFY_BLOCK], check[OTP_VERIFY_BLOCK];
+  uint64_t mismatches = 0;
+
+  for (size_t done = 0; done < length; done += OTP_VERIFY_BLOCK) {
+    size_t block = length - done < OTP_VERIFY_BLOCK ? length - done : OTP_VERIFY_BLOCK;
+    cipherEncrypt(text + done, key + done, cipher, block);
+    cipherDecrypt(cipher, key + done, check, block);
+    if (memcmp(check, text + done, block) != 0) {
+      for (size_t i = 0; i < block; i++) {
+        mismatches += check[i] != text[done + i];
+      }
+    }
+    memcpy(out + done, cipher, block);
+  }
+  return mismatches;
+}
+
+#endif
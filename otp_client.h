@@ -0,0 +1,1261 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "otp_proto.h"
+#include "otp_shm.h"
+#include "otp_pack.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Shared client-side helpers for enc_client / dec_client.
+//
+// A client run is a list of jobs (text file + key file). Against a framed
+// server the whole list goes over one connection as a pipelined session:
+// requests are written back to back while responses are read and printed in
+// order, one line per job, exactly as separate client runs would print them.
+// A job may name its operation (third manifest column "enc" or "dec"); servers
+// that offer both (otp_server) then run each request the way it asks. "verify"
+// encrypts and has the server check the ciphertext decrypts back to the text
+// (OTP_OP_VERIFY); a job that fails the check is reported once its
+// ciphertext has been printed.
+//
+// In place of a key file a job may name a pad registered on the server,
+// "pad:ID:OFFSET": the request then carries only the text, and the server keys
+// it with the pad bytes from OFFSET on (otp_pad.h).
+//
+// The server is a TCP port on localhost, or, for a server listening on a Unix
+// domain socket, "unix:PATH". "shm:PATH" connects the same way and, when the
+// server offers it, moves the payload through shared memory instead of the
+// socket (shmSession, otp_shm.h).
+//
+// With -c N the jobs are spread over a pool of N connections driven by one
+// epoll loop (poolSession), and -q caps how many requests are in flight across
+// them. With -o each job's output goes to its own file in a directory as soon
+// as its reply is complete.
+//
+// With -z, jobs go in the packed format (otp_pack.h) when the server offers it:
+// each chunk pair is packed into a small staging area just before it is sent,
+// and the packed reply is unpacked as it arrives. It cuts the bytes on the
+// wire to 5/8 for the cost of two kernel passes, which pays off over a real
+// network; pad jobs are sent as they are.
+//
+// Input files are mapped once (loadJob), validated and measured in a single
+// vectorized pass, and sent straight from the mapping with gathered writes:
+// no file is read into a staging buffer or copied into a combined message.
+
+typedef struct {
+  const char *textPath;
+  const char *keyPath;
+  int op;                  // OTP_OP_DEFAULT, or the operation the manifest asked for
+  const char *text;        // Mapped inputs, set by loadJob()
+  const char *key;
+  size_t textMapped;       // Mapping lengths, for unloadJob()
+  size_t keyMapped;
+  uint64_t textLength;     // Text up to its first newline
+  int outFD;               // Where streamSession() writes the reply, or -1 for its outFD
+  int usePad;              // keyPath is "pad:ID:OFFSET"
+  uint32_t padId;
+  uint64_t padOffset;
+  int packed;              // Sent and answered in the packed format (OTP_FLAG_PACKED)
+} StreamJob;
+
+// Client command line options, given before the jobs
+typedef struct {
+  int connections;         // -c: connections in the pool (1 without it)
+  size_t inFlight;         // -q: requests outstanding across them, 0 for no limit
+  const char *outDir;      // -o: one output file per job in this directory, NULL for stdout
+  int packed;              // -z: use the packed format when the server offers it
+} ClientOptions;
+
+#define OTP_SENDER_IOV 16   // Chunk pairs are queued eight at a time
+#define OTP_POOL_MAX_CONNECTIONS 64
+#define OTP_UNIX_PREFIX "unix:"
+#define OTP_SHM_PREFIX "shm:"
+
+// -- Command Line --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Print usage and exit
+static inline void clientUsage(const char *program, const char *textName) {
+  fprintf(stderr, "USAGE: %s [options] %s key [%s key ...] port\n", program, textName, textName);
+  fprintf(stderr, "       %s [options] -m manifest port   (manifest lines: %s key [enc|dec|verify])\n", program, textName);
+  fprintf(stderr, "  -c connections   spread the jobs over a pool of connections (needs -o)\n");
+  fprintf(stderr, "  -q requests      at most this many requests in flight\n");
+  fprintf(stderr, "  -o dir           write each job's output to dir/NAME, NAME being its %s's\n", textName);
+  fprintf(stderr, "  -z               send 5 bits a character when the server takes it\n");
+  fprintf(stderr, "  a key may be pad:ID:OFFSET, a pad registered on the server\n");
+  fprintf(stderr, "  port may be unix:PATH, a server's Unix socket, or shm:PATH to share memory with it\n");
+  exit(1);
+}
+
+// Function: Parse a "pad:ID:OFFSET" key reference. Returns 1 when `keyPath` is one, 0 when it is
+// a file name, -1 when it starts with "pad:" but is malformed
+static inline int parsePadKey(const char *keyPath, uint32_t *padId, uint64_t *padOffset) {
+  if (strncmp(keyPath, "pad:", 4) != 0) {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long id = strtoull(keyPath + 4, &end, 10);
+  if (end == keyPath + 4 || *end != ':' || id > UINT32_MAX) {
+    return -1;
+  }
+  const char *offsetStart = end + 1;
+  unsigned long long offset = strtoull(offsetStart, &end, 10);
+  if (end == offsetStart || *end != '\0' || errno != 0) {
+    return -1;
+  }
+  *padId = (uint32_t) id;
+  *padOffset = offset;
+  return 1;
+}
+
+// Function: Append one job, growing the array as needed
+static inline void addJob(StreamJob **jobs, size_t *jobCount, size_t *capacity,
+                          const char *textPath, const char *keyPath, int op) {
+  if (*jobCount == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 16;
+    *jobs = realloc(*jobs, *capacity * sizeof(StreamJob));
+    if (*jobs == NULL) {
+      perror("CLIENT: ERROR allocating jobs");
+      exit(1);
+    }
+  }
+  (*jobs)[*jobCount].textPath = textPath;
+  (*jobs)[*jobCount].keyPath = keyPath;
+  (*jobs)[*jobCount].op = op;
+  (*jobs)[*jobCount].text = NULL;
+  (*jobs)[*jobCount].key = NULL;
+  (*jobs)[*jobCount].textMapped = 0;
+  (*jobs)[*jobCount].keyMapped = 0;
+  (*jobs)[*jobCount].textLength = 0;
+  (*jobs)[*jobCount].outFD = -1;
+  (*jobs)[*jobCount].packed = 0;
+  (*jobs)[*jobCount].usePad = parsePadKey(keyPath, &(*jobs)[*jobCount].padId, &(*jobs)[*jobCount].padOffset);
+  if ((*jobs)[*jobCount].usePad < 0) {
+    fprintf(stderr, "Error: bad pad reference '%s' (expected pad:ID:OFFSET)\n", keyPath);
+    exit(1);
+  }
+  (*jobCount)++;
+}
+
+// Function: Read "text key [enc|dec|verify]" lines from a manifest; blank lines and '#' comments are skipped
+static inline void readManifest(const char *manifestPath, StreamJob **jobs, size_t *jobCount,
+                                size_t *capacity) {
+  FILE *manifest = fopen(manifestPath, "r");
+  if (manifest == NULL) {
+    fprintf(stderr, "Error: could not open manifest %s\n", manifestPath);
+    exit(1);
+  }
+
+  char line[8192];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), manifest) != NULL) {
+    lineNumber++;
+    char *textPath = strtok(line, " \t\r\n");
+    if (textPath == NULL || textPath[0] == '#') {
+      continue;
+    }
+    char *keyPath = strtok(NULL, " \t\r\n");
+    if (keyPath == NULL) {
+      fprintf(stderr, "Error: %s line %d needs a text file and a key file\n", manifestPath, lineNumber);
+      exit(1);
+    }
+    char *opName = strtok(NULL, " \t\r\n");
+    int op = OTP_OP_DEFAULT;
+    if (opName != NULL && strcmp(opName, "enc") == 0) {
+      op = OTP_OP_ENCRYPT;
+    } else if (opName != NULL && strcmp(opName, "dec") == 0) {
+      op = OTP_OP_DECRYPT;
+    } else if (opName != NULL && strcmp(opName, "verify") == 0) {
+      op = OTP_OP_VERIFY;
+    } else if (opName != NULL) {
+      fprintf(stderr, "Error: %s line %d: operation must be enc, dec or verify\n", manifestPath, lineNumber);
+      exit(1);
+    }
+    addJob(jobs, jobCount, capacity, strdup(textPath), strdup(keyPath), op);
+  }
+  fclose(manifest);
+}
+
+// Function: Parse `[options] text key [text key ...] port` or `[options] -m manifest port` into a
+// job list. The port is returned as given, since it may be a unix: or shm: endpoint
+static inline void parseClientArgs(int argc, char *argv[], const char *textName, StreamJob **jobs,
+                                   size_t *jobCount, ClientOptions *options, const char **endpoint) {
+  size_t capacity = 0;
+  *jobs = NULL;
+  *jobCount = 0;
+  options->connections = 1;
+  options->inFlight = 0;
+  options->outDir = NULL;
+  options->packed = 0;
+
+  int first = 1;
+  while (first + 1 < argc) {
+    if (strcmp(argv[first], "-z") == 0) {
+      options->packed = 1;
+      first++;
+      continue;
+    }
+    if (strcmp(argv[first], "-c") == 0) {
+      options->connections = atoi(argv[first + 1]);
+      if (options->connections <= 0 || options->connections > OTP_POOL_MAX_CONNECTIONS) {
+        fprintf(stderr, "Error: -c takes 1 to %d connections\n", OTP_POOL_MAX_CONNECTIONS);
+        exit(1);
+      }
+    } else if (strcmp(argv[first], "-q") == 0) {
+      options->inFlight = strtoul(argv[first + 1], NULL, 10);
+    } else if (strcmp(argv[first], "-o") == 0) {
+      options->outDir = argv[first + 1];
+    } else {
+      break;
+    }
+    first += 2;
+  }
+  if (options->connections > 1 && options->outDir == NULL) {
+    fprintf(stderr, "Error: -c needs -o, since replies on a pool complete out of order\n");
+    exit(1);
+  }
+
+  int remaining = argc - first;
+  if (remaining == 3 && strcmp(argv[first], "-m") == 0) {
+    readManifest(argv[first + 1], jobs, jobCount, &capacity);
+  } else if (remaining >= 3 && remaining % 2 == 1) {
+    for (int i = first; i + 1 < argc - 1; i += 2) {
+      addJob(jobs, jobCount, &capacity, argv[i], argv[i + 1], OTP_OP_DEFAULT);
+    }
+  } else {
+    clientUsage(argv[0], textName);
+  }
+
+  if (*jobCount == 0) {
+    fprintf(stderr, "Error: nothing to do\n");
+    exit(1);
+  }
+  *endpoint = argv[argc - 1];
+}
+
+// -- Endpoints --
+// ----------------------------------------------------------------------------------------------
+
+// Function: The socket path of a "unix:PATH" or "shm:PATH" endpoint, with *sharedMemory set for
+// shm:. Returns NULL for a TCP port
+static inline const char *localEndpointPath(const char *endpoint, int *sharedMemory) {
+  *sharedMemory = strncmp(endpoint, OTP_SHM_PREFIX, strlen(OTP_SHM_PREFIX)) == 0;
+  if (*sharedMemory) {
+    return endpoint + strlen(OTP_SHM_PREFIX);
+  }
+  if (strncmp(endpoint, OTP_UNIX_PREFIX, strlen(OTP_UNIX_PREFIX)) == 0) {
+    return endpoint + strlen(OTP_UNIX_PREFIX);
+  }
+  return NULL;
+}
+
+// Function: Connect to a server's Unix domain socket. Returns the socket, or -1 on error
+static inline int connectUnixSocket(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socketFD < 0) {
+    return -1;
+  }
+  if (connect(socketFD, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(socketFD);
+    return -1;
+  }
+  return socketFD;
+}
+
+#define OTP_HANDSHAKE_BUSY (-2)   // clientHandshake(): the server is at its connection limit
+
+// Function: Send our identifier, asking for the framed protocol, and check the reply names
+// `serverType`. Returns 1 for a framed server, with *serverOps set to the operations it lists (0
+// when it lists none), 0 for an older server that answered without the suffix, OTP_HANDSHAKE_BUSY
+// when it turned us away, or -1 when the exchange failed or another server answered
+static inline int clientHandshake(int socketFD, const char *clientType, const char *serverType,
+                                  unsigned *serverOps) {
+  char request[16];
+  char reply[OTP_HANDSHAKE_SIZE];
+  memset(reply, '\0', sizeof(reply));
+  snprintf(request, sizeof(request), "%s%s", clientType, OTP_VERSION_SUFFIX);
+  if (sendAll(socketFD, request, strlen(request)) < 0 || recv(socketFD, reply, sizeof(reply) - 1, 0) <= 0) {
+    return -1;
+  }
+
+  // A server at its connection limit turns us away before the handshake
+  if (strcmp(reply, OTP_BUSY_REPLY) == 0) {
+    return OTP_HANDSHAKE_BUSY;
+  }
+  size_t expectedLength = strlen(serverType);
+  if (strncmp(reply, serverType, expectedLength) != 0) {
+    return -1;
+  }
+
+  // Older servers answer without the suffix; servers offering more than the default operation
+  // list them after it ("ENC_SERVER/2:ED")
+  const char *suffix = reply + expectedLength;
+  size_t suffixLength = strlen(OTP_VERSION_SUFFIX);
+  int framed = strncmp(suffix, OTP_VERSION_SUFFIX, suffixLength) == 0 &&
+               (suffix[suffixLength] == '\0' || suffix[suffixLength] == ':');
+  *serverOps = framed ? parseServerOps(suffix) : 0;
+  return framed;
+}
+
+// Function: clientHandshake() for the clients, which exit with status 2 when the server cannot be
+// used. Returns 1 when it accepted the framed protocol, 0 when it only speaks the original newline
+// protocol. `serverOps` gets the (1 << op) mask of operations it will run, `defaultOp` alone when
+// it lists none
+static inline int performHandshake(int socketFD, const char *clientType, const char *serverType,
+                                   const char *port, int defaultOp, unsigned *serverOps) {
+  int framed = clientHandshake(socketFD, clientType, serverType, serverOps);
+  if (framed == OTP_HANDSHAKE_BUSY) {
+    fprintf(stderr, "Error: %s on port %s is busy, try again later\n", serverType, port);
+  } else if (framed < 0) {
+    fprintf(stderr, "Error: could not contact %s on port %s\n", serverType, port);
+  }
+  if (framed < 0) {
+    close(socketFD);
+    exit(2);  // Exit with status 2 as required
+  }
+  if (*serverOps == 0) {
+    *serverOps = 1u << defaultOp;
+  }
+  return framed;
+}
+
+// Function: Check that the server offers every operation the jobs ask for. `serverOps` is the
+// (1 << op) mask from its handshake, with OTP_SERVER_PADS when it has pads. Returns 0 when it
+// does, -1 after naming the first job it cannot run
+static inline int checkJobOps(const StreamJob *jobs, size_t jobCount, unsigned serverOps) {
+  for (size_t i = 0; i < jobCount; i++) {
+    if (jobs[i].usePad && !(serverOps & OTP_SERVER_PADS)) {
+      fprintf(stderr, "Error: server has no pads for %s\n", jobs[i].textPath);
+      return -1;
+    }
+    if (jobs[i].op != OTP_OP_DEFAULT && !(serverOps & (1u << jobs[i].op))) {
+      fprintf(stderr, "Error: server cannot %s %s\n", otpOpName(jobs[i].op), jobs[i].textPath);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function: Send every job that can go packed (all but pad jobs) in the packed format, when the
+// server offers it ('C')
+static inline void usePackedFormat(StreamJob *jobs, size_t jobCount, unsigned serverOps) {
+  for (size_t i = 0; i < jobCount; i++) {
+    jobs[i].packed = (serverOps & OTP_SERVER_PACKED) && !jobs[i].usePad;
+  }
+}
+
+// -- Input Files --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Map a whole file read-only. An empty file maps to NULL with length 0. Returns 0 on
+// success, -1 when the file cannot be opened or mapped
+static inline int mapFile(const char *path, const char **data, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  *length = info.st_size;
+  *data = NULL;
+  if (*length > 0) {
+    void *mapping = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(mapping, *length, MADV_SEQUENTIAL);
+    *data = mapping;
+  }
+  close(fd);  // The mapping stays valid without the descriptor
+  return 0;
+}
+
+// Function: Is `c` allowed in a plaintext file (A-Z, space, newline)
+static inline int isTextChar(unsigned char c) {
+  return (unsigned char) (c - 'A') < 26 || c == ' ' || c == '\n';
+}
+
+// Function: Find the end of the first line and, when `validate` is set, check every byte of
+// the file is A-Z, space or newline, both in one pass (16 bytes at a time with SSE2). Sets
+// *lineLength to the bytes before the first newline. Returns 0, or -1 on a bad character
+static inline int scanInput(const char *data, size_t length, int validate, size_t *lineLength) {
+  size_t line = length;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  // (c - 'A') < 26 unsigned, done as a signed compare after flipping the sign bit
+  const __m128i toLetter = _mm_set1_epi8((char) (0x80 - 'A'));
+  const __m128i letterLimit = _mm_set1_epi8((char) (0x80 + 26));
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i isNewline = _mm_cmpeq_epi8(bytes, newline);
+
+    if (line == length) {
+      int newlineMask = _mm_movemask_epi8(isNewline);
+      if (newlineMask != 0) {
+        line = i + __builtin_ctz(newlineMask);
+        if (!validate) {
+          break;
+        }
+      }
+    }
+    if (validate) {
+      __m128i isLetter = _mm_cmplt_epi8(_mm_add_epi8(bytes, toLetter), letterLimit);
+      __m128i allowed = _mm_or_si128(_mm_or_si128(isLetter, isNewline), _mm_cmpeq_epi8(bytes, space));
+      if (_mm_movemask_epi8(allowed) != 0xFFFF) {
+        return -1;
+      }
+    }
+  }
+  if (line != length && !validate) {
+    *lineLength = line;
+    return 0;
+  }
+#endif
+
+  for (; i < length; i++) {
+    unsigned char c = data[i];
+    if (c == '\n' && line == length) {
+      line = i;
+      if (!validate) {
+        break;
+      }
+    }
+    if (validate && !isTextChar(c)) {
+      return -1;
+    }
+  }
+  *lineLength = line;
+  return 0;
+}
+
+// Function: Release a job's mappings
+static inline void unloadJob(StreamJob *job) {
+  if (job->text != NULL) {
+    munmap((void *) job->text, job->textMapped);
+  }
+  if (job->key != NULL) {
+    munmap((void *) job->key, job->keyMapped);
+  }
+  job->text = NULL;
+  job->key = NULL;
+}
+
+// Function: Map a job's files, validate the text when asked and check the key covers it. A pad
+// job has no key file; the server checks its range. Returns 0, or -1 after printing a message
+// naming the file and releasing the mappings
+static inline int mapJob(StreamJob *job, int validateText) {
+  size_t textLength;
+  job->text = job->key = NULL;
+  if (mapFile(job->textPath, &job->text, &job->textMapped) < 0) {
+    fprintf(stderr, "Error: could not open file %s\n", job->textPath);
+    return -1;
+  }
+  if (job->usePad) {
+    if (scanInput(job->text, job->textMapped, validateText, &textLength) < 0) {
+      fprintf(stderr, "ERROR: input contains bad characters in %s\n", job->textPath);
+      unloadJob(job);
+      return -1;
+    }
+    job->textLength = textLength;
+    return 0;
+  }
+  if (mapFile(job->keyPath, &job->key, &job->keyMapped) < 0) {
+    fprintf(stderr, "Error: could not open file %s\n", job->keyPath);
+    unloadJob(job);
+    return -1;
+  }
+
+  if (scanInput(job->text, job->textMapped, validateText, &textLength) < 0) {
+    fprintf(stderr, "ERROR: input contains bad characters in %s\n", job->textPath);
+    unloadJob(job);
+    return -1;
+  }
+
+  // Only the key bytes that pair with the text matter; they must all be on its first line
+  if (job->keyMapped < textLength || (textLength > 0 && memchr(job->key, '\n', textLength) != NULL)) {
+    fprintf(stderr, "Error: key '%s' is too short\n", job->keyPath);
+    unloadJob(job);
+    return -1;
+  }
+  job->textLength = textLength;
+  return 0;
+}
+
+// Function: mapJob() for the clients, which check every pair before sending anything and
+// exit on the first problem
+static inline void loadJob(StreamJob *job, int validateText) {
+  if (mapJob(job, validateText) < 0) {
+    exit(1);
+  }
+}
+
+// -- Output Files --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Path of a job's output file: outdir/ plus the text file's name. The caller frees it
+static inline char *outputPath(const char *outDir, const char *textPath) {
+  const char *slash = strrchr(textPath, '/');
+  const char *name = slash != NULL ? slash + 1 : textPath;
+  size_t pathSize = strlen(outDir) + strlen(name) + 2;
+  char *path = malloc(pathSize);
+  if (path != NULL) {
+    snprintf(path, pathSize, "%s/%s", outDir, name);
+  }
+  return path;
+}
+
+// Function: Create a job's output file in `outDir` and make it the job's outFD. Returns 0, or -1
+// after naming the file that could not be written
+static inline int openJobOutput(StreamJob *job, const char *outDir) {
+  char *path = outputPath(outDir, job->textPath);
+  job->outFD = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+  if (job->outFD < 0) {
+    fprintf(stderr, "Error: could not write %s\n", path != NULL ? path : job->textPath);
+  }
+  free(path);
+  return job->outFD < 0 ? -1 : 0;
+}
+
+// Function: For the clients' -o: create `outDir` if needed and an output file for every job,
+// exiting on the first that fails
+static inline void openJobOutputs(StreamJob *jobs, size_t jobCount, const char *outDir) {
+  if (mkdir(outDir, 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error: could not create %s\n", outDir);
+    exit(1);
+  }
+  for (size_t i = 0; i < jobCount; i++) {
+    if (openJobOutput(&jobs[i], outDir) < 0) {
+      exit(1);
+    }
+  }
+}
+
+// -- Pipelined Session --
+// ----------------------------------------------------------------------------------------------
+
+typedef struct {
+  size_t job;              // Job whose bytes are being sent
+  int started;             // Its header has been queued
+  uint64_t nextOffset;     // Next text offset to queue
+  unsigned char header[OTP_HEADER_SIZE];
+  struct iovec vector[OTP_SENDER_IOV];
+  struct iovec *pending;   // Unsent part of `vector`
+  int pendingCount;
+  unsigned char *stage;    // Packed chunk pairs, one slot per pair the vector holds
+} SessionSender;
+
+// Function: Give a sender its packing stage when any of the jobs it may get is packed. Returns 0,
+// or -1 when it cannot be allocated
+static inline int prepareSender(SessionSender *sender, const StreamJob *jobs, size_t jobCount) {
+  for (size_t i = 0; i < jobCount && sender->stage == NULL; i++) {
+    if (jobs[i].packed) {
+      sender->stage = malloc(OTP_SENDER_IOV * (size_t) OTP_PACKED_CHUNK_SIZE);
+      return sender->stage != NULL ? 0 : -1;
+    }
+  }
+  return 0;
+}
+
+// Function: Queue the next bytes of the session once everything queued has been sent: the
+// current job's header and/or its next chunk pairs, pointing straight into the mapped files. A
+// packed job's pairs are packed into the stage instead, which is only refilled once all of it has
+// been sent
+static inline void refillSender(SessionSender *sender, StreamJob *jobs, size_t jobCount) {
+  while (sender->pendingCount == 0 && sender->job < jobCount) {
+    StreamJob *job = &jobs[sender->job];
+    sender->pending = sender->vector;
+
+    // Start the job with its request header; its first chunks go out in the same write. A pad
+    // job names its pad and offset instead of sending a key
+    if (!sender->started) {
+      FrameHeader request = { OTP_PROTO_VERSION, OTP_MSG_REQUEST, (uint16_t) job->op, 0,
+                              job->textLength, job->textLength };
+      if (job->usePad) {
+        request.flags |= OTP_FLAG_PAD;
+        request.reserved = job->padId;
+        request.keyLength = job->padOffset;
+      } else if (job->packed) {
+        request.flags |= OTP_FLAG_PACKED;
+      }
+      encodeHeader(&request, sender->header);
+      sender->vector[0].iov_base = sender->header;
+      sender->vector[0].iov_len = OTP_HEADER_SIZE;
+      sender->pendingCount = 1;
+      sender->started = 1;
+      sender->nextOffset = 0;
+    }
+
+    // Text chunk followed by its key chunk, as many pairs as the vector holds
+    while (sender->nextOffset < job->textLength && sender->pendingCount + 2 <= OTP_SENDER_IOV) {
+      uint64_t remaining = job->textLength - sender->nextOffset;
+      size_t length = remaining < OTP_CHUNK_SIZE ? (size_t) remaining : OTP_CHUNK_SIZE;
+      struct iovec *pair = sender->vector + sender->pendingCount;
+      if (job->packed) {
+        unsigned char *slot = sender->stage + (size_t) (sender->pendingCount / 2) * 2 * OTP_PACKED_CHUNK_SIZE;
+        size_t packedBytes = packedLength(length);
+        packSymbols(job->text + sender->nextOffset, length, slot);
+        packSymbols(job->key + sender->nextOffset, length, slot + packedBytes);
+        pair[0].iov_base = slot;
+        pair[0].iov_len = packedBytes;
+        pair[1].iov_base = slot + packedBytes;
+        pair[1].iov_len = packedBytes;
+        sender->pendingCount += 2;
+        sender->nextOffset += length;
+        continue;
+      }
+      pair[0].iov_base = (char *) job->text + sender->nextOffset;
+      pair[0].iov_len = length;
+      sender->pendingCount++;
+      if (!job->usePad) {
+        pair[1].iov_base = (char *) job->key + sender->nextOffset;
+        pair[1].iov_len = length;
+        sender->pendingCount++;
+      }
+      sender->nextOffset += length;
+    }
+    if (sender->pendingCount > 0) {
+      return;
+    }
+
+    // Job fully sent
+    sender->started = 0;
+    sender->job++;
+  }
+}
+
+typedef struct {
+  size_t job;              // Job whose reply is being received
+  unsigned char header[OTP_HEADER_SIZE];
+  size_t headerReceived;
+  uint64_t bodyRemaining;
+  int isError;             // The body is the reason from an error frame
+  char reason[OTP_MAX_ERROR_LENGTH];
+  size_t reasonLength;
+  unsigned char trailer[OTP_VERIFY_TRAILER_SIZE];
+  size_t trailerLength;    // Announced by the response header (verify replies)
+  size_t trailerReceived;
+  size_t verifyFailures;   // Verify replies whose trailer reported a failed round trip
+  int packed;              // The body is packed (OTP_FLAG_PACKED)
+  uint64_t symbolsRemaining;
+  unsigned char group[OTP_PACK_GROUP_BYTES];   // A packed group split across reads
+  size_t groupFilled;
+} SessionReceiver;
+
+// Function: Unpack body bytes of a packed reply to the job's output: whole groups straight from
+// `data`, a block at a time, and a group split across reads once it is complete. Returns 0, or -1
+// on a write error
+static inline int writeUnpacked(SessionReceiver *receiver, const unsigned char *data, size_t length, int jobFD) {
+  char chars[OTP_PACK_BLOCK];
+  while (length > 0) {
+    size_t groupBytes = (size_t) packedLength(receiver->symbolsRemaining < OTP_PACK_GROUP
+                                              ? receiver->symbolsRemaining : OTP_PACK_GROUP);
+    if (receiver->groupFilled > 0 || length < groupBytes) {
+      size_t take = groupBytes - receiver->groupFilled < length ? groupBytes - receiver->groupFilled : length;
+      memcpy(receiver->group + receiver->groupFilled, data, take);
+      receiver->groupFilled += take;
+      data += take;
+      length -= take;
+      if (receiver->groupFilled < groupBytes) {
+        break;
+      }
+      size_t symbols = receiver->symbolsRemaining < OTP_PACK_GROUP ? (size_t) receiver->symbolsRemaining : OTP_PACK_GROUP;
+      unpackSymbols(receiver->group, symbols, chars);
+      receiver->symbolsRemaining -= symbols;
+      receiver->groupFilled = 0;
+      if (writeAll(jobFD, chars, symbols) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    // Whole groups, or the rest of the body when all of it is here
+    uint64_t symbols = length / OTP_PACK_GROUP_BYTES * OTP_PACK_GROUP;
+    if (packedLength(receiver->symbolsRemaining) <= length || symbols > receiver->symbolsRemaining) {
+      symbols = receiver->symbolsRemaining;
+    }
+    symbols = symbols < OTP_PACK_BLOCK ? symbols : OTP_PACK_BLOCK;
+    unpackSymbols(data, (size_t) symbols, chars);
+    receiver->symbolsRemaining -= symbols;
+    data += packedLength(symbols);
+    length -= packedLength(symbols);
+    if (writeAll(jobFD, chars, (size_t) symbols) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function: Walk the reply frames in `length` received bytes, however they are split: header
+// bytes are collected, body bytes go straight to the job's output (unpacked first when the reply
+// is packed), a verify reply's trailer is checked, and each completed reply gets its newline. Returns 0, or -1 on a write error or an
+// error frame (after printing its reason)
+static inline int consumeReplies(SessionReceiver *receiver, const char *data, size_t length,
+                                 const StreamJob *jobs, size_t jobCount, int outFD) {
+  while (length > 0 && receiver->job < jobCount) {
+    int jobFD = jobs[receiver->job].outFD >= 0 ? jobs[receiver->job].outFD : outFD;
+
+    if (receiver->headerReceived < OTP_HEADER_SIZE) {
+      size_t take = OTP_HEADER_SIZE - receiver->headerReceived;
+      take = take < length ? take : length;
+      memcpy(receiver->header + receiver->headerReceived, data, take);
+      receiver->headerReceived += take;
+      data += take;
+      length -= take;
+      if (receiver->headerReceived < OTP_HEADER_SIZE) {
+        break;
+      }
+
+      // Keep an error frame's reason to report; anything else unexpected just ends the session
+      FrameHeader response;
+      decodeHeader(receiver->header, &response);
+      receiver->isError = response.type == OTP_MSG_ERROR && response.textLength < OTP_MAX_ERROR_LENGTH;
+      receiver->reasonLength = 0;
+      if (!receiver->isError && (response.version != OTP_PROTO_VERSION || response.type != OTP_MSG_RESPONSE ||
+                                 response.keyLength > OTP_VERIFY_TRAILER_SIZE)) {
+        return -1;
+      }
+      receiver->packed = !receiver->isError && (response.flags & OTP_FLAG_PACKED);
+      receiver->bodyRemaining = receiver->packed ? packedLength(response.textLength) : response.textLength;
+      receiver->symbolsRemaining = response.textLength;
+      receiver->groupFilled = 0;
+      receiver->trailerLength = receiver->isError ? 0 : (size_t) response.keyLength;
+      receiver->trailerReceived = 0;
+    }
+
+    size_t take = receiver->bodyRemaining < length ? (size_t) receiver->bodyRemaining : length;
+    if (receiver->isError) {
+      memcpy(receiver->reason + receiver->reasonLength, data, take);
+      receiver->reasonLength += take;
+    } else if (receiver->packed) {
+      if (writeUnpacked(receiver, (const unsigned char *) data, take, jobFD) < 0) {
+        return -1;
+      }
+    } else if (take > 0 && writeAll(jobFD, data, take) < 0) {
+      return -1;
+    }
+    data += take;
+    length -= take;
+    receiver->bodyRemaining -= take;
+
+    // The trailer follows the body
+    if (receiver->bodyRemaining == 0 && receiver->trailerReceived < receiver->trailerLength) {
+      take = receiver->trailerLength - receiver->trailerReceived;
+      take = take < length ? take : length;
+      memcpy(receiver->trailer + receiver->trailerReceived, data, take);
+      receiver->trailerReceived += take;
+      data += take;
+      length -= take;
+      if (receiver->trailerReceived < receiver->trailerLength) {
+        break;
+      }
+    }
+
+    // Reply complete: finish its line and move on to the next job's
+    if (receiver->bodyRemaining == 0) {
+      if (receiver->isError) {
+        fprintf(stderr, "SERVER ERROR: %.*s\n", (int) receiver->reasonLength, receiver->reason);
+        return -1;
+      }
+      if (writeAll(jobFD, "\n", 1) < 0) {
+        return -1;
+      }
+      if (receiver->trailerLength == OTP_VERIFY_TRAILER_SIZE && getUint64(receiver->trailer) > 0) {
+        fprintf(stderr, "Error: %s failed verification, %llu bytes did not survive the round trip\n",
+                jobs[receiver->job].textPath, (unsigned long long) getUint64(receiver->trailer));
+        receiver->verifyFailures++;
+      }
+      receiver->headerReceived = 0;
+      receiver->job++;
+    }
+  }
+  return 0;
+}
+
+// Function: Run every job over one framed connection. Requests are written back to back without
+// waiting for replies; replies are copied in order to their job's outFD, or to `outFD` for jobs
+// without one, each followed by a newline. Replies are read a chunk at a time, so many small
+// ones cost a single recv. Sending and receiving are interleaved with poll() so neither side can
+// stall on a full socket buffer. Returns the number of verify jobs that failed their check (0 when
+// every reply is good), or -1 on error
+static inline int streamSession(int socketFD, StreamJob *jobs, size_t jobCount, int outFD) {
+  SessionSender sender;
+  memset(&sender, 0, sizeof(sender));
+  char *recvBuffer = malloc(OTP_CHUNK_SIZE);
+  if (recvBuffer == NULL || prepareSender(&sender, jobs, jobCount) < 0) {
+    free(recvBuffer);
+    return -1;
+  }
+
+  SessionReceiver receiver;
+  memset(&receiver, 0, sizeof(receiver));
+  int sendClosed = 0;
+  int status = 0;
+
+  while (receiver.job < jobCount) {
+    refillSender(&sender, jobs, jobCount);
+
+    // Tell the server no more requests are coming once the last one is out
+    if (!sendClosed && sender.job == jobCount) {
+      shutdown(socketFD, SHUT_WR);
+      sendClosed = 1;
+    }
+
+    struct pollfd pollSocket = { .fd = socketFD, .events = POLLIN };
+    if (sender.pendingCount > 0) {
+      pollSocket.events |= POLLOUT;
+    }
+    if (poll(&pollSocket, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status = -1;
+      break;
+    }
+
+    if (pollSocket.revents & POLLOUT) {
+      struct msghdr message = { .msg_iov = sender.pending, .msg_iovlen = sender.pendingCount };
+      ssize_t sentAmount = sendmsg(socketFD, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sentAmount < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        status = -1;
+        break;
+      }
+      if (sentAmount > 0) {
+        sender.pending = advanceVector(sender.pending, &sender.pendingCount, sentAmount);
+      }
+    }
+
+    if (!(pollSocket.revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+
+    ssize_t charsRead = recv(socketFD, recvBuffer, OTP_CHUNK_SIZE, MSG_DONTWAIT);
+    if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      continue;
+    }
+    if (charsRead <= 0 || consumeReplies(&receiver, recvBuffer, charsRead, jobs, jobCount, outFD) < 0) {
+      status = -1;
+      break;
+    }
+  }
+
+  free(sender.stage);
+  free(recvBuffer);
+  return status < 0 ? -1 : (int) receiver.verifyFailures;
+}
+
+// -- Connection Pool --
+// ----------------------------------------------------------------------------------------------
+
+#define OTP_POOL_EVENTS 64
+
+typedef struct {
+  int fd;
+  StreamJob *jobs;         // Jobs handed to this connection, in the order they go out
+  size_t assigned;
+  SessionSender sender;
+  SessionReceiver receiver;
+  int sendClosed;
+} PoolConnection;
+
+// Function: Send what a pool connection has queued until it is all out or the socket is full; the
+// next EPOLLOUT edge picks up from there. Returns 0, or -1 on error
+static inline int pumpPoolSends(PoolConnection *conn) {
+  while (1) {
+    refillSender(&conn->sender, conn->jobs, conn->assigned);
+    if (conn->sender.pendingCount == 0) {
+      return 0;
+    }
+    struct msghdr message = { .msg_iov = conn->sender.pending, .msg_iovlen = conn->sender.pendingCount };
+    ssize_t sentAmount = sendmsg(conn->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sentAmount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    conn->sender.pending = advanceVector(conn->sender.pending, &conn->sender.pendingCount, sentAmount);
+  }
+}
+
+// Function: Read every reply byte a pool connection has waiting and hand it to its receiver.
+// Returns 0, or -1 on error or when the server closes with replies outstanding
+static inline int pumpPoolReplies(PoolConnection *conn, char *buffer, int outFD) {
+  while (conn->receiver.job < conn->assigned) {
+    ssize_t charsRead = recv(conn->fd, buffer, OTP_CHUNK_SIZE, MSG_DONTWAIT);
+    if (charsRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (charsRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (charsRead <= 0 || consumeReplies(&conn->receiver, buffer, charsRead, conn->jobs, conn->assigned, outFD) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function: Hand out jobs while fewer than `maxInFlight` are unanswered, each to the connection
+// with the fewest outstanding
+static inline void assignPoolJobs(PoolConnection *pool, int connectionCount, const StreamJob *jobs,
+                                  size_t jobCount, size_t *nextJob, size_t maxInFlight) {
+  while (*nextJob < jobCount) {
+    size_t inFlight = 0;
+    int idlest = 0;
+    for (int i = 0; i < connectionCount; i++) {
+      size_t outstanding = pool[i].assigned - pool[i].receiver.job;
+      inFlight += outstanding;
+      if (outstanding < pool[idlest].assigned - pool[idlest].receiver.job) {
+        idlest = i;
+      }
+    }
+    if (inFlight >= maxInFlight) {
+      return;
+    }
+    pool[idlest].jobs[pool[idlest].assigned++] = jobs[(*nextJob)++];
+  }
+}
+
+// Function: Run the jobs over a pool of framed connections from one thread. The sockets are made
+// non-blocking and watched by an edge-triggered epoll set. A job goes to the connection with the
+// fewest requests outstanding once fewer than `maxInFlight` (0 for no limit) are unanswered in
+// total, so a slow reply holds up only its own connection. Each connection pipelines its jobs
+// like streamSession() and gets its write side shut once the last job is handed out. Replies on
+// different connections complete in any order, so only jobs with an outFD of their own can be
+// spread: when any job would write to the shared `outFD`, everything runs on the first socket.
+// The caller closes the sockets. Returns the number of verify jobs that failed their check, or -1
+// on error
+static inline int poolSession(const int *sockets, int connectionCount, StreamJob *jobs, size_t jobCount,
+                              size_t maxInFlight, int outFD) {
+  if (jobCount == 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < jobCount && connectionCount > 1; i++) {
+    if (jobs[i].outFD < 0) {
+      connectionCount = 1;
+    }
+  }
+  if (connectionCount > OTP_POOL_MAX_CONNECTIONS) {
+    connectionCount = OTP_POOL_MAX_CONNECTIONS;
+  }
+  maxInFlight = maxInFlight > 0 ? maxInFlight : jobCount;
+
+  PoolConnection *pool = calloc(connectionCount, sizeof(PoolConnection));
+  char *recvBuffer = malloc(OTP_CHUNK_SIZE);
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  int status = pool != NULL && recvBuffer != NULL && epollFD >= 0 ? 0 : -1;
+
+  for (int i = 0; status == 0 && i < connectionCount; i++) {
+    pool[i].fd = sockets[i];
+    pool[i].jobs = malloc(jobCount * sizeof(StreamJob));
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = &pool[i] };
+    if (pool[i].jobs == NULL || prepareSender(&pool[i].sender, jobs, jobCount) < 0 || fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK) < 0 ||
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, sockets[i], &event) < 0) {
+      status = -1;
+    }
+  }
+
+  size_t nextJob = 0;
+  while (status == 0) {
+    // ** Hand out what the in-flight limit allows and start sending it **
+    assignPoolJobs(pool, connectionCount, jobs, jobCount, &nextJob, maxInFlight);
+    size_t answered = 0;
+    for (int i = 0; status == 0 && i < connectionCount; i++) {
+      PoolConnection *conn = &pool[i];
+      status = pumpPoolSends(conn);
+
+      // Nothing more will come for this connection once every job is handed out and sent
+      if (nextJob == jobCount && !conn->sendClosed && conn->sender.job == conn->assigned) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->sendClosed = 1;
+      }
+      answered += conn->receiver.job;
+    }
+    if (status < 0 || answered == jobCount) {
+      break;
+    }
+
+    // ** Wait for room to send or replies to read **
+    struct epoll_event events[OTP_POOL_EVENTS];
+    int ready = epoll_wait(epollFD, events, OTP_POOL_EVENTS, -1);
+    if (ready < 0 && errno != EINTR) {
+      status = -1;
+    }
+    for (int i = 0; status == 0 && i < ready; i++) {
+      PoolConnection *conn = events[i].data.ptr;
+      if ((events[i].events & EPOLLOUT) && pumpPoolSends(conn) < 0) {
+        status = -1;
+      }
+      if (status == 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+          pumpPoolReplies(conn, recvBuffer, outFD) < 0) {
+        status = -1;
+      }
+    }
+  }
+
+  int verifyFailures = 0;
+  for (int i = 0; pool != NULL && i < connectionCount; i++) {
+    verifyFailures += (int) pool[i].receiver.verifyFailures;
+    free(pool[i].jobs);
+    free(pool[i].sender.stage);
+  }
+  if (epollFD >= 0) {
+    close(epollFD);
+  }
+  free(recvBuffer);
+  free(pool);
+  return status < 0 ? -1 : verifyFailures;
+}
+
+// -- Shared Memory Session --
+// ----------------------------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t textOffset;     // Where the job's text sits in the ring; its key follows it
+  uint64_t reserved;       // Ring bytes it holds, including any gap skipped to wrap
+} SharedSlot;
+
+// Function: Can the jobs go through shared memory: the server offers it ('M') and no job keys
+// from a pad, which shared memory requests cannot name
+static inline int sharedMemoryUsable(const StreamJob *jobs, size_t jobCount, unsigned serverOps) {
+  if (!(serverOps & OTP_SERVER_SHM)) {
+    return 0;
+  }
+  for (size_t i = 0; i < jobCount; i++) {
+    if (jobs[i].usePad) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Function: Print the reason of an error frame whose header has been read
+static inline void reportErrorFrame(int socketFD, const FrameHeader *response) {
+  char reason[OTP_MAX_ERROR_LENGTH];
+  size_t length = response->textLength < sizeof(reason) ? (size_t) response->textLength : 0;
+  if (recvAll(socketFD, reason, length) < 0) {
+    length = 0;
+  }
+  fprintf(stderr, "SERVER ERROR: %.*s\n", (int) length, reason);
+}
+
+// Function: Create the ring, pass it to the server and wait for the server to map it. Returns 0,
+// or -1 on error (after reporting the server's reason, if it gave one)
+static inline int attachRing(int socketFD, SharedRegion *ring, uint64_t size) {
+  int fd = createSharedRegion(ring, size);
+  if (fd < 0) {
+    return -1;
+  }
+  FrameHeader attach = { OTP_PROTO_VERSION, OTP_MSG_ATTACH, 0, 0, size, 0 };
+  unsigned char wire[OTP_HEADER_SIZE];
+  encodeHeader(&attach, wire);
+  int status = sendWithDescriptor(socketFD, wire, sizeof(wire), fd);
+  close(fd);  // The server holds its own reference once the header is sent
+
+  FrameHeader response;
+  if (status < 0 || recvHeader(socketFD, &response) < 0) {
+    return -1;
+  }
+  if (response.type == OTP_MSG_ERROR) {
+    reportErrorFrame(socketFD, &response);
+    return -1;
+  }
+  return response.type == OTP_MSG_RESPONSE && response.textLength == 0 ? 0 : -1;
+}
+
+// Function: Claim ring space for `length` bytes after the slots in flight, wrapping to the start
+// when they do not fit before the end. Returns 0 with the slot filled in, or -1 when the ring has
+// no room until the oldest slot is released
+static inline int claimRing(uint64_t ringSize, uint64_t *head, uint64_t *used, uint64_t length,
+                            SharedSlot *slot) {
+  if (*used == 0) {
+    *head = 0;
+  }
+  uint64_t gap = *head + length <= ringSize ? 0 : ringSize - *head;
+  if (*used + gap + length > ringSize) {
+    return -1;
+  }
+  slot->textOffset = gap > 0 ? 0 : *head;
+  slot->reserved = gap + length;
+  *head = slot->textOffset + length;
+  *used += slot->reserved;
+  return 0;
+}
+
+// Function: Run every job through memory shared with the server (shm: endpoints, the server
+// offering 'M'). Each job's text and key are copied into a ring the server has mapped and a
+// OTP_SHM_DOORBELL_SIZE request names their offsets; the server transforms the text in place and
+// answers with a header (and a verify trailer), so no payload byte crosses the socket. Up to
+// OTP_SHM_MAX_INFLIGHT requests are outstanding at a time, their answers arriving in order, and
+// each job's output is written from the ring to its outFD, or to `outFD`, once it is answered.
+// Returns the number of verify jobs that failed their check, or -1 on error
+static inline int shmSession(int socketFD, StreamJob *jobs, size_t jobCount, int outFD) {
+  // The ring holds at least the largest job, text and key side by side
+  uint64_t ringSize = OTP_SHM_RING_SIZE;
+  for (size_t i = 0; i < jobCount; i++) {
+    ringSize = 2 * jobs[i].textLength > ringSize ? 2 * jobs[i].textLength : ringSize;
+  }
+  uint64_t pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+  ringSize = (ringSize + pageSize - 1) / pageSize * pageSize;
+
+  SharedRegion ring = { NULL, 0 };
+  if (attachRing(socketFD, &ring, ringSize) < 0) {
+    releaseSharedRegion(&ring);
+    return -1;
+  }
+
+  SharedSlot slots[OTP_SHM_MAX_INFLIGHT];
+  uint64_t head = 0, used = 0;
+  size_t sent = 0, answered = 0;
+  int verifyFailures = 0;
+  int status = 0;
+
+  while (status == 0 && answered < jobCount) {
+    // ** Fill the ring: copy in as many jobs as fit and ring the server for each **
+    while (sent < jobCount && sent - answered < OTP_SHM_MAX_INFLIGHT) {
+      StreamJob *job = &jobs[sent];
+      SharedSlot *slot = &slots[sent % OTP_SHM_MAX_INFLIGHT];
+      if (claimRing(ringSize, &head, &used, 2 * job->textLength, slot) < 0) {
+        break;
+      }
+      uint64_t keyOffset = slot->textOffset + job->textLength;
+      memcpy(ring.base + slot->textOffset, job->text, job->textLength);
+      memcpy(ring.base + keyOffset, job->key, job->textLength);
+
+      FrameHeader request = { OTP_PROTO_VERSION, OTP_MSG_REQUEST, (uint16_t) (job->op | OTP_FLAG_SHM), 0,
+                              job->textLength, job->textLength };
+      unsigned char wire[OTP_HEADER_SIZE + OTP_SHM_DOORBELL_SIZE];
+      encodeHeader(&request, wire);
+      putUint64(wire + OTP_HEADER_SIZE, slot->textOffset);
+      putUint64(wire + OTP_HEADER_SIZE + 8, keyOffset);
+      if (sendAll(socketFD, (const char *) wire, sizeof(wire)) < 0) {
+        status = -1;
+        break;
+      }
+      sent++;
+    }
+    if (status < 0) {
+      break;
+    }
+
+    // ** Take the oldest answer, write its output out of the ring and release its slot **
+    StreamJob *job = &jobs[answered];
+    SharedSlot *slot = &slots[answered % OTP_SHM_MAX_INFLIGHT];
+    FrameHeader response;
+    if (recvHeader(socketFD, &response) < 0) {
+      status = -1;
+      break;
+    }
+    if (response.type == OTP_MSG_ERROR) {
+      reportErrorFrame(socketFD, &response);
+      status = -1;
+      break;
+    }
+    if (response.type != OTP_MSG_RESPONSE || !(response.flags & OTP_FLAG_SHM) ||
+        response.textLength != job->textLength || response.keyLength > OTP_VERIFY_TRAILER_SIZE) {
+      status = -1;
+      break;
+    }
+    unsigned char trailer[OTP_VERIFY_TRAILER_SIZE];
+    if (recvAll(socketFD, (char *) trailer, response.keyLength) < 0) {
+      status = -1;
+      break;
+    }
+
+    int jobFD = job->outFD >= 0 ? job->outFD : outFD;
+    if (writeAll(jobFD, ring.base + slot->textOffset, job->textLength) < 0 || writeAll(jobFD, "\n", 1) < 0) {
+      status = -1;
+      break;
+    }
+    if (response.keyLength == OTP_VERIFY_TRAILER_SIZE && getUint64(trailer) > 0) {
+      fprintf(stderr, "Error: %s failed verification, %llu bytes did not survive the round trip\n",
+              job->textPath, (unsigned long long) getUint64(trailer));
+      verifyFailures++;
+    }
+    used -= slot->reserved;
+    answered++;
+  }
+
+  releaseSharedRegion(&ring);
+  return status < 0 ? -1 : verifyFailures;
+}
+
+// -- Newline Protocol --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Copy a newline-protocol reply to outFD as it arrives, a chunk at a time, up to and
+// including its first newline; a reply cut off without one still gets its newline. Nothing is
+// held beyond one chunk. Returns 0 on success, -1 on error
+static inline int relayLineReply(int socketFD, int outFD) {
+  char *buffer = malloc(OTP_CHUNK_SIZE);
+  if (buffer == NULL) {
+    return -1;
+  }
+
+  int status = 0;
+  while (1) {
+    ssize_t charsRead = recv(socketFD, buffer, OTP_CHUNK_SIZE, 0);
+    if (charsRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (charsRead < 0) {
+      status = -1;
+      break;
+    }
+    if (charsRead == 0) {
+      status = writeAll(outFD, "\n", 1);
+      break;
+    }
+
+    // The server's closing terminator follows the line; it is read but not printed
+    char *newline = memchr(buffer, '\n', charsRead);
+    size_t length = newline != NULL ? (size_t) (newline - buffer) + 1 : (size_t) charsRead;
+    if (writeAll(outFD, buffer, length) < 0) {
+      status = -1;
+      break;
+    }
+    if (newline != NULL) {
+      break;
+    }
+  }
+
+  free(buffer);
+  return status;
+}
+
+#endif
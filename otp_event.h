@@ -0,0 +1,700 @@
+#ifndef OTP_EVENT_H
+#define OTP_EVENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "otp_proto.h"
+#include "otp_service.h"
+#include "otp_metrics.h"
+
+// Edge-triggered epoll server mode (-e).
+//
+// Every connection is a small state machine driven by readiness events on a
+// non-blocking socket. Nothing is allocated for a connection beyond its
+// EventConnection until it has sent its handshake; the payload buffer is sized
+// to the request (one chunk pair for framed requests, grown on demand for the
+// newline protocol), so thousands of idle or slow clients cost very little.
+// The cipher runs inline on the event thread: a chunk transform is cheap
+// compared with the syscalls around it. With -w N, N event loops run in
+// threads and share the listen socket through EPOLLEXCLUSIVE, or each take a
+// listener of their own with -s (SO_REUSEPORT, see otp_server.h), optionally
+// pinned to a CPU each with -a. With -c, a connection beyond the limit is
+// answered OTP_BUSY_REPLY and closed at once.
+
+#define OTP_EVENT_BATCH 256
+#define OTP_EVENT_INITIAL_BUFFER 4096
+#define OTP_CPU_MASK_WORDS (1024 / (8 * sizeof(unsigned long)))   // Room for 1024 CPUs
+
+enum {
+  EV_HANDSHAKE,      // Waiting for the client identifier
+  EV_WRITE,          // Flushing writeData, then moving to nextState
+  EV_FRAME_HEADER,   // Reading a framed request header (sessions loop back here)
+  EV_FRAME_CHUNK,    // Reading one text chunk and its key chunk (just the text with a pad)
+  EV_FRAME_DISCARD,  // Skipping key bytes beyond the text length
+  EV_LINES,          // Reading a newline-protocol message
+  EV_CLOSE
+};
+
+typedef struct {
+  int fd;
+  int state;
+  int nextState;
+
+  char handshake[OTP_HANDSHAKE_SIZE];   // Client identifier, then our reply
+  size_t handshakeLength;
+  const ServiceRole *role;    // Set by the handshake
+  ChunkTransform transform;   // Operation of the request being served
+
+  unsigned char headerWire[OTP_HEADER_SIZE];
+  size_t headerReceived;
+  uint64_t textRemaining;
+  uint64_t discardRemaining;
+  const char *pad;            // Key of the next chunk, for pad requests (otp_pad.h)
+  int packed;                 // Request and response are in the packed format (otp_pack.h)
+  uint64_t mismatches;        // Round trip failures so far, for verify requests
+
+  char *buffer;
+  size_t capacity;
+  char *lentBuffer;           // io_uring: registered slot lent as `buffer` (otp_uring.h), or NULL
+  size_t filled;
+  size_t chunkLength;
+  int newlinesSeen;
+
+  const char *writeData;
+  size_t writeLength;
+  size_t writeOffset;
+
+  // Metrics for the request in progress (otp_metrics.h); all zero when metrics are off
+  int framed;
+  int op;
+  int failed;
+  uint64_t connectionStart;
+  uint64_t requestStart;
+  uint64_t cipherNanos;
+  uint64_t requestBytesIn;
+  uint64_t requestBytesOut;
+} EventConnection;
+
+// -- Connection State Machine --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Make sure the connection buffer holds at least `size` bytes. Returns 0 on success
+static inline int reserveEventBuffer(EventConnection *conn, size_t size) {
+  if (conn->capacity >= size) {
+    return 0;
+  }
+  if (conn->buffer != NULL && conn->buffer == conn->lentBuffer) {
+    // A lent slot is not ours to realloc: move to the heap, and the loop takes the slot back
+    char *moved = malloc(size);
+    if (moved == NULL) {
+      return -1;
+    }
+    memcpy(moved, conn->buffer, conn->filled);
+    conn->buffer = moved;
+    conn->capacity = size;
+    return 0;
+  }
+  char *grown = realloc(conn->buffer, size);
+  if (grown == NULL) {
+    return -1;
+  }
+  conn->buffer = grown;
+  conn->capacity = size;
+  return 0;
+}
+
+// Function: Queue bytes to send; the connection moves to `nextState` once they are out
+static inline void queueEventWrite(EventConnection *conn, const char *data, size_t length, int nextState) {
+  conn->writeData = data;
+  conn->writeLength = length;
+  conn->writeOffset = 0;
+  conn->state = EV_WRITE;
+  conn->nextState = nextState;
+}
+
+// Function: Queue an error frame and close afterwards
+static inline void queueEventError(EventConnection *conn, const char *reason) {
+  size_t length = strlen(reason);
+  conn->failed = 1;
+  if (reserveEventBuffer(conn, OTP_HEADER_SIZE + length) < 0) {
+    conn->state = EV_CLOSE;
+    return;
+  }
+  FrameHeader header = { OTP_PROTO_VERSION, OTP_MSG_ERROR, 0, 0, length, 0 };
+  encodeHeader(&header, (unsigned char *) conn->buffer);
+  memcpy(conn->buffer + OTP_HEADER_SIZE, reason, length);
+  queueEventWrite(conn, conn->buffer, OTP_HEADER_SIZE + length, EV_CLOSE);
+}
+
+// Function: State after a framed response chunk (or header) has been sent. Once a request is
+// complete the connection waits for the next one of the session
+static inline int nextFrameState(const EventConnection *conn) {
+  if (conn->textRemaining > 0) {
+    return EV_FRAME_CHUNK;
+  }
+  return conn->discardRemaining > 0 ? EV_FRAME_DISCARD : EV_FRAME_HEADER;
+}
+
+// Function: Check the identifier and queue our reply
+static inline void finishEventHandshake(EventConnection *conn, const ServiceSpec *service) {
+  int framed = 0;
+  conn->handshake[conn->handshakeLength] = '\0';
+  conn->role = matchRole(service, conn->handshake, &framed);
+  if (conn->role == NULL) {
+    conn->failed = 1;
+    conn->state = EV_CLOSE;
+    return;
+  }
+
+  conn->framed = framed;
+  conn->op = conn->role->defaultOp;
+  conn->transform = opTransform(conn->op);
+  formatHandshakeReply(service, conn->role, framed, 0, conn->handshake, sizeof(conn->handshake));
+  queueEventWrite(conn, conn->handshake, strlen(conn->handshake),
+                  framed ? EV_FRAME_HEADER : EV_LINES);
+}
+
+// Function: Validate a complete request header and queue the response header
+static inline void finishEventHeader(EventConnection *conn, const ServiceSpec *service) {
+  FrameHeader request;
+  decodeHeader(conn->headerWire, &request);
+  if (request.version != OTP_PROTO_VERSION) {
+    queueEventError(conn, "unsupported protocol version");
+    return;
+  }
+  if (request.type != OTP_MSG_REQUEST) {
+    queueEventError(conn, "unexpected message type");
+    return;
+  }
+  if (request.flags & OTP_FLAG_SHM) {
+    queueEventError(conn, "shared memory transport not offered");
+    return;
+  }
+  int usePad = (request.flags & OTP_FLAG_PAD) != 0;
+  int packed = (request.flags & OTP_FLAG_PACKED) != 0;
+  if (usePad && packed) {
+    queueEventError(conn, "pads cannot be used with the packed format");
+    return;
+  }
+  if (!usePad && request.keyLength < request.textLength) {
+    queueEventError(conn, "key is shorter than text");
+    return;
+  }
+  int op = resolveOp(service, conn->role, request.flags & OTP_FLAG_OP_MASK);
+  if (op == 0) {
+    queueEventError(conn, "operation not supported");
+    return;
+  }
+
+  // Like serveRequest(): a pad request's keyLength is its offset, and encryption claims the range
+  conn->pad = NULL;
+  if (usePad) {
+    const char *reason;
+    conn->pad = lookupPad(request.reserved, request.keyLength, request.textLength, op != OTP_OP_DECRYPT, &reason);
+    if (conn->pad == NULL) {
+      queueEventError(conn, reason);
+      return;
+    }
+  }
+  conn->op = op;
+  conn->transform = opTransform(op);
+  conn->requestStart = metricsNow();
+  conn->cipherNanos = 0;
+  conn->requestBytesIn = requestBodyLength(&request);
+  conn->requestBytesOut = responseBodyLength(&request);
+  conn->mismatches = 0;
+  conn->packed = packed;
+
+  // A verify response's trailer goes out behind its last chunk, so the buffer has room for it
+  uint64_t trailerLength = op == OTP_OP_VERIFY ? OTP_VERIFY_TRAILER_SIZE : 0;
+  size_t chunkLength = request.textLength < OTP_CHUNK_SIZE ? (size_t) request.textLength : OTP_CHUNK_SIZE;
+  size_t pairSize = (usePad ? 1 : 2) * (packed ? (size_t) packedLength(chunkLength) : chunkLength);
+  if (reserveEventBuffer(conn, pairSize + trailerLength > OTP_EVENT_INITIAL_BUFFER
+                                   ? pairSize + trailerLength : OTP_EVENT_INITIAL_BUFFER) < 0) {
+    conn->state = EV_CLOSE;
+    return;
+  }
+  conn->textRemaining = request.textLength;
+  uint64_t extraKey = usePad ? 0 : request.keyLength - request.textLength;
+  conn->discardRemaining = packed ? packedLength(extraKey) : extraKey;
+  conn->filled = 0;
+
+  FrameHeader response = { OTP_PROTO_VERSION, OTP_MSG_RESPONSE, packed ? OTP_FLAG_PACKED : 0, 0,
+                           request.textLength, trailerLength };
+  encodeHeader(&response, conn->headerWire);
+  if (trailerLength > 0 && request.textLength == 0) {
+    // No chunk to carry the trailer: it follows the header
+    encodeHeader(&response, (unsigned char *) conn->buffer);
+    putUint64((unsigned char *) conn->buffer + OTP_HEADER_SIZE, 0);
+    queueEventWrite(conn, conn->buffer, OTP_HEADER_SIZE + trailerLength, nextFrameState(conn));
+    return;
+  }
+  queueEventWrite(conn, (const char *) conn->headerWire, OTP_HEADER_SIZE, nextFrameState(conn));
+}
+
+// Function: Transform a newline-protocol message in place and queue the reply
+static inline void finishEventLines(EventConnection *conn) {
+  MessageView view;
+  if (parseMessage(conn->buffer, conn->filled, &view) < 0) {
+    conn->failed = 1;
+    conn->state = EV_CLOSE;
+    return;
+  }
+  size_t textLength = view.textLength;
+
+  // Same bytes as sendMessage(): the message, its newline, then the terminator
+  uint64_t cipherStart = metricsNow();
+  conn->transform(view.text, view.key, view.text, textLength);
+  conn->cipherNanos = metricsNow() - cipherStart;
+  conn->requestBytesIn = textLength + view.keyLength;
+  conn->requestBytesOut = textLength + 2;
+  conn->buffer[textLength] = '\n';
+  conn->buffer[textLength + 1] = '\n';
+  queueEventWrite(conn, conn->buffer, textLength + 2, EV_CLOSE);
+}
+
+// Function: Account for a request whose response has been fully sent
+static inline void finishEventRequest(EventConnection *conn) {
+  if (conn->requestStart == 0) {
+    return;
+  }
+  recordDuration(STAGE_CIPHER, conn->cipherNanos);
+  recordStage(STAGE_REQUEST, conn->requestStart);
+  countRequest(conn->framed, conn->op, conn->requestBytesIn, conn->requestBytesOut);
+  conn->requestStart = 0;
+}
+
+// Function: Bytes the current chunk's text (or key) takes on the wire
+static inline size_t eventChunkBytes(const EventConnection *conn) {
+  return conn->packed ? (size_t) packedLength(conn->chunkLength) : conn->chunkLength;
+}
+
+// Function: Work out what the connection needs next. Returns 1 with *target and *wanted set to
+// where its next input belongs, 0 when it has bytes queued to send (EV_WRITE), -1 once it is
+// finished. Calling it again before the read is applied gives the same target
+static inline int nextEventRead(EventConnection *conn, char **target, size_t *wanted) {
+  while (1) {
+    switch (conn->state) {
+      case EV_CLOSE:
+        return -1;
+
+      case EV_WRITE:
+        return 0;
+
+      case EV_HANDSHAKE:
+        *target = conn->handshake + conn->handshakeLength;
+        *wanted = OTP_CLIENT_ID_SIZE - 1 - conn->handshakeLength;
+        return 1;
+
+      case EV_FRAME_HEADER:
+        *target = (char *) conn->headerWire + conn->headerReceived;
+        *wanted = OTP_HEADER_SIZE - conn->headerReceived;
+        return 1;
+
+      case EV_FRAME_CHUNK:
+        conn->chunkLength = conn->textRemaining < OTP_CHUNK_SIZE ? (size_t) conn->textRemaining : OTP_CHUNK_SIZE;
+        *target = conn->buffer + conn->filled;
+        *wanted = (conn->pad != NULL ? 1 : 2) * eventChunkBytes(conn) - conn->filled;
+        return 1;
+
+      case EV_FRAME_DISCARD:
+        *target = conn->buffer;
+        *wanted = conn->discardRemaining < conn->capacity ? (size_t) conn->discardRemaining : conn->capacity;
+        return 1;
+
+      case EV_LINES:
+        if (conn->filled == conn->capacity) {
+          size_t grown = conn->capacity == 0 ? OTP_EVENT_INITIAL_BUFFER : 2 * conn->capacity;
+          if (grown > BUFFER_SIZE) {
+            grown = BUFFER_SIZE;
+          }
+          if (grown == conn->capacity || reserveEventBuffer(conn, grown) < 0) {
+            finishEventLines(conn);  // Full, like receiveMessage() hitting bufferSize
+            continue;
+          }
+        }
+        *target = conn->buffer + conn->filled;
+        *wanted = conn->capacity - conn->filled;
+        return 1;
+
+      default:
+        return -1;
+    }
+  }
+}
+
+// Function: Move on once the queued bytes of an EV_WRITE have all been sent
+static inline void completeEventWrite(EventConnection *conn) {
+  conn->state = conn->nextState;
+  if (conn->state == EV_FRAME_HEADER || (conn->state == EV_CLOSE && !conn->failed)) {
+    finishEventRequest(conn);
+  }
+}
+
+// Function: Account for `charsRead` bytes that arrived at the target from nextEventRead(), or for
+// the end of the stream when it is 0. Returns 0 while the connection goes on, -1 once it is finished
+static inline int applyEventRead(EventConnection *conn, const ServiceSpec *service, char *target,
+                                 size_t charsRead) {
+  if (charsRead == 0) {
+    // A newline-protocol client may close its side once the message is out
+    if (conn->state == EV_LINES) {
+      finishEventLines(conn);
+      return 0;
+    }
+    return -1;
+  }
+
+  switch (conn->state) {
+    case EV_HANDSHAKE:
+      // Like verifyClient(), the first read carries the whole identifier
+      conn->handshakeLength += charsRead;
+      finishEventHandshake(conn, service);
+      break;
+
+    case EV_FRAME_HEADER:
+      conn->headerReceived += charsRead;
+      if (conn->headerReceived == OTP_HEADER_SIZE) {
+        conn->headerReceived = 0;  // Ready for the next request of the session
+        finishEventHeader(conn, service);
+      }
+      break;
+
+    case EV_FRAME_CHUNK:
+      conn->filled += charsRead;
+      if (conn->filled == (conn->pad != NULL ? 1 : 2) * eventChunkBytes(conn)) {
+        size_t length = conn->chunkLength;
+        size_t replyLength = eventChunkBytes(conn);
+        const char *key = conn->pad != NULL ? conn->pad : conn->buffer + replyLength;
+        uint64_t cipherStart = metricsNow();
+        if (conn->packed) {
+          conn->mismatches += transformPacked((unsigned char *) conn->buffer, (const unsigned char *) key, length,
+                                              conn->transform, conn->op == OTP_OP_VERIFY);
+        } else if (conn->op == OTP_OP_VERIFY) {
+          conn->mismatches += cipherVerify(conn->buffer, key, conn->buffer, length);
+        } else {
+          conn->transform(conn->buffer, key, conn->buffer, length);
+        }
+        conn->cipherNanos += metricsNow() - cipherStart;
+        if (conn->pad != NULL) {
+          conn->pad += length;
+        }
+        conn->textRemaining -= length;
+        conn->filled = 0;
+
+        // The last chunk of a verify response carries the trailer; the key chunk behind it is spent
+        if (conn->op == OTP_OP_VERIFY && conn->textRemaining == 0) {
+          putUint64((unsigned char *) conn->buffer + replyLength, conn->mismatches);
+          replyLength += OTP_VERIFY_TRAILER_SIZE;
+          if (conn->mismatches > 0) {
+            countMetric(verifyFailures, 1);
+          }
+        }
+        queueEventWrite(conn, conn->buffer, replyLength, nextFrameState(conn));
+      }
+      break;
+
+    case EV_FRAME_DISCARD:
+      conn->discardRemaining -= charsRead;
+      if (conn->discardRemaining == 0) {
+        conn->state = EV_FRAME_HEADER;
+        finishEventRequest(conn);
+      }
+      break;
+
+    case EV_LINES: {
+      // Only the new bytes are scanned for the two terminators
+      char *scan = target;
+      char *end = target + charsRead;
+      if (conn->filled == 0) {
+        conn->requestStart = metricsNow();
+      }
+      conn->filled += charsRead;
+      while (conn->newlinesSeen < 2 && (scan = memchr(scan, '\n', end - scan)) != NULL) {
+        conn->newlinesSeen++;
+        scan++;
+      }
+      if (conn->newlinesSeen >= 2) {
+        finishEventLines(conn);
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+// Function: Advance the connection as far as the socket allows. Returns 0 while the
+// connection should stay open, -1 once it is finished
+static inline int driveEventConnection(EventConnection *conn, const ServiceSpec *service) {
+  while (1) {
+    char *target;
+    size_t wanted;
+    int need = nextEventRead(conn, &target, &wanted);
+    if (need < 0) {
+      return -1;
+    }
+
+    if (need == 0) {
+      while (conn->writeOffset < conn->writeLength) {
+        ssize_t sentAmount = send(conn->fd, conn->writeData + conn->writeOffset,
+                                  conn->writeLength - conn->writeOffset, MSG_NOSIGNAL);
+        if (sentAmount < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->writeOffset += sentAmount;
+      }
+      completeEventWrite(conn);
+      continue;
+    }
+
+    ssize_t charsRead = recv(conn->fd, target, wanted, 0);
+    if (charsRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (applyEventRead(conn, service, target, charsRead) < 0) {
+      return -1;
+    }
+  }
+}
+
+// -- Event Loop --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Pin the calling thread to the slot-th CPU it may run on, wrapping around when there are
+// fewer CPUs than slots. Raw syscalls, since cpu_set_t needs _GNU_SOURCE. Returns 0 on success
+static inline int pinToCpuSlot(int slot) {
+  const size_t wordBits = 8 * sizeof(unsigned long);
+  unsigned long allowed[OTP_CPU_MASK_WORDS];
+  memset(allowed, 0, sizeof(allowed));
+  if (syscall(__NR_sched_getaffinity, 0, sizeof(allowed), allowed) < 0) {
+    return -1;
+  }
+
+  int count = 0;
+  for (size_t word = 0; word < OTP_CPU_MASK_WORDS; word++) {
+    count += __builtin_popcountl(allowed[word]);
+  }
+  if (count == 0) {
+    return -1;
+  }
+  int wanted = slot % count;
+  for (size_t cpu = 0; cpu < OTP_CPU_MASK_WORDS * wordBits; cpu++) {
+    if ((allowed[cpu / wordBits] >> (cpu % wordBits)) & 1) {
+      if (wanted-- == 0) {
+        unsigned long mask[OTP_CPU_MASK_WORDS];
+        memset(mask, 0, sizeof(mask));
+        mask[cpu / wordBits] = 1UL << (cpu % wordBits);
+        return syscall(__NR_sched_setaffinity, 0, sizeof(mask), mask) < 0 ? -1 : 0;
+      }
+    }
+  }
+  return -1;
+}
+
+typedef struct {
+  int listenSocket;           // Shared by every loop, or this loop's own shard (-s)
+  int maxConnections;         // -c; 0 for no limit
+  int cpuSlot;                // -a: pin the loop with pinToCpuSlot(); -1 leaves it unpinned
+  const ServiceSpec *service;
+} EventLoopArgs;
+
+static int eventConnectionCount = 0;   // Open connections across all loops
+
+// Function: Release a finished connection. A session ends cleanly between requests or after
+// a newline-protocol reply; anything else counts as an error
+static inline void closeEventConnection(EventConnection *conn) {
+  int clean = !conn->failed && (conn->state == EV_CLOSE ||
+                                (conn->state == EV_FRAME_HEADER && conn->headerReceived == 0));
+  if (!clean) {
+    countMetric(errors, 1);
+  }
+  countMetric(activeConnections, -1);
+  recordStage(STAGE_CONNECTION, conn->connectionStart);
+  __atomic_fetch_sub(&eventConnectionCount, 1, __ATOMIC_RELAXED);
+
+  close(conn->fd);
+  free(conn->buffer);
+  free(conn);
+}
+
+// Function: Start tracking a freshly accepted connection, or turn it away busy when `maxConnections`
+// are already open. Returns NULL, with the socket closed, when it was turned away or out of memory
+static inline EventConnection *newEventConnection(int connectionSocket, int maxConnections) {
+  int open = __atomic_add_fetch(&eventConnectionCount, 1, __ATOMIC_RELAXED);
+  if (maxConnections > 0 && open > maxConnections) {
+    __atomic_fetch_sub(&eventConnectionCount, 1, __ATOMIC_RELAXED);
+    rejectBusy(connectionSocket);
+    return NULL;
+  }
+
+  setNoDelay(connectionSocket);
+  EventConnection *conn = calloc(1, sizeof(EventConnection));
+  if (conn == NULL) {
+    __atomic_fetch_sub(&eventConnectionCount, 1, __ATOMIC_RELAXED);
+    close(connectionSocket);
+    return NULL;
+  }
+  conn->fd = connectionSocket;
+  conn->state = EV_HANDSHAKE;
+  conn->connectionStart = metricsNow();
+  countMetric(connections, 1);
+  countMetric(activeConnections, 1);
+  return conn;
+}
+
+// Function: Accept every pending connection and register it edge-triggered
+static inline void acceptEventConnections(int epollFD, const EventLoopArgs *args) {
+  while (1) {
+    int connectionSocket = accept(args->listenSocket, NULL, NULL);
+    if (connectionSocket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("ERROR on accept");
+      }
+      return;
+    }
+
+    // Accepted sockets do not inherit O_NONBLOCK from the listen socket
+    fcntl(connectionSocket, F_SETFL, fcntl(connectionSocket, F_GETFL) | O_NONBLOCK);
+
+    EventConnection *conn = newEventConnection(connectionSocket, args->maxConnections);
+    if (conn == NULL) {
+      continue;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, connectionSocket, &event) < 0) {
+      conn->failed = 1;
+      closeEventConnection(conn);
+    }
+  }
+}
+
+// Function: Run one event loop forever. The listen socket may be shared between loops
+static void *runEventLoop(void *arg) {
+  EventLoopArgs *args = arg;
+  if (args->cpuSlot >= 0) {
+    pinToCpuSlot(args->cpuSlot);
+  }
+
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFD < 0) {
+    perror("ERROR creating epoll instance");
+    exit(1);
+  }
+
+  // data.ptr == NULL marks the listen socket; EPOLLEXCLUSIVE wakes one loop per connection
+  struct epoll_event listenEvent = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, args->listenSocket, &listenEvent) < 0) {
+    perror("ERROR watching listen socket");
+    exit(1);
+  }
+
+  struct epoll_event events[OTP_EVENT_BATCH];
+  while (1) {
+    int ready = epoll_wait(epollFD, events, OTP_EVENT_BATCH, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR in epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < ready; i++) {
+      EventConnection *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        acceptEventConnections(epollFD, args);
+      } else if (driveEventConnection(conn, args->service) < 0) {
+        closeEventConnection(conn);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Function: Get the descriptor limit ready for thousands of clients. The accept queue is
+// already as deep as -b asked (openListenSocket)
+static inline void prepareEventListen(void) {
+  // Lift the descriptor limit as far as allowed; each client holds one descriptor
+  struct rlimit fileLimit;
+  if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+    fileLimit.rlim_cur = fileLimit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fileLimit);
+  }
+}
+
+// Function: Run `loop` on this thread, or on `loops` threads when there is more than one, loop i
+// with args[i]
+static inline void runEventLoops(int loops, void *(*loop)(void *), EventLoopArgs *args) {
+  if (loops <= 1) {
+    loop(&args[0]);
+    return;
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * loops);
+  if (threads == NULL) {
+    perror("ERROR allocating event loops");
+    exit(1);
+  }
+  for (int i = 0; i < loops; i++) {
+    if (pthread_create(&threads[i], NULL, loop, &args[i]) != 0) {
+      perror("ERROR starting event loop");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < loops; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+// Function: Arguments for `loops` loops (at least one): loop i listens on listeners[i] and, with
+// `pinLoops`, is pinned to CPU slot i
+static inline EventLoopArgs *makeEventLoopArgs(const int *listeners, int loops, int maxConnections,
+                                               int pinLoops, const ServiceSpec *service) {
+  int count = loops > 1 ? loops : 1;
+  EventLoopArgs *args = calloc(count, sizeof(EventLoopArgs));
+  if (args == NULL) {
+    perror("ERROR allocating event loops");
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    args[i].listenSocket = listeners[i];
+    args[i].maxConnections = maxConnections;
+    args[i].cpuSlot = pinLoops ? i : -1;
+    args[i].service = service;
+  }
+  return args;
+}
+
+// Function: Serve with `loops` epoll event loops (one per thread), loop i accepting on listeners[i],
+// at most `maxConnections` clients at a time when it is set
+static inline void runEventServer(const int *listeners, int loops, int maxConnections, int pinLoops,
+                                  const ServiceSpec *service) {
+  prepareEventListen();
+  EventLoopArgs *args = makeEventLoopArgs(listeners, loops, maxConnections, pinLoops, service);
+  for (int i = 0; i < (loops > 1 ? loops : 1); i++) {
+    fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+  }
+  runEventLoops(loops, runEventLoop, args);
+  free(args);
+}
+
+#endif
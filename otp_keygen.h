@@ -0,0 +1,106 @@
+#ifndef OTP_KEYGEN_H
+#define OTP_KEYGEN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/random.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Key symbol generation shared by keygen and the benchmarks.
+//
+// A random byte below KEYGEN_ACCEPT_LIMIT (9 * 27) maps to byte % 27, which
+// gives every symbol exactly the same odds; bytes 243-255 are rejected.
+
+#define KEYGEN_RANDOM_SIZE 65536
+#define KEYGEN_ACCEPT_LIMIT 243
+
+// -- Conversion --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Symbol for a value 0-26 ('A'-'Z', then space for 26)
+static inline char symbolFor(unsigned value) {
+  return value < 26 ? (char) ('A' + value) : ' ';
+}
+
+#ifdef __SSE2__
+// Function: Convert 16 accepted bytes (all below 243) to symbols
+static inline __m128i convertBlock16(__m128i bytes) {
+  const __m128i zero = _mm_setzero_si128();
+  // x / 27 == (x * 2428) >> 16 for every byte value
+  const __m128i reciprocal = _mm_set1_epi16(2428);
+  const __m128i modulus = _mm_set1_epi16(27);
+
+  __m128i low = _mm_unpacklo_epi8(bytes, zero);
+  __m128i high = _mm_unpackhi_epi8(bytes, zero);
+  low = _mm_sub_epi16(low, _mm_mullo_epi16(_mm_mulhi_epu16(low, reciprocal), modulus));
+  high = _mm_sub_epi16(high, _mm_mullo_epi16(_mm_mulhi_epu16(high, reciprocal), modulus));
+  __m128i values = _mm_packus_epi16(low, high);
+
+  // 'A' + value, except 26 which becomes ' ' ('A' + 26 - 0x3B)
+  __m128i isSpace = _mm_cmpeq_epi8(values, _mm_set1_epi8(26));
+  __m128i symbols = _mm_add_epi8(values, _mm_set1_epi8('A'));
+  return _mm_sub_epi8(symbols, _mm_and_si128(isSpace, _mm_set1_epi8('A' + 26 - ' ')));
+}
+#endif
+
+// Function: Turn random bytes into key symbols, dropping rejected bytes. Writes at most `length`
+// symbols to `out` and returns how many were written
+static inline size_t convertRandom(const unsigned char *random, size_t length, char *out) {
+  size_t produced = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // Blocks with no rejected byte (about 43% of them) convert in one go
+  const __m128i signFlip = _mm_set1_epi8((char) 0x80);
+  const __m128i rejectFrom = _mm_set1_epi8((char) ((KEYGEN_ACCEPT_LIMIT - 1) ^ 0x80));
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (random + i));
+    __m128i rejected = _mm_cmpgt_epi8(_mm_xor_si128(bytes, signFlip), rejectFrom);
+    if (_mm_movemask_epi8(rejected) == 0) {
+      _mm_storeu_si128((__m128i *) (out + produced), convertBlock16(bytes));
+      produced += 16;
+      continue;
+    }
+    for (size_t j = i; j < i + 16; j++) {
+      out[produced] = symbolFor(random[j] % 27);
+      produced += random[j] < KEYGEN_ACCEPT_LIMIT;
+    }
+  }
+#endif
+
+  // Branch-free: every byte is written, only accepted ones advance the output
+  for (; i < length; i++) {
+    out[produced] = symbolFor(random[i] % 27);
+    produced += random[i] < KEYGEN_ACCEPT_LIMIT;
+  }
+  return produced;
+}
+
+// Function: Fill `length` key symbols from getrandom(). Returns 0 on success
+static inline int fillKey(char *out, size_t length) {
+  unsigned char random[KEYGEN_RANDOM_SIZE];
+
+  while (length > 0) {
+    // Output never exceeds input, so asking for `length` bytes cannot overrun `out`
+    size_t wanted = length < sizeof(random) ? length : sizeof(random);
+    ssize_t received = getrandom(random, wanted, 0);
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error: getrandom failed");
+      return -1;
+    }
+    size_t produced = convertRandom(random, received, out);
+    out += produced;
+    length -= produced;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "otp_proto.h"
+
+// Server instrumentation, enabled with -m port.
+//
+// Stage timings come from CLOCK_MONOTONIC and land in fixed log2 histograms;
+// requests, bytes, connections and errors are plain counters. Everything lives
+// in one MAP_SHARED block created before any worker starts, and every update is
+// a relaxed atomic add, so forked children, pool processes, threads and event
+// loops all feed the same numbers without locks. A thread in the main process
+// serves them in the Prometheus text format on 127.0.0.1:port, to plain
+// connections (`nc localhost port`) and HTTP GETs (a Prometheus scrape) alike.
+//
+// With metrics off, otpMetrics is NULL and every hook returns before reading
+// the clock.
+
+enum {
+  STAGE_FORK,        // fork() for a connection (fork-per-connection model)
+  STAGE_HANDSHAKE,   // verifyClient()
+  STAGE_RECEIVE,     // Reading a request's text and key off the socket
+  STAGE_CIPHER,      // The transform itself
+  STAGE_SEND,        // Writing the response
+  STAGE_REQUEST,     // One request, first byte in to last byte out
+  STAGE_CONNECTION,  // A whole connection, handshake to close
+  STAGE_COUNT
+};
+
+static const char *const stageNames[STAGE_COUNT] = {
+  "fork", "handshake", "receive", "cipher", "send", "request", "connection"
+};
+
+// Bucket i counts durations up to 2^i microseconds; the last one is +Inf
+#define METRICS_BUCKETS 25
+
+typedef struct {
+  uint64_t buckets[METRICS_BUCKETS + 1];
+  uint64_t count;
+  uint64_t sumNanos;
+} Histogram;
+
+typedef struct {
+  Histogram stages[STAGE_COUNT];
+  uint64_t requests[2][OTP_OP_COUNT];  // [framed][op]
+  uint64_t bytesReceived;        // Request payload: text and key
+  uint64_t bytesSent;            // Response payload
+  uint64_t connections;
+  int64_t activeConnections;
+  uint64_t errors;               // Connections that ended in an error
+  uint64_t rejected;             // Connections turned away busy (admission control)
+  uint64_t verifyFailures;       // Verify requests whose text did not survive the round trip
+} OtpMetrics;
+
+static OtpMetrics *otpMetrics = NULL;
+
+// -- Recording --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Monotonic timestamp in nanoseconds, or 0 when metrics are off
+static inline uint64_t metricsNow(void) {
+  if (otpMetrics == NULL) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Function: Add a duration to a stage histogram
+static inline void recordDuration(int stage, uint64_t nanos) {
+  if (otpMetrics == NULL) {
+    return;
+  }
+  uint64_t micros = nanos / 1000;
+  int bucket = micros <= 1 ? 0 : 64 - __builtin_clzll(micros - 1);
+  if (bucket > METRICS_BUCKETS) {
+    bucket = METRICS_BUCKETS;
+  }
+
+  Histogram *histogram = &otpMetrics->stages[stage];
+  __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sumNanos, nanos, __ATOMIC_RELAXED);
+}
+
+// Function: Record the time since `start` (from metricsNow) for a stage. Returns the current
+// timestamp so consecutive stages can be chained
+static inline uint64_t recordStage(int stage, uint64_t start) {
+  if (otpMetrics == NULL) {
+    return 0;
+  }
+  uint64_t now = metricsNow();
+  recordDuration(stage, now - start);
+  return now;
+}
+
+// Function: Add to one of the OtpMetrics counters, e.g. countMetric(errors, 1)
+#define countMetric(field, amount)                                         \
+  do {                                                                     \
+    if (otpMetrics != NULL) {                                              \
+      __atomic_fetch_add(&otpMetrics->field, (amount), __ATOMIC_RELAXED);  \
+    }                                                                      \
+  } while (0)
+
+// Function: Count one served request and its payload
+static inline void countRequest(int framed, int op, uint64_t bytesIn, uint64_t bytesOut) {
+  if (otpMetrics == NULL || op < 0 || op >= OTP_OP_COUNT) {
+    return;
+  }
+  countMetric(requests[framed ? 1 : 0][op], 1);
+  countMetric(bytesReceived, bytesIn);
+  countMetric(bytesSent, bytesOut);
+}
+
+// -- Exposition --
+// ----------------------------------------------------------------------------------------------
+
+static inline uint64_t loadMetric(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// Function: Write every metric in the Prometheus text format
+static inline void writeMetrics(FILE *out) {
+  fprintf(out, "# HELP otp_stage_seconds Time spent in each stage of serving a connection.\n");
+  fprintf(out, "# TYPE otp_stage_seconds histogram\n");
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    const Histogram *histogram = &otpMetrics->stages[stage];
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+      cumulative += loadMetric(&histogram->buckets[bucket]);
+      fprintf(out, "otp_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stageNames[stage],
+              (double) (1ULL << bucket) / 1e6, (unsigned long long) cumulative);
+    }
+    cumulative += loadMetric(&histogram->buckets[METRICS_BUCKETS]);
+    fprintf(out, "otp_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stageNames[stage],
+            (unsigned long long) cumulative);
+    fprintf(out, "otp_stage_seconds_sum{stage=\"%s\"} %.9f\n", stageNames[stage],
+            loadMetric(&histogram->sumNanos) / 1e9);
+    fprintf(out, "otp_stage_seconds_count{stage=\"%s\"} %llu\n", stageNames[stage],
+            (unsigned long long) loadMetric(&histogram->count));
+  }
+
+  fprintf(out, "# HELP otp_requests_total Requests served.\n");
+  fprintf(out, "# TYPE otp_requests_total counter\n");
+  for (int framed = 0; framed < 2; framed++) {
+    for (int op = 1; op < OTP_OP_COUNT; op++) {
+      fprintf(out, "otp_requests_total{protocol=\"%s\",op=\"%s\"} %llu\n", framed ? "framed" : "newline",
+              otpOpName(op), (unsigned long long) loadMetric(&otpMetrics->requests[framed][op]));
+    }
+  }
+
+  fprintf(out, "# TYPE otp_received_bytes_total counter\notp_received_bytes_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->bytesReceived));
+  fprintf(out, "# TYPE otp_sent_bytes_total counter\notp_sent_bytes_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->bytesSent));
+  fprintf(out, "# TYPE otp_connections_total counter\notp_connections_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->connections));
+  fprintf(out, "# TYPE otp_connections_active gauge\notp_connections_active %lld\n",
+          (long long) __atomic_load_n(&otpMetrics->activeConnections, __ATOMIC_RELAXED));
+  fprintf(out, "# TYPE otp_connection_errors_total counter\notp_connection_errors_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->errors));
+  fprintf(out, "# TYPE otp_connections_rejected_total counter\notp_connections_rejected_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->rejected));
+  fprintf(out, "# TYPE otp_verify_failures_total counter\notp_verify_failures_total %llu\n",
+          (unsigned long long) loadMetric(&otpMetrics->verifyFailures));
+}
+
+// Function: Answer one metrics connection. HTTP clients send a request line first and get an
+// HTTP response; anything that stays quiet for a moment just gets the text
+static inline void serveMetricsConnection(int connectionSocket) {
+  char request[512];
+  ssize_t charsRead = 0;
+  struct pollfd pollSocket = { .fd = connectionSocket, .events = POLLIN };
+  if (poll(&pollSocket, 1, 200) > 0) {
+    charsRead = recv(connectionSocket, request, sizeof(request), 0);
+  }
+
+  FILE *out = fdopen(connectionSocket, "w");
+  if (out == NULL) {
+    close(connectionSocket);
+    return;
+  }
+  if (charsRead >= 4 && strncmp(request, "GET ", 4) == 0) {
+    fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+  }
+  writeMetrics(out);
+  fclose(out);  // Also closes the socket
+}
+
+static void *metricsThreadMain(void *arg) {
+  int listenSocket = (int) (intptr_t) arg;
+  while (1) {
+    int connectionSocket = accept(listenSocket, NULL, NULL);
+    if (connectionSocket < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("ERROR on metrics accept");
+        sleep(1);
+      }
+      continue;
+    }
+    serveMetricsConnection(connectionSocket);
+  }
+  return NULL;
+}
+
+// Function: Turn metrics on: allocate the shared block and serve it on 127.0.0.1:port from a
+// background thread. Call before any worker is started. Returns 0 on success, -1 on error
+static inline int startMetrics(int port) {
+  void *shared = mmap(NULL, sizeof(OtpMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("ERROR allocating metrics");
+    return -1;
+  }
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  if (listenSocket < 0 ||
+      setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+      bind(listenSocket, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(listenSocket, 16) < 0) {
+    perror("ERROR opening metrics port");
+    if (listenSocket >= 0) {
+      close(listenSocket);
+    }
+    munmap(shared, sizeof(OtpMetrics));
+    return -1;
+  }
+
+  // The block is in place before the thread starts, which orders it before the first scrape;
+  // workers start after this returns
+  otpMetrics = shared;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, metricsThreadMain, (void *) (intptr_t) listenSocket) != 0) {
+    perror("ERROR starting metrics thread");
+    otpMetrics = NULL;
+    close(listenSocket);
+    munmap(shared, sizeof(OtpMetrics));
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+#endif
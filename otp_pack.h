@@ -0,0 +1,316 @@
+#ifndef OTP_PACK_H
+#define OTP_PACK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+
+// Packed wire format for the 27-symbol alphabet (OTP_FLAG_PACKED).
+//
+// Every symbol is its 0..26 cipher value (v(c) in otp_cipher.h, so any byte
+// outside A-Z packs as a space, exactly as the cipher would read it) in 5 bits.
+// Eight symbols make a 40-bit group, symbol j in bits 5j..5j+4, stored as 5
+// little-endian bytes; a final group of n < 8 symbols takes ceil(5n / 8)
+// bytes. Text and key shrink to 5/8 of their size on the wire.
+//
+// Unpacking gives 'A' + value back, with 26 as a space; the values 27..31
+// cannot come out of packing and unpack to bytes the cipher treats as spaces.
+// The vector kernels follow the cipher's: SSSE3 and AVX2 packs fold pairs of
+// values with multiply-adds and compact the groups with a byte shuffle, and
+// unpacks spread each group over a 64-bit lane and split it with shifts. Like
+// the cipher, initPack() picks the fastest one that agrees with the scalar
+// kernel at startup; OTP_PACK=<name> restricts it.
+//
+// transformPacked() runs the cipher over packed text and key without ever
+// expanding a whole message: a block at a time is unpacked into L1, transformed
+// and packed back in place.
+
+#define OTP_PACK_GROUP 8          // Symbols per group
+#define OTP_PACK_GROUP_BYTES 5
+#define OTP_PACK_BLOCK 4096       // Symbols transformPacked() unpacks at a time
+
+typedef void (*PackKernel)(const char *chars, size_t count, unsigned char *out);
+typedef void (*UnpackKernel)(const unsigned char *in, size_t count, char *out);
+
+typedef struct {
+  const char *name;
+  int (*supported)(void);
+  PackKernel pack;
+  UnpackKernel unpack;
+} PackImpl;
+
+// -- Scalar Kernel --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Pack `count` characters into packedLength(count) bytes. `out` may alias `chars`
+static inline void packScalar(const char *chars, size_t count, unsigned char *out) {
+  for (size_t i = 0; i < count; i += OTP_PACK_GROUP) {
+    size_t symbols = count - i < OTP_PACK_GROUP ? count - i : OTP_PACK_GROUP;
+    uint64_t group = 0;
+    for (size_t j = 0; j < symbols; j++) {
+      group |= (uint64_t) charToValue(chars[i + j]) << (5 * j);
+    }
+    unsigned char *target = out + i / OTP_PACK_GROUP * OTP_PACK_GROUP_BYTES;
+    for (size_t b = 0; b < packedLength(symbols); b++) {
+      target[b] = (unsigned char) (group >> (8 * b));
+    }
+  }
+}
+
+// Function: Unpack `count` symbols from packedLength(count) bytes. `out` must not overlap `in`
+static inline void unpackScalar(const unsigned char *in, size_t count, char *out) {
+  for (size_t i = 0; i < count; i += OTP_PACK_GROUP) {
+    size_t symbols = count - i < OTP_PACK_GROUP ? count - i : OTP_PACK_GROUP;
+    const unsigned char *source = in + i / OTP_PACK_GROUP * OTP_PACK_GROUP_BYTES;
+    uint64_t group = 0;
+    for (size_t b = 0; b < packedLength(symbols); b++) {
+      group |= (uint64_t) source[b] << (8 * b);
+    }
+    for (size_t j = 0; j < symbols; j++) {
+      out[i + j] = valueToChar((unsigned char) ((group >> (5 * j)) & 0x1F));
+    }
+  }
+}
+
+#ifdef OTP_CIPHER_X86
+
+// -- SSSE3 Kernel (16 symbols, 10 bytes per step) --
+// ----------------------------------------------------------------------------------------------
+
+// Values are folded 5 -> 10 -> 20 bits per lane by two multiply-adds, the two 20-bit halves of
+// each 64-bit lane are joined into a 40-bit group, and a shuffle drops the 3 empty bytes of each.
+// A step stores 16 bytes for the 10 it makes; the next step or the tail overwrites the rest, so
+// the loops stop while whole vectors still fit in the packed length.
+
+__attribute__((target("ssse3")))
+static inline __m128i packGroupsSsse3(__m128i values) {
+  __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi16(0x2001));           // v0 + 32 v1
+  __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x04000001));           // p0 + 1024 p1
+  __m128i groups = _mm_or_si128(_mm_and_si128(quads, _mm_set1_epi64x(0xFFFFFFFF)),
+                                _mm_slli_epi64(_mm_srli_epi64(quads, 32), 20));
+  return _mm_shuffle_epi8(groups, _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1));
+}
+
+// The reverse: each 5-byte group goes to its own 64-bit lane and is split 40 -> 20 -> 10 -> 5 bits
+__attribute__((target("ssse3")))
+static inline __m128i unpackGroupsSsse3(__m128i bytes) {
+  __m128i groups = _mm_shuffle_epi8(bytes, _mm_setr_epi8(0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1));
+  __m128i quads = _mm_or_si128(_mm_and_si128(groups, _mm_set1_epi64x(0xFFFFF)),
+                               _mm_slli_epi64(_mm_srli_epi64(groups, 20), 32));
+  __m128i pairs = _mm_or_si128(_mm_and_si128(quads, _mm_set1_epi32(0x3FF)),
+                               _mm_slli_epi32(_mm_srli_epi32(quads, 10), 16));
+  return _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi16(0x1F)),
+                      _mm_slli_epi16(_mm_srli_epi16(pairs, 5), 8));
+}
+
+// Function: Pack 16 symbols a step from symbol `i` on. Returns where the steps stopped. Inlined
+// into the AVX2 kernel too, which would pay for a switch to legacy SSE encoding in a call
+__attribute__((target("ssse3")))
+static inline size_t packStepsSsse3(const char *chars, size_t count, unsigned char *out, size_t i) {
+  for (; i + 32 <= count; i += 16) {
+    __m128i values = toValuesSse2(_mm_loadu_si128((const __m128i *) (chars + i)));
+    _mm_storeu_si128((__m128i *) (out + i / 8 * 5), packGroupsSsse3(values));
+  }
+  return i;
+}
+
+// Function: Unpack 16 symbols a step from symbol `i` on. Returns where the steps stopped
+__attribute__((target("ssse3")))
+static inline size_t unpackStepsSsse3(const unsigned char *in, size_t count, char *out, size_t i) {
+  for (; i + 32 <= count; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (in + i / 8 * 5));
+    _mm_storeu_si128((__m128i *) (out + i), toCharsSse2(unpackGroupsSsse3(bytes)));
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static void packSsse3(const char *chars, size_t count, unsigned char *out) {
+  size_t i = packStepsSsse3(chars, count, out, 0);
+  packScalar(chars + i, count - i, out + i / 8 * 5);
+}
+
+__attribute__((target("ssse3")))
+static void unpackSsse3(const unsigned char *in, size_t count, char *out) {
+  size_t i = unpackStepsSsse3(in, count, out, 0);
+  unpackScalar(in + i / 8 * 5, count - i, out + i);
+}
+
+static inline int ssse3Supported(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+// -- AVX2 Kernel (32 symbols, 20 bytes per step) --
+// ----------------------------------------------------------------------------------------------
+
+// The SSSE3 steps, one per 128-bit lane; each lane's 10 bytes are stored (and loaded) separately.
+// What is left over goes through the SSSE3 steps, then the scalar kernel
+
+__attribute__((target("avx2")))
+static void packAvx2(const char *chars, size_t count, unsigned char *out) {
+  const __m256i compact = _mm256_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1,
+                                           0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 48 <= count; i += 32) {
+    __m256i values = toValuesAvx2(_mm256_loadu_si256((const __m256i *) (chars + i)));
+    __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x2001));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x04000001));
+    __m256i groups = _mm256_or_si256(_mm256_and_si256(quads, _mm256_set1_epi64x(0xFFFFFFFF)),
+                                     _mm256_slli_epi64(_mm256_srli_epi64(quads, 32), 20));
+    __m256i packed = _mm256_shuffle_epi8(groups, compact);
+    _mm_storeu_si128((__m128i *) (out + i / 8 * 5), _mm256_castsi256_si128(packed));
+    _mm_storeu_si128((__m128i *) (out + i / 8 * 5 + 10), _mm256_extracti128_si256(packed, 1));
+  }
+  i = packStepsSsse3(chars, count, out, i);
+  packScalar(chars + i, count - i, out + i / 8 * 5);
+}
+
+__attribute__((target("avx2")))
+static void unpackAvx2(const unsigned char *in, size_t count, char *out) {
+  const __m256i spread = _mm256_setr_epi8(0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1,
+                                          0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 48 <= count; i += 32) {
+    const unsigned char *source = in + i / 8 * 5;
+    __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) source)),
+                                            _mm_loadu_si128((const __m128i *) (source + 10)), 1);
+    __m256i groups = _mm256_shuffle_epi8(bytes, spread);
+    __m256i quads = _mm256_or_si256(_mm256_and_si256(groups, _mm256_set1_epi64x(0xFFFFF)),
+                                    _mm256_slli_epi64(_mm256_srli_epi64(groups, 20), 32));
+    __m256i pairs = _mm256_or_si256(_mm256_and_si256(quads, _mm256_set1_epi32(0x3FF)),
+                                    _mm256_slli_epi32(_mm256_srli_epi32(quads, 10), 16));
+    __m256i values = _mm256_or_si256(_mm256_and_si256(pairs, _mm256_set1_epi16(0x1F)),
+                                     _mm256_slli_epi16(_mm256_srli_epi16(pairs, 5), 8));
+    _mm256_storeu_si256((__m256i *) (out + i), toCharsAvx2(values));
+  }
+  i = unpackStepsSsse3(in, count, out, i);
+  unpackScalar(in + i / 8 * 5, count - i, out + i);
+}
+
+#endif
+
+// -- Dispatch --
+// ----------------------------------------------------------------------------------------------
+
+static inline int packScalarSupported(void) {
+  return 1;
+}
+
+// Kernels in order of preference; the scalar kernel is always last and always available
+static const PackImpl packImpls[] = {
+#ifdef OTP_CIPHER_X86
+  { "avx2", avx2Supported, packAvx2, unpackAvx2 },
+  { "ssse3", ssse3Supported, packSsse3, unpackSsse3 },
+#endif
+  { "scalar", packScalarSupported, packScalar, unpackScalar },
+};
+
+#define OTP_PACK_IMPL_COUNT (sizeof(packImpls) / sizeof(packImpls[0]))
+
+static const PackImpl *activePack = NULL;
+
+// Function: Compare a kernel with the scalar one on every length up to 160 symbols at odd offsets:
+// packing any bytes, and unpacking arbitrary bits. Returns 1 when they agree bit for bit
+static inline int packSelfTest(const PackImpl *impl) {
+  enum { TEST_SIZE = 160, TEST_OFFSETS = 7 };
+  char chars[TEST_SIZE + TEST_OFFSETS], expectedChars[TEST_SIZE], actualChars[TEST_SIZE];
+  unsigned char bytes[TEST_SIZE + TEST_OFFSETS], expected[TEST_SIZE], actual[TEST_SIZE];
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+  // Mostly the alphabet, with a stray byte now and then
+  unsigned int seed = 2463534242u;
+  for (size_t n = 0; n < sizeof(chars); n++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    chars[n] = seed % 11 == 0 ? (char) (seed >> 8) : alphabet[(seed >> 8) % 27];
+    bytes[n] = (unsigned char) (seed >> 16);
+  }
+
+  for (size_t length = 0; length <= TEST_SIZE; length++) {
+    size_t offset = length % TEST_OFFSETS;
+    memset(expected, 0, sizeof(expected));
+    memset(actual, 0, sizeof(actual));
+    packScalar(chars + offset, length, expected);
+    impl->pack(chars + offset, length, actual);
+    unpackScalar(bytes + offset, length, expectedChars);
+    impl->unpack(bytes + offset, length, actualChars);
+    if (memcmp(expected, actual, packedLength(length)) != 0 || memcmp(expectedChars, actualChars, length) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Function: Pick the fastest pack kernel this CPU supports that passes the self test.
+// OTP_PACK=<name> in the environment restricts the choice to that kernel (or scalar)
+static inline const PackImpl *initPack(void) {
+  if (activePack != NULL) {
+    return activePack;
+  }
+
+  const char *forced = getenv("OTP_PACK");
+  const PackImpl *chosen = &packImpls[OTP_PACK_IMPL_COUNT - 1];
+
+  for (size_t i = 0; i + 1 < OTP_PACK_IMPL_COUNT; i++) {
+    const PackImpl *impl = &packImpls[i];
+    if (forced != NULL && strcmp(forced, impl->name) != 0) {
+      continue;
+    }
+    if (!impl->supported()) {
+      continue;
+    }
+    if (!packSelfTest(impl)) {
+      fprintf(stderr, "PACK: %s kernel disagrees with the scalar one, skipping it\n", impl->name);
+      continue;
+    }
+    chosen = impl;
+    break;
+  }
+
+  activePack = chosen;
+  return activePack;
+}
+
+// Function: Pack `count` characters into packedLength(count) bytes. `out` may alias `chars`
+static inline void packSymbols(const char *chars, size_t count, unsigned char *out) {
+  initPack()->pack(chars, count, out);
+}
+
+// Function: Unpack `count` symbols into characters. `out` must not overlap `in`
+static inline void unpackSymbols(const unsigned char *in, size_t count, char *out) {
+  initPack()->unpack(in, count, out);
+}
+
+// -- Packed Cipher --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Transform `count` packed symbols of text with as many packed key symbols, leaving the
+// packed output over the text. One OTP_PACK_BLOCK at a time is unpacked into scratch that stays
+// in L1, transformed (or, with `verify`, encrypted and checked by cipherVerify()) and packed back.
+// Returns the number of symbols that failed a verify round trip
+static inline uint64_t transformPacked(unsigned char *text, const unsigned char *key, size_t count,
+                                       CipherKernel transform, int verify) {
+  char plain[OTP_PACK_BLOCK], keyChars[OTP_PACK_BLOCK];
+  uint64_t mismatches = 0;
+
+  for (size_t done = 0; done < count; done += OTP_PACK_BLOCK) {
+    size_t block = count - done < OTP_PACK_BLOCK ? count - done : OTP_PACK_BLOCK;
+    size_t offset = done / OTP_PACK_GROUP * OTP_PACK_GROUP_BYTES;
+    unpackSymbols(text + offset, block, plain);
+    unpackSymbols(key + offset, block, keyChars);
+    if (verify) {
+      mismatches += cipherVerify(plain, keyChars, plain, block);
+    } else {
+      transform(plain, keyChars, plain, block);
+    }
+    packSymbols(plain, block, text + offset);
+  }
+  return mismatches;
+}
+
+#endif
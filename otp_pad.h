@@ -0,0 +1,217 @@
+#ifndef OTP_PAD_H
+#define OTP_PAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_proto.h"
+
+// Registered pads (-k dir).
+//
+// A pad is a large key made once by keygen and spent in pieces. Every file
+// ID.pad in the directory is mapped read-only at startup, before any worker
+// exists, so forked children, pool processes, threads and event loops all
+// read the same pages. A framed request with OTP_FLAG_PAD names a pad and an
+// offset instead of carrying key bytes (otp_proto.h); the cipher reads the key
+// straight out of the mapping.
+//
+// A pad range must never encrypt twice. Beside each pad the server keeps a
+// ledger, ID.used: one bit per pad byte, set once that byte has encrypted
+// something. It is a MAP_SHARED mapping of the file, claimed with atomic ORs,
+// so concurrent workers cannot both win an overlapping range, and it is synced
+// to disk before a single byte of ciphertext goes out, so a restart cannot
+// forget a claim. Decryption reads pads without claiming anything.
+
+#define OTP_MAX_PADS 256
+#define OTP_PAD_SUFFIX ".pad"
+#define OTP_LEDGER_SUFFIX ".used"
+
+typedef struct {
+  uint32_t id;
+  const char *data;
+  uint64_t length;          // Key bytes, up to the first newline
+  size_t mapped;
+  uint64_t *ledger;         // Bit i of word w: pad byte 64 * w + i has been used
+  size_t ledgerSize;        // In bytes, a whole number of words
+} Pad;
+
+static Pad padRegistry[OTP_MAX_PADS];
+static size_t padCount = 0;
+
+// -- Registry --
+// ----------------------------------------------------------------------------------------------
+
+// Function: The registered pad with this ID, or NULL
+static inline Pad *findPad(uint32_t id) {
+  for (size_t i = 0; i < padCount; i++) {
+    if (padRegistry[i].id == id) {
+      return &padRegistry[i];
+    }
+  }
+  return NULL;
+}
+
+// Function: Open (or create) a pad's ledger file and map it shared. Returns 0 on success
+static inline int mapLedger(const char *dir, Pad *pad) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%u%s", dir, pad->id, OTP_LEDGER_SUFFIX);
+  pad->ledgerSize = (size_t) ((pad->length + 63) / 64) * sizeof(uint64_t);
+
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0 ||
+      ((size_t) info.st_size < pad->ledgerSize && ftruncate(fd, pad->ledgerSize) < 0)) {
+    close(fd);
+    return -1;
+  }
+  void *mapping = mmap(NULL, pad->ledgerSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return -1;
+  }
+  pad->ledger = mapping;
+  return 0;
+}
+
+// Function: Map one pad file and its ledger. Returns 0 on success, -1 on error
+static inline int registerPad(const char *dir, const char *name, uint32_t id) {
+  if (padCount == OTP_MAX_PADS || findPad(id) != NULL) {
+    errno = padCount == OTP_MAX_PADS ? ENOSPC : EEXIST;
+    return -1;
+  }
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    return -1;
+  }
+  void *mapping = info.st_size > 0 ? mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    errno = info.st_size > 0 ? errno : EINVAL;
+    return -1;
+  }
+
+  // Like a key file, a pad runs to its first newline
+  Pad *pad = &padRegistry[padCount];
+  const char *newline = memchr(mapping, '\n', info.st_size);
+  pad->id = id;
+  pad->data = mapping;
+  pad->mapped = info.st_size;
+  pad->length = newline != NULL ? (uint64_t) (newline - (const char *) mapping) : (uint64_t) info.st_size;
+  if (pad->length == 0) {
+    munmap(mapping, info.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  if (mapLedger(dir, pad) < 0) {
+    munmap(mapping, info.st_size);
+    return -1;
+  }
+  padCount++;
+  return 0;
+}
+
+// Function: Register every ID.pad file in `dir`. Call before any worker is started. Returns
+// the number of pads registered, or -1 after reporting the first one that failed
+static inline int registerPads(const char *dir) {
+  DIR *directory = opendir(dir);
+  if (directory == NULL) {
+    fprintf(stderr, "ERROR opening pad directory %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    char *end;
+    unsigned long id = strtoul(entry->d_name, &end, 10);
+    if (end == entry->d_name || strcmp(end, OTP_PAD_SUFFIX) != 0 || id > UINT32_MAX) {
+      continue;
+    }
+    if (registerPad(dir, entry->d_name, (uint32_t) id) < 0) {
+      fprintf(stderr, "ERROR registering pad %s/%s: %s\n", dir, entry->d_name, strerror(errno));
+      closedir(directory);
+      return -1;
+    }
+  }
+  closedir(directory);
+  return (int) padCount;
+}
+
+// -- Ledger --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Ledger bits of word `word` that fall inside [start, end)
+static inline uint64_t ledgerMask(uint64_t word, uint64_t start, uint64_t end) {
+  uint64_t first = start > word * 64 ? start - word * 64 : 0;
+  uint64_t last = end < word * 64 + 64 ? end - word * 64 : 64;
+  uint64_t high = last == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << last) - 1;
+  return high & ~(((uint64_t) 1 << first) - 1);
+}
+
+// Function: Mark [offset, offset + length) of a pad used and sync the ledger to disk. Either the
+// whole range is claimed or none of it is. Returns 0 on success, -1 when any byte of it was
+// already used (errno EEXIST) or the ledger could not be synced
+static inline int claimPadRange(Pad *pad, uint64_t offset, uint64_t length) {
+  uint64_t end = offset + length;
+  uint64_t firstWord = offset / 64;
+  uint64_t endWord = (end + 63) / 64;
+
+  for (uint64_t word = firstWord; word < endWord; word++) {
+    uint64_t mask = ledgerMask(word, offset, end);
+    uint64_t previous = __atomic_fetch_or(&pad->ledger[word], mask, __ATOMIC_ACQ_REL);
+    if (previous & mask) {
+      // Give back what this claim set, and only that: the overlapping bits belong to someone else
+      __atomic_fetch_and(&pad->ledger[word], ~(mask & ~previous), __ATOMIC_ACQ_REL);
+      while (word-- > firstWord) {
+        __atomic_fetch_and(&pad->ledger[word], ~ledgerMask(word, offset, end), __ATOMIC_ACQ_REL);
+      }
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  // msync() works on whole pages
+  uintptr_t pageMask = (uintptr_t) sysconf(_SC_PAGESIZE) - 1;
+  uintptr_t syncStart = (uintptr_t) (pad->ledger + firstWord) & ~pageMask;
+  uintptr_t syncEnd = (uintptr_t) (pad->ledger + endWord);
+  return msync((void *) syncStart, syncEnd - syncStart, MS_SYNC);
+}
+
+// Function: Key bytes for a pad request: `length` bytes of pad `id` at `offset`, claimed first when
+// they will encrypt. Returns a pointer into the pad, or NULL with *reason set for the client
+static inline const char *lookupPad(uint32_t id, uint64_t offset, uint64_t length, int claim,
+                                    const char **reason) {
+  Pad *pad = findPad(id);
+  if (pad == NULL) {
+    *reason = "unknown pad";
+    return NULL;
+  }
+  if (offset > pad->length || length > pad->length - offset) {
+    *reason = "pad range out of bounds";
+    return NULL;
+  }
+  if (claim && length > 0 && claimPadRange(pad, offset, length) < 0) {
+    *reason = errno == EEXIST ? "pad range already used" : "pad ledger not synced";
+    return NULL;
+  }
+  return pad->data + offset;
+}
+
+#endif
@@ -0,0 +1,291 @@
+#ifndef OTP_PARALLEL_H
+#define OTP_PARALLEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_pack.h"
+
+// Parallel cipher for large framed requests (-p threads).
+//
+// A request whose text is at least OTP_PARALLEL_THRESHOLD bytes is received a
+// window of OTP_PARALLEL_WINDOW chunk pairs at a time. The window is cut into
+// OTP_PARALLEL_BLOCK-sized tasks that the calling worker and the pool threads
+// run together, and the transformed chunks are sent back in order. Smaller
+// requests, and any request that finds the pool busy with another connection's
+// window, are transformed inline as before.
+//
+// Scheduling: every participant owns an equal range of task indexes with its
+// own atomic cursor, drains it, then steals from the other ranges' cursors, so
+// a participant that falls behind (descheduled, slower core) is picked up by
+// the rest without a shared queue.
+//
+// Threads do not survive fork(), so each process starts its own pool the first
+// time it needs one; worker threads of one process (-t) share it, and the first
+// of them to need it starts it under a lock. Event loops (-e) keep transforming inline: their chunks
+// are interleaved with other connections and never wait for a whole window.
+
+#define OTP_PARALLEL_THRESHOLD (1 << 20)
+#define OTP_PARALLEL_WINDOW 16          // Chunk pairs per window: 1 MB of text
+#define OTP_PARALLEL_BLOCK (16 << 10)   // Task size, small enough to stay in L1/L2
+#define OTP_PARALLEL_MAX_THREADS 64
+
+typedef void (*RangeTask)(void *context, size_t index);
+
+typedef struct {
+  size_t next;                          // Atomic cursor
+  size_t end;
+  char padding[64 - 2 * sizeof(size_t)];
+} TaskRange;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  int threads;
+  int busy;                             // A window is being processed
+  int running;                          // Pool threads still inside the current job
+  unsigned long generation;
+
+  RangeTask task;
+  void *context;
+  int participants;
+  TaskRange ranges[OTP_PARALLEL_MAX_THREADS + 1];
+} CipherPool;
+
+typedef struct {
+  CipherPool *pool;
+  int id;
+} PoolThreadArgs;
+
+static int cipherPoolThreads = 0;       // Configured with -p; 0 keeps every request inline
+static CipherPool *cipherPool = NULL;   // Guarded by cipherPoolLock, like cipherPoolOwner
+static pid_t cipherPoolOwner = 0;
+static pthread_mutex_t cipherPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cipherPoolForkOnce = PTHREAD_ONCE_INIT;
+
+// -- Work Stealing --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Run tasks from our own range, then steal from everyone else's
+static inline void runPoolTasks(CipherPool *pool, int id) {
+  for (int offset = 0; offset < pool->participants; offset++) {
+    TaskRange *range = &pool->ranges[(id + offset) % pool->participants];
+    size_t index;
+    while ((index = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED)) < range->end) {
+      pool->task(pool->context, index);
+    }
+  }
+}
+
+static void *cipherPoolThreadMain(void *arg) {
+  PoolThreadArgs *args = arg;
+  CipherPool *pool = args->pool;
+  unsigned long seen = 0;
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    runPoolTasks(pool, args->id);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+// fork() handlers keeping cipherPoolLock consistent: a child must not inherit it held by a thread
+// that does not exist there
+static void lockCipherPool(void) {
+  pthread_mutex_lock(&cipherPoolLock);
+}
+
+static void unlockCipherPool(void) {
+  pthread_mutex_unlock(&cipherPoolLock);
+}
+
+static void registerCipherPoolFork(void) {
+  pthread_atfork(lockCipherPool, unlockCipherPool, unlockCipherPool);
+}
+
+// Function: This process's pool, started on first use. Worker threads whose first large requests
+// arrive together race here, so the check and the start happen under cipherPoolLock and exactly
+// one pool is started per process. Returns NULL when parallel cipher is off or the pool cannot
+// be started
+static inline CipherPool *getCipherPool(void) {
+  if (cipherPoolThreads <= 0) {
+    return NULL;
+  }
+  pthread_once(&cipherPoolForkOnce, registerCipherPoolFork);
+  pthread_mutex_lock(&cipherPoolLock);
+  if (cipherPool != NULL && cipherPoolOwner == getpid()) {
+    CipherPool *pool = cipherPool;
+    pthread_mutex_unlock(&cipherPoolLock);
+    return pool;
+  }
+
+  // A pool inherited across fork() has no threads behind it; start a fresh one
+  CipherPool *pool = calloc(1, sizeof(CipherPool));
+  if (pool == NULL) {
+    pthread_mutex_unlock(&cipherPoolLock);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int i = 0; i < cipherPoolThreads; i++) {
+    PoolThreadArgs *args = malloc(sizeof(PoolThreadArgs));
+    pthread_t thread;
+    if (args == NULL) {
+      break;
+    }
+    args->pool = pool;
+    args->id = i + 1;  // The caller is participant 0
+    if (pthread_create(&thread, NULL, cipherPoolThreadMain, args) != 0) {
+      free(args);
+      break;
+    }
+    pthread_detach(thread);
+    pool->threads++;
+  }
+
+  cipherPool = pool;
+  cipherPoolOwner = getpid();
+  pthread_mutex_unlock(&cipherPoolLock);
+  return pool;
+}
+
+// Function: Run task(context, i) for every i below `count` on the pool, the caller included.
+// Returns 0 once all have run, or -1 without running any when the pool is off or busy
+static inline int parallelFor(size_t count, RangeTask task, void *context) {
+  CipherPool *pool = getCipherPool();
+  if (pool == NULL || pool->threads == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->busy) {
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+  }
+  pool->busy = 1;
+
+  // Equal ranges, one per participant
+  pool->task = task;
+  pool->context = context;
+  pool->participants = pool->threads + 1;
+  for (int i = 0; i < pool->participants; i++) {
+    pool->ranges[i].next = count * i / pool->participants;
+    pool->ranges[i].end = count * (i + 1) / pool->participants;
+  }
+  pool->running = pool->threads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  runPoolTasks(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->busy = 0;
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+// -- Cipher Windows --
+// ----------------------------------------------------------------------------------------------
+
+// A window as it arrives off the wire: text chunk, key chunk, text chunk, ... with every chunk
+// OTP_CHUNK_SIZE long except the last pair's. For pad requests the window holds only the text
+// chunks and the key is read from the pad (otp_pad.h), `pad` pointing at the window's first byte.
+// A verify window (OTP_OP_VERIFY) runs cipherVerify() in place of `transform` and adds up the bytes
+// that failed the round trip in `mismatches`. A packed window (OTP_FLAG_PACKED) holds the same pairs
+// in the packed format, OTP_PACKED_CHUNK_SIZE bytes to a full chunk, and stays packed throughout
+typedef struct {
+  char *window;
+  uint64_t textLength;
+  ChunkTransform transform;
+  const char *pad;
+  int verify;
+  uint64_t mismatches;                  // Atomic
+  int packed;
+} CipherWindow;
+
+// Function: Text of pair `pair` within a window; its key chunk follows it unless the key is a pad.
+// `length` is in symbols, which for a packed window take packedLength() bytes
+static inline char *windowText(const CipherWindow *window, size_t pair, size_t *length) {
+  uint64_t remaining = window->textLength - (uint64_t) pair * OTP_CHUNK_SIZE;
+  *length = remaining < OTP_CHUNK_SIZE ? (size_t) remaining : OTP_CHUNK_SIZE;
+  size_t chunkBytes = window->packed ? OTP_PACKED_CHUNK_SIZE : OTP_CHUNK_SIZE;
+  return window->window + pair * (window->pad != NULL ? 1 : 2) * chunkBytes;
+}
+
+static void cipherWindowTask(void *context, size_t index) {
+  CipherWindow *window = context;
+  size_t offset = index * OTP_PARALLEL_BLOCK;
+  size_t pair = offset / OTP_CHUNK_SIZE;
+  size_t inPair = offset % OTP_CHUNK_SIZE;
+
+  size_t pairLength;
+  char *text = windowText(window, pair, &pairLength);
+  size_t length = pairLength - inPair < OTP_PARALLEL_BLOCK ? pairLength - inPair : OTP_PARALLEL_BLOCK;
+  uint64_t mismatches;
+  if (window->packed) {
+    // Blocks are whole groups, so each starts on a byte of the packed text and key
+    unsigned char *packedText = (unsigned char *) text + packedLength(inPair);
+    mismatches = transformPacked(packedText, packedText + packedLength(pairLength), length,
+                                 window->transform, window->verify);
+  } else {
+    const char *key = window->pad != NULL ? window->pad + offset : text + pairLength + inPair;
+    if (!window->verify) {
+      window->transform(text + inPair, key, text + inPair, length);
+      return;
+    }
+    mismatches = cipherVerify(text + inPair, key, text + inPair, length);
+  }
+  if (mismatches > 0) {
+    __atomic_fetch_add(&window->mismatches, mismatches, __ATOMIC_RELAXED);
+  }
+}
+
+// Function: Transform every pair of a window in place, across the pool when it is free
+static inline void transformWindow(CipherWindow *window) {
+  size_t blocks = (window->textLength + OTP_PARALLEL_BLOCK - 1) / OTP_PARALLEL_BLOCK;
+  if (blocks > 1 && parallelFor(blocks, cipherWindowTask, window) == 0) {
+    return;
+  }
+  for (size_t i = 0; i < blocks; i++) {
+    cipherWindowTask(window, i);
+  }
+}
+
+// Function: Send a transformed window's text chunks, in order, in one gathered write
+static inline int sendWindow(int socketFD, const CipherWindow *window) {
+  struct iovec vector[OTP_PARALLEL_WINDOW];
+  int count = 0;
+  for (size_t pair = 0; (uint64_t) pair * OTP_CHUNK_SIZE < window->textLength; pair++) {
+    size_t length;
+    vector[count].iov_base = windowText(window, pair, &length);
+    vector[count].iov_len = window->packed ? packedLength(length) : length;
+    count++;
+  }
+  return sendAllVector(socketFD, vector, count);
+}
+
+#endif
@@ -0,0 +1,420 @@
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Shared wire helpers for the enc/dec clients and servers.
+//
+// Framed mode is negotiated during the handshake: the client appends
+// OTP_VERSION_SUFFIX ("/2") to its identifier and the server echoes it back
+// when it speaks protocol version 2. A peer that does not echo it is spoken
+// to with the original newline protocol.
+//
+// Every framed message starts with a fixed OTP_HEADER_SIZE header, all fields
+// in network byte order:
+//   version (1) | type (1) | flags (2) | reserved (4) | textLength (8) | keyLength (8)
+//
+// OTP_MSG_REQUEST body: text and key interleaved in blocks of
+//   min(OTP_CHUNK_SIZE, remaining) text bytes followed by as many key bytes,
+//   then any key bytes beyond textLength (read and discarded).
+// OTP_MSG_RESPONSE body: textLength transformed bytes, streamed chunk by chunk.
+// OTP_MSG_ERROR body: textLength bytes of human readable reason.
+//
+// The low bits of a request's flags name its operation (OTP_OP_*); 0 asks for
+// the default of the identifier the client connected with. A server that
+// offers more than that default lists the operations it accepts after the
+// version suffix of its handshake reply ("ENC_SERVER/2:ED").
+//
+// With OTP_FLAG_PAD set, a request carries no key: the key is textLength bytes
+// of a pad registered on the server (otp_pad.h), whose ID is in the reserved
+// field and whose offset is in keyLength, and the body is the text alone, in
+// OTP_CHUNK_SIZE blocks. Servers with pads add 'P' to the list in their
+// handshake reply ("ENC_SERVER/2:EDP"), which can run past 16 bytes, so replies
+// are read into OTP_HANDSHAKE_SIZE buffers.
+//
+// OTP_OP_VERIFY encrypts and, block by block, decrypts the ciphertext again
+// with the same key to check it comes back as the text. Its OTP_MSG_RESPONSE
+// header has keyLength OTP_VERIFY_TRAILER_SIZE: the ciphertext is followed by
+// a trailer holding the number of text bytes that did not survive the round
+// trip (a uint64, network order), so 0 means the request verified. Servers
+// that offer it list 'V' ("ENC_SERVER/2:EV").
+//
+// Over a Unix domain socket a client may instead share memory with the server
+// (otp_shm.h). OTP_MSG_ATTACH passes a memfd of textLength bytes as SCM_RIGHTS
+// with its header and is answered with an empty OTP_MSG_RESPONSE (or an
+// error). A request with OTP_FLAG_SHM then carries a OTP_SHM_DOORBELL_SIZE body,
+// the offsets of its text and key inside that region (two uint64s, network
+// order), and the server transforms the text in place: the OTP_FLAG_SHM response
+// carries only the verify trailer, if any. Servers that take it list 'M'.
+//
+// With OTP_FLAG_PACKED set, text and key travel in the 5-bit packed format of
+// otp_pack.h, 8 symbols to 5 bytes; textLength and keyLength still count
+// symbols. Each block of min(OTP_CHUNK_SIZE, remaining) text symbols takes
+// packedLength() bytes and is followed by the same for its key, and extra key
+// symbols are packed on their own after the last block. The OTP_FLAG_PACKED
+// response carries packedLength(textLength) bytes of packed output (before any
+// verify trailer). Packing does not mix with pads or shared memory. Servers
+// that take it list 'C' (compact).
+//
+// A server shedding load answers OTP_BUSY_REPLY in place of its handshake reply
+// and closes the connection; nothing on it is served.
+//
+// A connection carries any number of requests (a session). Clients may
+// pipeline them; the server answers in order and the session ends when the
+// client closes its side between requests.
+//
+// Lengths are explicit, so no reads scan for terminators and payloads may
+// contain any byte.
+
+#define OTP_CHUNK_SIZE 65536
+#define OTP_PROTO_VERSION 2
+#define OTP_VERSION_SUFFIX "/2"
+#define OTP_HEADER_SIZE 24
+#define OTP_MAX_ERROR_LENGTH 256
+#define OTP_CLIENT_ID_SIZE 16      // Client identifiers are read 15 bytes at most
+#define OTP_HANDSHAKE_SIZE 32      // Room for any handshake reply
+#define OTP_BUSY_REPLY "SERVER_BUSY"
+#define OTP_VERIFY_TRAILER_SIZE 8
+
+enum {
+  OTP_MSG_REQUEST = 1,
+  OTP_MSG_RESPONSE = 2,
+  OTP_MSG_ERROR = 3,
+  OTP_MSG_ATTACH = 4         // Client hands over a shared memory region (fd passed with the header)
+};
+
+// Request operations, carried in FrameHeader.flags & OTP_FLAG_OP_MASK
+enum {
+  OTP_OP_DEFAULT = 0,
+  OTP_OP_ENCRYPT = 1,
+  OTP_OP_DECRYPT = 2,
+  OTP_OP_VERIFY = 3,        // Encrypt, and check the ciphertext decrypts back to the text
+  OTP_OP_COUNT
+};
+
+#define OTP_FLAG_OP_MASK 0x000F
+#define OTP_FLAG_PAD 0x0010        // Key comes from a registered pad: reserved = ID, keyLength = offset
+#define OTP_FLAG_SHM 0x0020        // Text and key are in the attached region; the body holds their offsets
+#define OTP_FLAG_PACKED 0x0040     // Text, key and output are 5-bit packed symbols (otp_pack.h)
+#define OTP_SHM_DOORBELL_SIZE 16
+#define OTP_PACKED_CHUNK_SIZE (OTP_CHUNK_SIZE / 8 * 5)
+
+// parseServerOps() bits for a server with registered pads, one taking shared memory and one
+// taking packed requests; operations use bits below 16
+#define OTP_SERVER_PADS (1u << 16)
+#define OTP_SERVER_SHM (1u << 17)
+#define OTP_SERVER_PACKED (1u << 18)
+
+typedef struct {
+  uint8_t version;
+  uint8_t type;
+  uint16_t flags;
+  uint32_t reserved;
+  uint64_t textLength;
+  uint64_t keyLength;
+} FrameHeader;
+
+typedef void (*ChunkTransform)(const char *text, const char *key, char *out, size_t length);
+
+// Function: Handshake letter advertising an operation
+static inline char otpOpLetter(int op) {
+  return op == OTP_OP_ENCRYPT ? 'E' : op == OTP_OP_DECRYPT ? 'D' : op == OTP_OP_VERIFY ? 'V' : '?';
+}
+
+// Function: Name of an operation for messages and manifests
+static inline const char *otpOpName(int op) {
+  static const char *const names[OTP_OP_COUNT] = { "default", "encrypt", "decrypt", "verify" };
+  return op >= 0 && op < OTP_OP_COUNT ? names[op] : "unknown";
+}
+
+// Function: Parse the operations a framed server lists after ':' in its handshake reply, as a
+// bitmask of (1 << op), plus OTP_SERVER_PADS for 'P', OTP_SERVER_SHM for 'M' and OTP_SERVER_PACKED
+// for 'C'. Returns 0 when the reply lists none
+static inline unsigned parseServerOps(const char *reply) {
+  const char *list = strchr(reply, ':');
+  unsigned ops = 0;
+  for (; list != NULL && *list != '\0'; list++) {
+    if (*list == 'E') {
+      ops |= 1u << OTP_OP_ENCRYPT;
+    } else if (*list == 'D') {
+      ops |= 1u << OTP_OP_DECRYPT;
+    } else if (*list == 'V') {
+      ops |= 1u << OTP_OP_VERIFY;
+    } else if (*list == 'P') {
+      ops |= OTP_SERVER_PADS;
+    } else if (*list == 'M') {
+      ops |= OTP_SERVER_SHM;
+    } else if (*list == 'C') {
+      ops |= OTP_SERVER_PACKED;
+    }
+  }
+  return ops;
+}
+
+// Function: Bytes that `symbols` symbols take in the packed format: 5 per group of 8, and
+// ceil(5n / 8) for a final group of n
+static inline uint64_t packedLength(uint64_t symbols) {
+  return symbols / 8 * 5 + (symbols % 8 * 5 + 7) / 8;
+}
+
+// Function: Bytes that follow a request header on the wire: text and key, the text alone when
+// the key comes from a pad, just the offsets when both are in shared memory, or both packed
+static inline uint64_t requestBodyLength(const FrameHeader *request) {
+  if (request->flags & OTP_FLAG_SHM) {
+    return OTP_SHM_DOORBELL_SIZE;
+  }
+  if (request->flags & OTP_FLAG_PACKED) {
+    uint64_t extraKey = request->keyLength > request->textLength ? request->keyLength - request->textLength : 0;
+    return 2 * packedLength(request->textLength) + packedLength(extraKey);
+  }
+  return (request->flags & OTP_FLAG_PAD) ? request->textLength : request->textLength + request->keyLength;
+}
+
+// -- Byte Helpers --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Send exactly `length` bytes. Returns 0 on success, -1 on error
+static inline int sendAll(int socketFD, const char *data, size_t length) {
+  size_t totalSent = 0;
+
+  while (totalSent < length) {
+    ssize_t sentAmount = send(socketFD, data + totalSent, length - totalSent, MSG_NOSIGNAL);
+    if (sentAmount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    totalSent += sentAmount;
+  }
+  return 0;
+}
+
+// Function: Turn off Nagle's algorithm. Peers always write whole messages, and a small write
+// held back for the ACK of the previous one would cost a delayed-ACK timeout (~40 ms)
+static inline void setNoDelay(int socketFD) {
+  int noDelay = 1;
+  setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+}
+
+// Function: Advance an iovec array past `amount` sent bytes. Returns the first entry not fully
+// sent; `*count` is reduced to the entries left
+static inline struct iovec *advanceVector(struct iovec *vector, int *count, size_t amount) {
+  while (*count > 0 && amount >= vector->iov_len) {
+    amount -= vector->iov_len;
+    vector++;
+    (*count)--;
+  }
+  if (*count > 0) {
+    vector->iov_base = (char *) vector->iov_base + amount;
+    vector->iov_len -= amount;
+  }
+  return vector;
+}
+
+// Function: Send every byte of an iovec array (gathered straight from the caller's buffers, no
+// staging copy). The array is consumed. Returns 0 on success, -1 on error
+static inline int sendAllVector(int socketFD, struct iovec *vector, int count) {
+  while (count > 0) {
+    struct msghdr message = { .msg_iov = vector, .msg_iovlen = count };
+    ssize_t sentAmount = sendmsg(socketFD, &message, MSG_NOSIGNAL);
+    if (sentAmount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    vector = advanceVector(vector, &count, sentAmount);
+  }
+  return 0;
+}
+
+// Function: Receive exactly `length` bytes. Returns 0 on success, -1 on error or early close
+static inline int recvAll(int socketFD, char *data, size_t length) {
+  size_t totalReceived = 0;
+
+  while (totalReceived < length) {
+    ssize_t charsRead = recv(socketFD, data + totalReceived, length - totalReceived, 0);
+    if (charsRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (charsRead <= 0) {
+      return -1;
+    }
+    totalReceived += charsRead;
+  }
+  return 0;
+}
+
+// Function: Read exactly `length` bytes from a file descriptor. Returns 0 on success
+static inline int readAll(int fd, char *data, size_t length) {
+  size_t totalRead = 0;
+
+  while (totalRead < length) {
+    ssize_t readAmount = read(fd, data + totalRead, length - totalRead);
+    if (readAmount < 0 && errno == EINTR) {
+      continue;
+    }
+    if (readAmount <= 0) {
+      return -1;
+    }
+    totalRead += readAmount;
+  }
+  return 0;
+}
+
+// Function: Write exactly `length` bytes to a file descriptor. Returns 0 on success
+static inline int writeAll(int fd, const char *data, size_t length) {
+  size_t totalWritten = 0;
+
+  while (totalWritten < length) {
+    ssize_t written = write(fd, data + totalWritten, length - totalWritten);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    totalWritten += written;
+  }
+  return 0;
+}
+
+// Function: Map `length` bytes of a freshly truncated output file. Returns NULL on failure, with
+// any file it created removed so nothing half-written is left behind
+static inline char *mapOutputFile(const char *path, size_t length) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, length) == 0) {
+    mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    unlink(path);
+    return NULL;
+  }
+  return mapping;
+}
+
+// Function: Store a 64-bit value in network byte order
+static inline void putUint64(unsigned char *out, uint64_t value) {
+  for (int i = 7; i >= 0; i--) {
+    out[i] = (unsigned char) (value & 0xFF);
+    value >>= 8;
+  }
+}
+
+// Function: Load a 64-bit value stored in network byte order
+static inline uint64_t getUint64(const unsigned char *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | in[i];
+  }
+  return value;
+}
+
+// Function: Serialize a frame header into its OTP_HEADER_SIZE wire form
+static inline void encodeHeader(const FrameHeader *header, unsigned char *out) {
+  out[0] = header->version;
+  out[1] = header->type;
+  out[2] = (unsigned char) (header->flags >> 8);
+  out[3] = (unsigned char) (header->flags & 0xFF);
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = (unsigned char) (header->reserved >> (24 - 8 * i));
+  }
+  putUint64(out + 8, header->textLength);
+  putUint64(out + 16, header->keyLength);
+}
+
+// Function: Parse the OTP_HEADER_SIZE wire form of a frame header
+static inline void decodeHeader(const unsigned char *in, FrameHeader *header) {
+  header->version = in[0];
+  header->type = in[1];
+  header->flags = (uint16_t) ((in[2] << 8) | in[3]);
+  header->reserved = ((uint32_t) in[4] << 24) | ((uint32_t) in[5] << 16) |
+                     ((uint32_t) in[6] << 8) | (uint32_t) in[7];
+  header->textLength = getUint64(in + 8);
+  header->keyLength = getUint64(in + 16);
+}
+
+// Function: Build and send a header. Returns 0 on success, -1 on error
+static inline int sendHeader(int socketFD, uint8_t type, uint16_t flags,
+                             uint64_t textLength, uint64_t keyLength) {
+  FrameHeader header = { OTP_PROTO_VERSION, type, flags, 0, textLength, keyLength };
+  unsigned char wire[OTP_HEADER_SIZE];
+  encodeHeader(&header, wire);
+  return sendAll(socketFD, (const char *) wire, sizeof(wire));
+}
+
+// Function: Receive and parse a header. Returns 0 on success, -1 on error or bad version
+static inline int recvHeader(int socketFD, FrameHeader *header) {
+  unsigned char wire[OTP_HEADER_SIZE];
+  if (recvAll(socketFD, (char *) wire, sizeof(wire)) < 0) {
+    return -1;
+  }
+  decodeHeader(wire, header);
+  return header->version == OTP_PROTO_VERSION ? 0 : -1;
+}
+
+// Function: Bytes of output that follow a response header for a request, before any trailer
+static inline uint64_t responseBodyLength(const FrameHeader *request) {
+  return (request->flags & OTP_FLAG_PACKED) ? packedLength(request->textLength) : request->textLength;
+}
+
+// Function: Report a request failure to the peer as an OTP_MSG_ERROR frame
+static inline int sendErrorFrame(int socketFD, const char *reason) {
+  size_t length = strlen(reason);
+  if (sendHeader(socketFD, OTP_MSG_ERROR, 0, length, 0) < 0) {
+    return -1;
+  }
+  return sendAll(socketFD, reason, length);
+}
+
+// Function: Read and throw away `length` bytes from the socket
+static inline int discardBytes(int socketFD, uint64_t length, char *scratch, size_t scratchSize) {
+  while (length > 0) {
+    size_t part = length < scratchSize ? (size_t) length : scratchSize;
+    if (recvAll(socketFD, scratch, part) < 0) {
+      return -1;
+    }
+    length -= part;
+  }
+  return 0;
+}
+
+// -- Tool Helpers --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Seconds on the monotonic clock, for the benchmarks and batch timings
+static inline double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function: Fill a buffer with random characters from the 27-symbol alphabet
+static inline void fillRandomText(char *buffer, size_t length, unsigned int seed) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  for (size_t i = 0; i < length; i++) {
+    buffer[i] = alphabet[rand_r(&seed) % 27];
+  }
+}
+
+#endif
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_service.h"
+#include "otp_server.h"
+
+#define BUFFER_SIZE 70000
+
+// -- Service --
+// ----------------------------------------------------------------------------------------------
+
+// One process for both directions. enc_client and dec_client connect unchanged and get their
+// usual operation; framed clients may also pick the operation per request, so a single session
+// can mix encryption, decryption and verified encryption
+static const ServiceRole roles[] = {
+  { "ENC_CLIENT", "ENC_SERVER", OTP_OP_ENCRYPT },
+  { "DEC_CLIENT", "DEC_SERVER", OTP_OP_DECRYPT }
+};
+
+static const ServiceSpec service = { roles, 2,
+                                     (1u << OTP_OP_ENCRYPT) | (1u << OTP_OP_DECRYPT) | (1u << OTP_OP_VERIFY) };
+
+// ----------------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]){
+  ServerConfig config;
+  parseServerArgs(argc, argv, &config);
+
+  // Pick the cipher kernel once so every worker inherits the choice
+  initCipher();
+
+  int listenSocket = openListenSocket(&config);
+  runServer(listenSocket, &config, &service);
+
+  // Close the listening socket
+  close(listenSocket);
+  return 0;
+}
@@ -0,0 +1,608 @@
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include "otp_proto.h"
+#include "otp_service.h"
+#include "otp_metrics.h"
+#include "otp_parallel.h"
+#include "otp_event.h"
+#include "otp_uring.h"
+
+// Shared connection runtime for the enc/dec/otp servers.
+//
+// Each server supplies a ServiceSpec (otp_service.h) describing what it offers;
+// the runtime owns the listening socket, the worker model and the per-worker
+// arenas (otp_arena.h), and hands every accepted socket to handleConnection(). Worker models:
+//   fork (default)   fork() a child for every accepted connection
+//   -w N             N pre-forked worker processes, each running accept()
+//   -w N -t          N worker threads in one process sharing the listen socket
+//   -e [-w N]        edge-triggered epoll event loop(s), see otp_event.h
+//   -u [-w N]        io_uring completion loop(s), see otp_uring.h
+//
+// Overload: the accept queue is -b deep (SOMAXCONN by default). With -c N at
+// most N connections are served at once by the fork and event models; the fork
+// model parks up to -q more (N by default) until a child exits, and anything
+// beyond that is answered OTP_BUSY_REPLY and closed straight away, so a spike
+// costs the extra clients a fast retry instead of everyone a slow queue. Pools
+// are bounded by -w already; connections wait for them in the accept queue.
+//
+// Listeners: TCP on the port, IPv4 by default or dual-stack IPv6 with -6, or a
+// Unix domain socket for same-host clients when the endpoint is unix:PATH.
+// Every worker of a pool or loop model normally accepts on the one socket. With
+// -s each of the -w workers (or loops) gets a TCP listener of its own, all bound
+// to the port with SO_REUSEPORT, so the kernel spreads connections across the
+// shards and no accept queue or lock is shared; -a pins worker i to the i-th CPU
+// the server may run on.
+
+typedef struct {
+  int port;
+  const char *unixPath; // Listen on this Unix domain socket (unix:PATH) instead of the port
+  int ipv6;        // Listen on IPv6, dual-stack so IPv4 clients still connect
+  int sharded;     // One SO_REUSEPORT listener per worker or loop
+  int pinWorkers;  // Pin worker (or loop) i to CPU slot i
+  int workers;     // 0 selects fork-per-connection
+  int threaded;    // Workers are threads rather than processes
+  int eventDriven; // Serve from epoll event loops instead of blocking workers
+  int uring;       // Serve from io_uring loops instead of blocking workers
+  int metricsPort; // Serve otp_metrics.h metrics on this local port; 0 disables them
+  int cipherThreads; // Extra threads per process for large requests (otp_parallel.h); 0 disables
+  const char *padDir; // Directory of registered pads (otp_pad.h), or NULL
+  int backlog;     // listen() backlog
+  int maxConnections; // Connections served at once by the fork and event models; 0 is no limit
+  int queueDepth;  // Fork model: accepted connections parked while at maxConnections
+} ServerConfig;
+
+#define OTP_ACCEPT_BACKOFF_US 10000   // Pause after accept() runs out of descriptors or memory
+
+// Error function used for reporting issues
+static inline void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+// Set up the address struct for the server socket
+static inline void setupAddressStruct(struct sockaddr_in* address,
+                                      int portNumber){
+
+  // Clear out the address struct
+  memset((char*) address, '\0', sizeof(*address));
+
+  // The address should be network capable
+  address->sin_family = AF_INET;
+  // Store the port number
+  address->sin_port = htons(portNumber);
+  // Allow a client at any address to connect to this server
+  address->sin_addr.s_addr = INADDR_ANY;
+}
+
+// Function: Set up an IPv6 wildcard address on the port
+static inline void setupAddressStruct6(struct sockaddr_in6 *address, int portNumber) {
+  memset(address, 0, sizeof(*address));
+  address->sin6_family = AF_INET6;
+  address->sin6_port = htons(portNumber);
+  address->sin6_addr = in6addr_any;
+}
+
+// Function: Set up a Unix domain address. Returns 0, or -1 when the path does not fit
+static inline int setupUnixAddress(struct sockaddr_un *address, const char *path) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    return -1;
+  }
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+// -- Configuration --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Print usage and exit
+static inline void serverUsage(const char *program) {
+  fprintf(stderr, "USAGE: %s port|unix:path [-w workers] [-t] [-e] [-u] [-m metrics-port] [-p cipher-threads]\n"
+                  "       [-k pad-dir] [-b backlog] [-c max-connections] [-q queue] [-6] [-s] [-a]\n", program);
+  fprintf(stderr, "  unix:path   listen on a Unix domain socket instead of a TCP port\n");
+  fprintf(stderr, "  -w workers  serve with a fixed pool of pre-started workers\n");
+  fprintf(stderr, "  -t          make the pool workers threads instead of processes\n");
+  fprintf(stderr, "  -e          serve from non-blocking epoll event loops (-w sets the loop count)\n");
+  fprintf(stderr, "  -u          serve from io_uring completion loops (-w sets the loop count)\n");
+  fprintf(stderr, "  -m port     record stage latencies and counters, served on 127.0.0.1:port\n");
+  fprintf(stderr, "  -p threads  transform requests of 1 MB and up on this many extra threads\n");
+  fprintf(stderr, "  -k dir      serve requests keyed by offset into the pads ID.pad in dir\n");
+  fprintf(stderr, "  -b backlog  accept queue length (default %d)\n", SOMAXCONN);
+  fprintf(stderr, "  -c max      serve at most max connections at once; turn the rest away busy\n");
+  fprintf(stderr, "  -q queue    with -c and forking, park up to queue connections for a free slot\n");
+  fprintf(stderr, "  -6          listen on IPv6 (IPv4 clients still connect)\n");
+  fprintf(stderr, "  -s          give every -w worker its own SO_REUSEPORT listener\n");
+  fprintf(stderr, "  -a          pin every -w worker to a CPU of its own\n");
+  exit(1);
+}
+
+// Function: Parse `port [options]` into a ServerConfig
+static inline void parseServerArgs(int argc, char *argv[], ServerConfig *config) {
+  memset(config, 0, sizeof(*config));
+  config->backlog = SOMAXCONN;
+  config->queueDepth = -1;
+
+  // Check usage & args
+  if (argc < 2 || argv[1][0] == '-') {
+    serverUsage(argv[0]);
+  }
+  if (strncmp(argv[1], "unix:", 5) == 0) {
+    config->unixPath = argv[1] + 5;
+    if (config->unixPath[0] == '\0') {
+      serverUsage(argv[0]);
+    }
+  } else {
+    config->port = atoi(argv[1]);
+  }
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      config->workers = atoi(argv[++i]);
+      if (config->workers <= 0) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-t") == 0) {
+      config->threaded = 1;
+    } else if (strcmp(argv[i], "-e") == 0) {
+      config->eventDriven = 1;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      config->uring = 1;
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      config->metricsPort = atoi(argv[++i]);
+      if (config->metricsPort <= 0) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      config->cipherThreads = atoi(argv[++i]);
+      if (config->cipherThreads <= 0 || config->cipherThreads > OTP_PARALLEL_MAX_THREADS) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      config->padDir = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      config->backlog = atoi(argv[++i]);
+      if (config->backlog <= 0) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      config->maxConnections = atoi(argv[++i]);
+      if (config->maxConnections <= 0) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      config->queueDepth = atoi(argv[++i]);
+      if (config->queueDepth < 0) {
+        serverUsage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "-6") == 0) {
+      config->ipv6 = 1;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      config->sharded = 1;
+    } else if (strcmp(argv[i], "-a") == 0) {
+      config->pinWorkers = 1;
+    } else {
+      serverUsage(argv[0]);
+    }
+  }
+
+  if (config->threaded + config->eventDriven + config->uring > 1) {
+    fprintf(stderr, "%s: -t, -e and -u are separate worker models\n", argv[0]);
+    exit(1);
+  }
+  if (config->threaded && config->workers == 0) {
+    fprintf(stderr, "%s: -t needs a worker count (-w)\n", argv[0]);
+    exit(1);
+  }
+
+  int pooled = config->workers > 0 && !config->eventDriven && !config->uring;
+  if (config->maxConnections > 0 && pooled) {
+    fprintf(stderr, "%s: -w already bounds a worker pool; -c is for the fork, -e and -u models\n", argv[0]);
+    exit(1);
+  }
+  if (config->queueDepth >= 0 && (config->maxConnections == 0 || config->workers > 0 ||
+                                  config->eventDriven || config->uring)) {
+    fprintf(stderr, "%s: -q needs -c and the fork model\n", argv[0]);
+    exit(1);
+  }
+  if (config->queueDepth < 0) {
+    config->queueDepth = config->maxConnections;
+  }
+  if ((config->sharded || config->pinWorkers) && config->workers == 0) {
+    fprintf(stderr, "%s: -s and -a work per worker; they need -w\n", argv[0]);
+    exit(1);
+  }
+  if (config->unixPath != NULL && (config->sharded || config->ipv6)) {
+    fprintf(stderr, "%s: -s and -6 are for TCP listeners, not unix:%s\n", argv[0], config->unixPath);
+    exit(1);
+  }
+}
+
+// Function: Reserve one worker's arena, reused for every request it serves
+static inline void initWorkerArena(WorkerArena *arena) {
+  if (arenaInit(arena, WORKER_ARENA_SIZE) < 0) {
+    error("ERROR allocating worker arena");
+  }
+}
+
+// Function: Create, bind and listen on a server socket: TCP on the port (IPv6 with -6, one of
+// several SO_REUSEPORT shards with -s) or the Unix domain socket of a unix:PATH endpoint
+static inline int openListenSocket(const ServerConfig *config) {
+  struct sockaddr_in serverAddress;
+  struct sockaddr_in6 serverAddress6;
+  struct sockaddr_un unixAddress;
+  struct sockaddr *address = (struct sockaddr *) &serverAddress;
+  socklen_t addressLength = sizeof(serverAddress);
+
+  // Set up the address struct for the server socket
+  if (config->unixPath != NULL) {
+    if (setupUnixAddress(&unixAddress, config->unixPath) < 0) {
+      fprintf(stderr, "ERROR on binding: socket path %s is too long\n", config->unixPath);
+      exit(1);
+    }
+    address = (struct sockaddr *) &unixAddress;
+    addressLength = sizeof(unixAddress);
+  } else if (config->ipv6) {
+    setupAddressStruct6(&serverAddress6, config->port);
+    address = (struct sockaddr *) &serverAddress6;
+    addressLength = sizeof(serverAddress6);
+  } else {
+    setupAddressStruct(&serverAddress, config->port);
+  }
+
+  // Create the socket that will listen for connections
+  int listenSocket = socket(address->sa_family, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
+    error("ERROR opening socket");
+  }
+
+  int enable = 1, disable = 0;
+  if (config->ipv6) {
+    setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+  }
+  if (config->sharded && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+    error("ERROR enabling SO_REUSEPORT");
+  }
+
+  // A socket file left behind by an earlier run would make bind() fail; anything else at the
+  // path is not ours to remove
+  struct stat info;
+  if (config->unixPath != NULL && lstat(config->unixPath, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(config->unixPath);
+  }
+
+  // Associate the socket to the address
+  if (bind(listenSocket, address, addressLength) < 0){
+    error("ERROR on binding");
+  }
+
+  // Start listening for connections. A burst beyond the backlog is dropped by the kernel and
+  // retried by the client a second later, so the queue must cover the bursts we expect
+  if (listen(listenSocket, config->backlog) < 0) {
+    error("ERROR on listen");
+  }
+  return listenSocket;
+}
+
+// -- Worker Models --
+// ----------------------------------------------------------------------------------------------
+
+// Function: accept() that rides out errors: those that only affect one connection attempt, and
+// running out of descriptors or memory, which gets a short pause instead of a busy loop while
+// connections finish. Returns the connection socket, or -1 when the caller should simply try again
+static inline int acceptConnection(int listenSocket) {
+  int connectionSocket = accept(listenSocket, NULL, NULL);
+  if (connectionSocket < 0) {
+    if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("ERROR on accept");
+    }
+    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+      usleep(OTP_ACCEPT_BACKOFF_US);
+    }
+    return -1;
+  }
+  setNoDelay(connectionSocket);
+  return connectionSocket;
+}
+
+// Function: Accept and serve connections forever out of one arena
+static inline void workerLoop(int listenSocket, const ServiceSpec *service, WorkerArena *arena) {
+  while (1) {
+    int connectionSocket = acceptConnection(listenSocket);
+    if (connectionSocket < 0) {
+      continue;
+    }
+    handleConnection(connectionSocket, arena, service);
+    close(connectionSocket);
+  }
+}
+
+// Accepted connections waiting for a child slot (-q), oldest first
+typedef struct {
+  int *sockets;
+  size_t capacity;
+  size_t head;
+  size_t count;
+} ConnectionQueue;
+
+static void noteChildExit(int signal) {
+  (void) signal;  // Only interrupts pselect(); the accept loop does the reaping
+}
+
+// Function: Collect every child that has exited. Returns how many there were
+static inline int reapChildren(void) {
+  int reaped = 0;
+  while (waitpid(-1, NULL, WNOHANG) > 0) {
+    reaped++;
+  }
+  return reaped;
+}
+
+// Function: Fork a child to serve one connection. The child runs with `childMask` as its signal
+// mask. Returns 0 when a child took the connection, -1 when fork failed and it was turned away
+static inline int forkConnection(int listenSocket, int connectionSocket, const ServiceSpec *service,
+                                 const sigset_t *childMask) {
+  uint64_t forkStart = metricsNow();
+  pid_t spawnPid = fork();
+  switch (spawnPid) {
+    case -1:  // Fork failed: out of processes or memory, so shed the connection
+      perror("ERROR on fork");
+      rejectBusy(connectionSocket);
+      return -1;
+
+    case 0: { // Child Process
+      sigprocmask(SIG_SETMASK, childMask, NULL);
+      close(listenSocket);
+      WorkerArena arena;
+      initWorkerArena(&arena);
+      int status = handleConnection(connectionSocket, &arena, service);
+      close(connectionSocket);
+      exit(status == 0 ? 0 : 1);
+    }
+
+    default:  // Parent Process
+      recordStage(STAGE_FORK, forkStart);
+      close(connectionSocket); // Parent closes the connection socket
+      return 0;
+  }
+}
+
+// Function: The original model, one child process per accepted connection. Children are reaped as
+// they exit. With -c, at most that many run at once; further connections are parked (-q) until
+// one exits, and turned away busy once the queue is full too
+static inline void runForkPerConnection(int listenSocket, const ServerConfig *config,
+                                        const ServiceSpec *service) {
+  // runServer() blocked SIGCHLD; it is let through only inside pselect(), so an exit cannot slip in
+  // between reaping and waiting: it either is reaped already or interrupts the wait. Children
+  // run with the same mask as the wait
+  sigset_t waitMask;
+  sigprocmask(SIG_BLOCK, NULL, &waitMask);
+  sigdelset(&waitMask, SIGCHLD);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = noteChildExit;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGCHLD, &action, NULL);
+
+  // Readiness comes from pselect(); a connection aborted before accept() must not block the loop
+  fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+
+  ConnectionQueue queue = { NULL, (size_t) config->queueDepth, 0, 0 };
+  if (queue.capacity > 0 && (queue.sockets = malloc(sizeof(int) * queue.capacity)) == NULL) {
+    error("ERROR allocating connection queue");
+  }
+  int active = 0;
+
+  while (1) {
+    active -= reapChildren();
+
+    // Freed slots go to parked connections first
+    while (queue.count > 0 && (config->maxConnections == 0 || active < config->maxConnections)) {
+      int parked = queue.sockets[queue.head];
+      queue.head = (queue.head + 1) % queue.capacity;
+      queue.count--;
+      if (forkConnection(listenSocket, parked, service, &waitMask) == 0) {
+        active++;
+      }
+    }
+
+    // Wait for a connection or a child exit
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(listenSocket, &readable);
+    if (pselect(listenSocket + 1, &readable, NULL, NULL, NULL, &waitMask) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("ERROR waiting for connections");
+    }
+
+    int connectionSocket = acceptConnection(listenSocket);
+    if (connectionSocket < 0) {
+      continue;
+    }
+
+    if (config->maxConnections == 0 || active < config->maxConnections) {
+      if (forkConnection(listenSocket, connectionSocket, service, &waitMask) == 0) {
+        active++;
+      }
+    } else if (queue.count < queue.capacity) {
+      queue.sockets[(queue.head + queue.count) % queue.capacity] = connectionSocket;
+      queue.count++;
+    } else {
+      rejectBusy(connectionSocket);
+    }
+  }
+}
+
+// Function: Start one pre-forked worker process, pinned to CPU slot `cpuSlot` unless it is -1.
+// Returns its pid in the parent
+static inline pid_t spawnWorkerProcess(int listenSocket, int cpuSlot, const ServiceSpec *service) {
+  pid_t spawnPid = fork();
+  if (spawnPid == 0) {
+    // Pool workers go down with the parent instead of lingering on the port
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+      exit(0);
+    }
+    if (cpuSlot >= 0) {
+      pinToCpuSlot(cpuSlot);
+    }
+    WorkerArena arena;
+    initWorkerArena(&arena);
+    workerLoop(listenSocket, service, &arena);
+    exit(0);
+  }
+  if (spawnPid < 0) {
+    perror("ERROR on fork");
+  }
+  return spawnPid;
+}
+
+// Function: Keep `workers` pre-forked processes accepting, worker i on listeners[i], replacing any
+// that die. A replacement takes over the listener and CPU slot of the worker it replaces
+static inline void runProcessPool(const int *listeners, int workers, int pinWorkers, const ServiceSpec *service) {
+  pid_t *pids = malloc(sizeof(pid_t) * workers);
+  if (pids == NULL) {
+    error("ERROR allocating worker pool");
+  }
+  for (int i = 0; i < workers; i++) {
+    pids[i] = spawnWorkerProcess(listeners[i], pinWorkers ? i : -1, service);
+  }
+
+  while (1) {
+    int status;
+    pid_t exited = wait(&status);
+    if (exited < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("ERROR waiting for workers");
+    }
+
+    // A slot whose fork failed earlier (-1) is refilled along with the exited worker's
+    for (int i = 0; i < workers; i++) {
+      if (pids[i] == exited || pids[i] < 0) {
+        if (pids[i] == exited) {
+          fprintf(stderr, "SERVER: worker %d exited, restarting\n", (int) exited);
+        }
+        pids[i] = spawnWorkerProcess(listeners[i], pinWorkers ? i : -1, service);
+        if (pids[i] < 0) {
+          sleep(1);  // Back off instead of spinning when fork keeps failing
+        }
+      }
+    }
+  }
+}
+
+typedef struct {
+  int listenSocket;
+  int cpuSlot;             // -1 leaves the thread unpinned
+  const ServiceSpec *service;
+} ThreadWorkerArgs;
+
+static void *threadWorkerMain(void *arg) {
+  ThreadWorkerArgs *args = arg;
+  if (args->cpuSlot >= 0) {
+    pinToCpuSlot(args->cpuSlot);
+  }
+  WorkerArena arena;
+  initWorkerArena(&arena);
+  workerLoop(args->listenSocket, args->service, &arena);
+  return NULL;
+}
+
+// Function: Run `workers` threads, thread i accepting on listeners[i], each with its own arena
+static inline void runThreadPool(const int *listeners, int workers, int pinWorkers, const ServiceSpec *service) {
+  ThreadWorkerArgs *args = malloc(sizeof(ThreadWorkerArgs) * workers);
+  pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+  if (threads == NULL || args == NULL) {
+    error("ERROR allocating worker threads");
+  }
+  for (int i = 0; i < workers; i++) {
+    args[i].listenSocket = listeners[i];
+    args[i].cpuSlot = pinWorkers ? i : -1;
+    args[i].service = service;
+    if (pthread_create(&threads[i], NULL, threadWorkerMain, &args[i]) != 0) {
+      error("ERROR starting worker thread");
+    }
+  }
+  for (int i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(args);
+}
+
+// Function: Serve connections on the listen socket with the configured worker model. Blocking
+// workers run handleConnection(); event loops drive the otp_event.h state machine
+static inline void runServer(int listenSocket, const ServerConfig *config, const ServiceSpec *service) {
+  // A client that hangs up mid-reply must not kill a long-lived worker
+  signal(SIGPIPE, SIG_IGN);
+
+  // The fork model collects children when SIGCHLD interrupts its wait. Block the signal before any
+  // thread (metrics) exists, so no other thread can take it instead
+  if (config->workers == 0 && !config->eventDriven && !config->uring) {
+    sigset_t childSignal;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, NULL);
+  }
+
+  // Before any worker exists, so every one of them shares the counters
+  if (config->metricsPort > 0 && startMetrics(config->metricsPort) < 0) {
+    exit(1);
+  }
+
+  // Pads are mapped once, here, and every worker inherits the mappings
+  if (config->padDir != NULL && registerPads(config->padDir) < 0) {
+    exit(1);
+  }
+
+  // Each process starts its cipher pool the first time a large request needs it
+  cipherPoolThreads = config->cipherThreads;
+
+  // Worker i accepts on listeners[i]: its own shard with -s, otherwise the one socket from main()
+  int slots = config->workers > 0 ? config->workers : 1;
+  int *listeners = malloc(sizeof(int) * slots);
+  if (listeners == NULL) {
+    error("ERROR allocating listeners");
+  }
+  listeners[0] = listenSocket;
+  for (int i = 1; i < slots; i++) {
+    listeners[i] = config->sharded ? openListenSocket(config) : listenSocket;
+  }
+
+  if (config->eventDriven) {
+    runEventServer(listeners, config->workers, config->maxConnections, config->pinWorkers, service);
+  } else if (config->uring) {
+    runUringServer(listeners, config->workers, config->maxConnections, config->pinWorkers, service);
+  } else if (config->workers == 0) {
+    runForkPerConnection(listenSocket, config, service);
+  } else if (config->threaded) {
+    runThreadPool(listeners, config->workers, config->pinWorkers, service);
+  } else {
+    runProcessPool(listeners, config->workers, config->pinWorkers, service);
+  }
+  free(listeners);
+}
+
+#endif
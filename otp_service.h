@@ -0,0 +1,605 @@
+#ifndef OTP_SERVICE_H
+#define OTP_SERVICE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_metrics.h"
+#include "otp_parallel.h"
+#include "otp_arena.h"
+#include "otp_pad.h"
+#include "otp_shm.h"
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 70000
+#endif
+
+// Room for the largest request buffers: a parallel cipher window, or a whole newline message
+#define WORKER_ARENA_SIZE (2 * (size_t) OTP_CHUNK_SIZE * OTP_PARALLEL_WINDOW + BUFFER_SIZE + 4096)
+
+// What a server offers and how it talks to each kind of client.
+//
+// enc_server, dec_server and otp_server share this connection handling and
+// differ only in their ServiceSpec. A role pairs a client identifier with the
+// answer we send and the operation used for requests that do not name one
+// (every newline-protocol request, and framed requests with op 0). A framed
+// request may name any operation in `ops`. When a server supports more than
+// its role's default, or has pads registered (otp_pad.h), the handshake reply
+// lists its operations after the version suffix, with 'P' for the pads:
+// "ENC_SERVER/2:ED", "ENC_SERVER/2:EP". Blocking workers serving a Unix domain
+// socket also take shared memory (otp_shm.h) and add 'M'. Every framed server
+// takes the packed format (otp_pack.h) and ends the list with 'C', so framed
+// clients always get one.
+
+typedef struct {
+  const char *clientType;   // "ENC_CLIENT" / "DEC_CLIENT"
+  const char *serverType;   // "ENC_SERVER" / "DEC_SERVER"
+  int defaultOp;            // OTP_OP_ENCRYPT / OTP_OP_DECRYPT
+} ServiceRole;
+
+typedef struct {
+  const ServiceRole *roles;
+  size_t roleCount;
+  unsigned ops;             // Bit (1 << op) for every supported operation
+} ServiceSpec;
+
+// A newline-protocol request as it sits in the receive buffer: views, not copies
+typedef struct {
+  char *text;               // First line, transformed in place
+  size_t textLength;
+  const char *key;          // Second line
+  size_t keyLength;
+} MessageView;
+
+// -- Operations --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Kernel for an operation, or NULL when there is none
+static inline ChunkTransform opTransform(int op) {
+  switch (op) {
+    case OTP_OP_ENCRYPT:
+      return cipherEncrypt;
+    case OTP_OP_DECRYPT:
+      return cipherDecrypt;
+    case OTP_OP_VERIFY:
+      return cipherEncrypt;  // What it sends back; the check runs beside it (cipherVerify)
+    default:
+      return NULL;
+  }
+}
+
+// Function: The operation a request runs: its own, or the role default. Returns 0 when the
+// service does not offer it
+static inline int resolveOp(const ServiceSpec *service, const ServiceRole *role, int requestedOp) {
+  int op = requestedOp != OTP_OP_DEFAULT ? requestedOp : role->defaultOp;
+  if (op <= 0 || op >= 16 || !(service->ops & (1u << op)) || opTransform(op) == NULL) {
+    return 0;
+  }
+  return op;
+}
+
+// Function: Write the handshake reply for a role: "ENC_SERVER" for the newline protocol, and
+// "ENC_SERVER/2:EC" for a framed client, with every operation on offer and 'C' for the packed
+// format ("ENC_SERVER/2:EDPC" with pads, "ENC_SERVER/2:EMC" when the connection can share memory)
+static inline void formatHandshakeReply(const ServiceSpec *service, const ServiceRole *role, int framed,
+                                        int sharedMemory, char *reply, size_t replySize) {
+  snprintf(reply, replySize, "%s%s", role->serverType, framed ? OTP_VERSION_SUFFIX : "");
+  if (!framed) {
+    return;
+  }
+
+  size_t length = strlen(reply);
+  if (length + 1 < replySize) {
+    reply[length++] = ':';
+  }
+  for (int op = 1; op < 16 && length + 1 < replySize; op++) {
+    if ((service->ops & (1u << op)) && opTransform(op) != NULL) {
+      reply[length++] = otpOpLetter(op);
+    }
+  }
+  if (padCount > 0 && length + 1 < replySize) {
+    reply[length++] = 'P';
+  }
+  if (sharedMemory && length + 1 < replySize) {
+    reply[length++] = 'M';
+  }
+  if (length + 1 < replySize) {
+    reply[length++] = 'C';
+  }
+  reply[length] = '\0';
+}
+
+// Function: Find the role whose identifier starts the handshake message. Sets *framed when the
+// client asked for the framed protocol. Returns NULL when nothing matches
+static inline const ServiceRole *matchRole(const ServiceSpec *service, const char *clientType, int *framed) {
+  for (size_t i = 0; i < service->roleCount; i++) {
+    const ServiceRole *role = &service->roles[i];
+    size_t expectedLength = strlen(role->clientType);
+    if (strncmp(clientType, role->clientType, expectedLength) == 0) {
+      *framed = strcmp(clientType + expectedLength, OTP_VERSION_SUFFIX) == 0;
+      return role;
+    }
+  }
+  return NULL;
+}
+
+// -- Newline Protocol --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Send `messageLength` bytes followed by the `\n` terminator. Returns 0 on success
+static inline int sendMessage(int socketFD, const char *message, size_t messageLength) {
+  if (sendAll(socketFD, message, messageLength) < 0) {
+      perror("ERROR sending message");
+      return -1;
+  }
+
+  // Send a termination signal (`\n`) to mark end of message
+  return sendAll(socketFD, "\n", 1);
+}
+
+// Function: Receive a newline-protocol message (plaintext line + key line) and NUL-terminate it.
+// Only the newly received bytes are scanned, so each byte is looked at once, and nothing past
+// them is touched. Returns the message length, or -1 on error
+static inline int receiveMessage(int socketFD, char *buffer, int bufferSize) {
+  int totalReceived = 0;
+  int newlinesSeen = 0;
+  int charsRead;
+
+  while (totalReceived < bufferSize - 1) {
+      charsRead = recv(socketFD, buffer + totalReceived, bufferSize - totalReceived - 1, 0);
+      
+      if (charsRead < 0) {
+          perror("ERROR reading from socket");
+          return -1;
+      }
+      if (charsRead == 0) {  // Stop if connection closes
+          break;
+      }
+
+      // ** Count newlines in the new bytes; two mean plaintext + key have arrived **
+      char *scan = buffer + totalReceived;
+      char *end = scan + charsRead;
+      while (newlinesSeen < 2 && (scan = memchr(scan, '\n', end - scan)) != NULL) {
+          newlinesSeen++;
+          scan++;
+      }
+
+      totalReceived += charsRead;
+      if (newlinesSeen >= 2) {
+          break;  // We have received both lines
+      }
+  }
+
+  buffer[totalReceived] = '\0';  // Ensure null termination
+  return totalReceived;
+}
+
+// Function: Point the view at the first line of the message. Returns 0 on success
+static inline int extractPlaintext(char *buffer, size_t length, MessageView *view) {
+  char *newlinePos = memchr(buffer, '\n', length);
+  if (newlinePos == NULL) {
+      return -1;
+  }
+  view->text = buffer;
+  view->textLength = newlinePos - buffer;
+  return 0;
+}
+
+// Function: Point the view at the key line, which runs to the next newline or the end of the
+// message. Call after extractPlaintext(). Returns 0 on success
+static inline int extractKey(const char *buffer, size_t length, MessageView *view) {
+  const char *keyStart = view->text + view->textLength + 1;
+  size_t remaining = buffer + length - keyStart;
+  const char *newlinePos = memchr(keyStart, '\n', remaining);
+  view->key = keyStart;
+  view->keyLength = newlinePos != NULL ? (size_t) (newlinePos - keyStart) : remaining;
+  return 0;
+}
+
+// Function: Split a received newline-protocol message into views of its text and key, without
+// copying either. Returns 0 on success, -1 when a line is missing or the key is too short
+static inline int parseMessage(char *buffer, size_t length, MessageView *view) {
+  if (extractPlaintext(buffer, length, view) < 0 || extractKey(buffer, length, view) < 0) {
+    return -1;
+  }
+  return view->keyLength < view->textLength ? -1 : 0;
+}
+
+// Function: Check the client identifier and answer with ours, offering shared memory when
+// `sharedMemory` is set. Returns the client's role and sets *framed when the client asked for the
+// framed protocol; returns NULL when the handshake failed
+static inline const ServiceRole *verifyClient(int connectionSocket, const ServiceSpec *service,
+                                              int sharedMemory, int *framed) {
+  char clientType[OTP_CLIENT_ID_SIZE];
+  memset(clientType, '\0', sizeof(clientType));
+
+  // Receive client identifier
+  int checkClient = recv(connectionSocket, clientType, sizeof(clientType) - 1, 0);
+  if (checkClient < 0) {
+      fprintf(stderr, "SERVER: ERROR reading handshake\n");
+      return NULL;
+  }
+
+  // Validate client type (ENC_CLIENT or DEC_CLIENT)
+  const ServiceRole *role = matchRole(service, clientType, framed);
+  if (role == NULL) {
+      fprintf(stderr, "SERVER: ERROR - incorrect client type\n");
+      return NULL;
+  }
+
+  // Send server confirmation (ENC_SERVER or DEC_SERVER), echoing the version suffix
+  char reply[OTP_HANDSHAKE_SIZE];
+  formatHandshakeReply(service, role, *framed, sharedMemory, reply, sizeof(reply));
+  int handshakeSent = send(connectionSocket, reply, strlen(reply), 0);
+  if (handshakeSent < 0) {
+      fprintf(stderr, "SERVER: ERROR sending handshake response\n");
+      return NULL;
+  }
+  return role;
+}
+
+// Function: Encrypt `length` bytes of a newline-protocol message. `ciphertext` may be the
+// plaintext itself. Returns the output length including the newline
+static inline size_t encryptMessage(const char *plaintext, size_t length, const char *key, char *ciphertext) {
+  cipherEncrypt(plaintext, key, ciphertext, length);
+
+  // Add newline at the end (per project requirements)
+  ciphertext[length] = '\n';
+  return length + 1;
+}
+
+// Function: Decrypt `length` bytes of a newline-protocol message. `plaintext` may be the
+// ciphertext itself. Returns the output length including the newline
+static inline size_t decryptMessage(const char *ciphertext, size_t length, const char *key, char *plaintext) {
+  cipherDecrypt(ciphertext, key, plaintext, length);
+
+  plaintext[length] = '\n';
+  return length + 1;
+}
+
+// -- Framed Protocol --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Receive the next request header of a session. When `passedFD` is set, a descriptor
+// sent along with the header is stored there (it stays -1 when none came). Returns 0 on success,
+// 1 when the client closed the connection cleanly between requests, -1 on error
+static inline int recvNextHeader(int socketFD, FrameHeader *header, int *passedFD) {
+  unsigned char wire[OTP_HEADER_SIZE];
+  ssize_t charsRead;
+  do {
+    charsRead = passedFD != NULL ? recvWithDescriptor(socketFD, wire, sizeof(wire), passedFD)
+                                 : recv(socketFD, (char *) wire, sizeof(wire), 0);
+  } while (charsRead < 0 && errno == EINTR);
+
+  if (charsRead == 0) {
+    return 1;
+  }
+  if (charsRead < 0 ||
+      recvAll(socketFD, (char *) wire + charsRead, sizeof(wire) - charsRead) < 0) {
+    return -1;
+  }
+  decodeHeader(wire, header);
+  return 0;
+}
+
+// Function: Answer one framed request whose header has been read. The payload is handled a
+// window at a time: one chunk pair, or, for requests of at least OTP_PARALLEL_THRESHOLD bytes when
+// -p is set, OTP_PARALLEL_WINDOW pairs transformed across the cipher pool (otp_parallel.h). The
+// window comes from the worker's arena, sized to the request, and each one is sent back as soon
+// as it is transformed, so memory use is bounded regardless of message size. A pad request
+// (OTP_FLAG_PAD) sends only text; its key is read straight from the registered pad, and an
+// encryption claims its pad range before anything is answered. A verify request encrypts like
+// any other and ends its response with the OTP_VERIFY_TRAILER_SIZE mismatch count. A packed request
+// (OTP_FLAG_PACKED) is received, transformed and answered in the packed format. Returns 0 on
+// success
+static inline int serveRequest(int connectionSocket, const FrameHeader *request, int op,
+                               WorkerArena *arena) {
+  if (request->version != OTP_PROTO_VERSION) {
+    sendErrorFrame(connectionSocket, "unsupported protocol version");
+    return -1;
+  }
+  if (request->type != OTP_MSG_REQUEST) {
+    sendErrorFrame(connectionSocket, "unexpected message type");
+    return -1;
+  }
+
+  // A pad request's keyLength is its offset into the pad
+  const char *pad = NULL;
+  int packed = (request->flags & OTP_FLAG_PACKED) != 0;
+  if (packed && (request->flags & OTP_FLAG_PAD)) {
+    sendErrorFrame(connectionSocket, "pads cannot be used with the packed format");
+    return -1;
+  } else if (request->flags & OTP_FLAG_PAD) {
+    const char *reason;
+    pad = lookupPad(request->reserved, request->keyLength, request->textLength, op != OTP_OP_DECRYPT, &reason);
+    if (pad == NULL) {
+      sendErrorFrame(connectionSocket, reason);
+      return -1;
+    }
+  } else if (request->keyLength < request->textLength) {
+    sendErrorFrame(connectionSocket, "key is shorter than text");
+    return -1;
+  }
+
+  // Large requests take the parallel path. The window also serves as scratch space for key
+  // bytes beyond the text, so it is sized by the key; pad requests only ever hold text
+  uint64_t windowCapacity = OTP_CHUNK_SIZE;
+  if (request->textLength >= OTP_PARALLEL_THRESHOLD && getCipherPool() != NULL) {
+    windowCapacity = (uint64_t) OTP_CHUNK_SIZE * OTP_PARALLEL_WINDOW;
+  }
+  uint64_t windowKey = request->keyLength < windowCapacity ? request->keyLength : windowCapacity;
+  size_t windowSize = pad != NULL
+      ? (size_t) (request->textLength < windowCapacity ? request->textLength : windowCapacity)
+      : 2 * (size_t) (packed ? packedLength(windowKey) : windowKey);
+  arenaReset(arena);
+  CipherWindow window = { .window = arenaAlloc(arena, windowSize > 0 ? windowSize : OTP_ARENA_ALIGN),
+                          .transform = opTransform(op), .pad = pad, .verify = op == OTP_OP_VERIFY,
+                          .packed = packed };
+  uint64_t trailerLength = window.verify ? OTP_VERIFY_TRAILER_SIZE : 0;
+
+  uint64_t requestStart = metricsNow();
+  uint64_t receiveNanos = 0, cipherNanos = 0, sendNanos = 0;
+
+  // The response length is known up front, so the header goes out before any payload
+  int status = sendHeader(connectionSocket, OTP_MSG_RESPONSE, packed ? OTP_FLAG_PACKED : 0,
+                          request->textLength, trailerLength);
+
+  uint64_t remaining = request->textLength;
+  while (status == 0 && remaining > 0) {
+    window.textLength = remaining < windowCapacity ? remaining : windowCapacity;
+    uint64_t mark = metricsNow();
+
+    // Pairs are back to back on the wire, so one receive fills the whole window
+    uint64_t textBytes = packed ? packedLength(window.textLength) : window.textLength;
+    if (recvAll(connectionSocket, window.window, (pad != NULL ? 1 : 2) * textBytes) < 0) {
+      status = -1;
+      break;
+    }
+    uint64_t received = metricsNow();
+
+    // Transform in place and hand the text chunks straight back
+    transformWindow(&window);
+    uint64_t transformed = metricsNow();
+    status = sendWindow(connectionSocket, &window);
+    remaining -= window.textLength;
+    if (pad != NULL) {
+      window.pad += window.textLength;
+    }
+
+    receiveNanos += received - mark;
+    cipherNanos += transformed - received;
+    sendNanos += metricsNow() - transformed;
+  }
+
+  if (status == 0 && window.verify) {
+    unsigned char trailer[OTP_VERIFY_TRAILER_SIZE];
+    putUint64(trailer, window.mismatches);
+    status = sendAll(connectionSocket, (const char *) trailer, sizeof(trailer));
+    if (window.mismatches > 0) {
+      countMetric(verifyFailures, 1);
+    }
+  }
+
+  if (status == 0 && pad == NULL) {
+    uint64_t extraKey = request->keyLength - request->textLength;
+    status = discardBytes(connectionSocket, packed ? packedLength(extraKey) : extraKey,
+                          window.window, windowSize);
+  }
+
+  // Stage totals for the whole request, however many chunks it took
+  if (status == 0) {
+    recordDuration(STAGE_RECEIVE, receiveNanos);
+    recordDuration(STAGE_CIPHER, cipherNanos);
+    recordDuration(STAGE_SEND, sendNanos);
+    recordStage(STAGE_REQUEST, requestStart);
+  }
+  return status;
+}
+
+// Function: Answer an OTP_MSG_ATTACH: map the region whose descriptor came with the header,
+// replacing any attached before. Returns 0 on success
+static inline int serveAttach(int connectionSocket, const FrameHeader *request, int passedFD,
+                              SharedRegion *region) {
+  const char *reason;
+  if (attachSharedRegion(region, passedFD, request->textLength, &reason) < 0) {
+    sendErrorFrame(connectionSocket, reason);
+    return -1;
+  }
+  return sendHeader(connectionSocket, OTP_MSG_RESPONSE, OTP_FLAG_SHM, 0, 0);
+}
+
+// Function: Answer a shared memory request (OTP_FLAG_SHM). Its body is only the offsets of the text
+// and key inside the attached region; the text is transformed in place, across the cipher pool
+// when it is large, and the response carries no payload, only a verify request's trailer.
+// Returns 0 on success
+static inline int serveSharedRequest(int connectionSocket, const FrameHeader *request, int op,
+                                     const SharedRegion *region) {
+  if (request->version != OTP_PROTO_VERSION || request->type != OTP_MSG_REQUEST) {
+    sendErrorFrame(connectionSocket, "unexpected message type");
+    return -1;
+  }
+  unsigned char doorbell[OTP_SHM_DOORBELL_SIZE];
+  if (recvAll(connectionSocket, (char *) doorbell, sizeof(doorbell)) < 0) {
+    return -1;
+  }
+  uint64_t textOffset = getUint64(doorbell);
+  uint64_t keyOffset = getUint64(doorbell + 8);
+  if (request->flags & (OTP_FLAG_PAD | OTP_FLAG_PACKED)) {
+    sendErrorFrame(connectionSocket, (request->flags & OTP_FLAG_PAD) ? "pads cannot be used with shared memory"
+                                                                     : "shared memory requests cannot be packed");
+    return -1;
+  }
+  if (!sharedRangeValid(region, textOffset, request->textLength) ||
+      !sharedRangeValid(region, keyOffset, request->textLength)) {
+    sendErrorFrame(connectionSocket, region->base == NULL ? "no shared memory attached"
+                                                          : "shared memory range out of bounds");
+    return -1;
+  }
+
+  // The key is laid out like a pad: contiguous, textLength bytes
+  uint64_t requestStart = metricsNow();
+  CipherWindow window = { .window = region->base + textOffset, .textLength = request->textLength,
+                          .transform = opTransform(op), .pad = region->base + keyOffset,
+                          .verify = op == OTP_OP_VERIFY };
+  transformWindow(&window);
+  uint64_t transformed = metricsNow();
+
+  uint64_t trailerLength = window.verify ? OTP_VERIFY_TRAILER_SIZE : 0;
+  int status = sendHeader(connectionSocket, OTP_MSG_RESPONSE, OTP_FLAG_SHM, request->textLength, trailerLength);
+  if (status == 0 && window.verify) {
+    unsigned char trailer[OTP_VERIFY_TRAILER_SIZE];
+    putUint64(trailer, window.mismatches);
+    status = sendAll(connectionSocket, (const char *) trailer, sizeof(trailer));
+    if (window.mismatches > 0) {
+      countMetric(verifyFailures, 1);
+    }
+  }
+
+  if (status == 0) {
+    recordDuration(STAGE_CIPHER, transformed - requestStart);
+    recordStage(STAGE_REQUEST, requestStart);
+  }
+  return status;
+}
+
+// -- Connections --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Serve framed requests on one connection until the client closes it. Requests may
+// be pipelined and may each name their operation; they are answered strictly in order. With
+// `sharedMemory` set the client may attach a region and send shared memory requests, which are
+// answered in the same order. Returns 0 on success, -1 on error
+static inline int serveSession(int connectionSocket, const ServiceSpec *service,
+                               const ServiceRole *role, int sharedMemory, WorkerArena *arena) {
+  SharedRegion region = { NULL, 0 };
+  int status;
+  while (1) {
+    FrameHeader request;
+    int passedFD = -1;
+    status = recvNextHeader(connectionSocket, &request, sharedMemory ? &passedFD : NULL);
+    if (status != 0) {
+      status = status > 0 ? 0 : -1;
+      break;
+    }
+
+    if (sharedMemory && request.version == OTP_PROTO_VERSION && request.type == OTP_MSG_ATTACH) {
+      status = serveAttach(connectionSocket, &request, passedFD, &region);
+      if (status < 0) {
+        break;
+      }
+      continue;
+    }
+    if (passedFD >= 0) {
+      close(passedFD);
+    }
+
+    int op = resolveOp(service, role, request.flags & OTP_FLAG_OP_MASK);
+    if (op == 0) {
+      sendErrorFrame(connectionSocket, "operation not supported");
+      status = -1;
+      break;
+    }
+    if ((request.flags & OTP_FLAG_SHM) && !sharedMemory) {
+      sendErrorFrame(connectionSocket, "shared memory transport not offered");
+      status = -1;
+      break;
+    }
+    status = (request.flags & OTP_FLAG_SHM) ? serveSharedRequest(connectionSocket, &request, op, &region)
+                                            : serveRequest(connectionSocket, &request, op, arena);
+    if (status < 0) {
+      break;
+    }
+    countRequest(1, op, requestBodyLength(&request), responseBodyLength(&request));
+  }
+  releaseSharedRegion(&region);
+  return status;
+}
+
+// Function: Serve one client connection out of the worker's arena. Returns 0 on success
+static inline int serveConnection(int connectionSocket, WorkerArena *arena, const ServiceSpec *service) {
+
+  // ** Step 0: Check Correct Client and Server Connection **
+  // Descriptors, and so shared memory, can only be passed over a Unix domain socket
+  int framed = 0;
+  uint64_t mark = metricsNow();
+  int sharedMemory = isUnixSocket(connectionSocket);
+  const ServiceRole *role = verifyClient(connectionSocket, service, sharedMemory, &framed);
+  if (role == NULL) {
+    return -1;
+  }
+  mark = recordStage(STAGE_HANDSHAKE, mark);
+
+  // Framed clients send sessions of sized text and key chunks; transform each as it arrives
+  if (framed) {
+    return serveSession(connectionSocket, service, role, sharedMemory, arena);
+  }
+
+  // ** Step 1: Receive the full message from the client **
+  // Only the pages the message lands on are touched; the rest of the buffer stays unbacked
+  uint64_t requestStart = mark;
+  arenaReset(arena);
+  char *message = arenaAlloc(arena, BUFFER_SIZE);
+  int messageLength = message != NULL ? receiveMessage(connectionSocket, message, BUFFER_SIZE) : -1;
+  if (messageLength < 0) {
+    return -1;
+  }
+
+  // ** Step 2: Parse text and key **
+  MessageView view;
+  if (parseMessage(message, messageLength, &view) < 0) {
+    return -1;
+  }
+  mark = recordStage(STAGE_RECEIVE, mark);
+
+  // ** Step 3: Encrypt or decrypt Message **
+  // The output overwrites the text in place, so the receive buffer doubles as the send buffer.
+  // The key starts past the text, so no key byte is overwritten before it is read
+  size_t outputLength = role->defaultOp == OTP_OP_ENCRYPT
+      ? encryptMessage(view.text, view.textLength, view.key, view.text)
+      : decryptMessage(view.text, view.textLength, view.key, view.text);
+  mark = recordStage(STAGE_CIPHER, mark);
+
+  // ** Step 4: Send the full message to the client ***
+  if (sendMessage(connectionSocket, view.text, outputLength) < 0) {
+    return -1;
+  }
+  recordStage(STAGE_SEND, mark);
+  recordStage(STAGE_REQUEST, requestStart);
+  countRequest(0, role->defaultOp, messageLength, outputLength + 1);
+  return 0;
+}
+
+// Function: Turn a connection away without serving it: answer OTP_BUSY_REPLY in place of the
+// handshake and close. Whatever the client already sent is drained first, so the close is a
+// plain FIN rather than a reset that could overtake the reply. Never blocks
+static inline void rejectBusy(int connectionSocket) {
+  char drain[OTP_CLIENT_ID_SIZE];
+  send(connectionSocket, OTP_BUSY_REPLY, strlen(OTP_BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL);
+  while (recv(connectionSocket, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+  }
+  close(connectionSocket);
+  countMetric(rejected, 1);
+}
+
+// Function: Serve one client connection and account for it in the metrics. Returns 0 on success
+static inline int handleConnection(int connectionSocket, WorkerArena *arena, const ServiceSpec *service) {
+  uint64_t connectionStart = metricsNow();
+  countMetric(connections, 1);
+  countMetric(activeConnections, 1);
+
+  int status = serveConnection(connectionSocket, arena, service);
+
+  countMetric(activeConnections, -1);
+  if (status < 0) {
+    countMetric(errors, 1);
+  }
+  recordStage(STAGE_CONNECTION, connectionStart);
+  return status;
+}
+
+#endif
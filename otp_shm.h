@@ -0,0 +1,183 @@
+#ifndef OTP_SHM_H
+#define OTP_SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/memfd.h>
+#include "otp_proto.h"
+
+// Shared-memory transport for clients on the same host (shm:PATH endpoints).
+//
+// Over a Unix domain socket a client can hand the server a memory region once
+// and from then on move no payload through the socket at all. The client
+// creates a memfd, seals it against shrinking (so the server can never fault
+// on a truncated mapping) and passes the descriptor with SCM_RIGHTS alongside
+// an OTP_MSG_ATTACH header; both sides map it shared. The client uses the
+// region as a ring: it copies a job's text and key in, and sends a doorbell,
+// an OTP_FLAG_SHM request whose body is just the two offsets. The server
+// transforms the text in place and rings back with a response header (and a
+// verify trailer, if any) but no payload; the client reads the output straight
+// out of the region. Only servers running blocking workers on a Unix socket
+// offer it, with 'M' in their handshake reply.
+
+#define OTP_SHM_RING_SIZE (64 << 20)     // Default ring; grown to fit the largest job
+#define OTP_SHM_MAX_INFLIGHT 256         // Doorbells outstanding, well within the socket buffers
+
+// memfd sealing, spelled out since <fcntl.h> only has these with _GNU_SOURCE
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+typedef struct {
+  char *base;
+  uint64_t size;
+} SharedRegion;
+
+// -- Descriptor Passing --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Send `length` bytes with `fd` riding along as SCM_RIGHTS. Returns 0 on success
+static inline int sendWithDescriptor(int socketFD, const void *data, size_t length, int fd) {
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec vector = { (void *) data, length };
+  struct msghdr message = { .msg_iov = &vector, .msg_iovlen = 1,
+                            .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+  // The descriptor goes with the first byte; whatever sendmsg() leaves is plain data
+  ssize_t sentAmount;
+  do {
+    sentAmount = sendmsg(socketFD, &message, MSG_NOSIGNAL);
+  } while (sentAmount < 0 && errno == EINTR);
+  if (sentAmount < 0) {
+    return -1;
+  }
+  return sendAll(socketFD, (const char *) data + sentAmount, length - sentAmount);
+}
+
+// Function: recv() that also collects a descriptor passed with the bytes. *fd is left alone when
+// none came; any beyond the first are closed. Returns what recv() would
+static inline ssize_t recvWithDescriptor(int socketFD, void *data, size_t length, int *fd) {
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct iovec vector = { data, length };
+  struct msghdr message = { .msg_iov = &vector, .msg_iovlen = 1,
+                            .msg_control = control, .msg_controllen = sizeof(control) };
+  ssize_t received = recvmsg(socketFD, &message, MSG_CMSG_CLOEXEC);
+  if (received <= 0) {
+    return received;
+  }
+
+  for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+      if (*fd < 0) {
+        *fd = passed;
+      } else {
+        close(passed);
+      }
+    }
+  }
+  return received;
+}
+
+// -- Regions --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Client side: create a sealed memfd of `size` bytes and map it. Returns the descriptor
+// to pass to the server, or -1 on error
+static inline int createSharedRegion(SharedRegion *region, uint64_t size) {
+  int fd = (int) syscall(__NR_memfd_create, "otp-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+    close(fd);
+    return -1;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  region->base = mapping;
+  region->size = size;
+  return fd;
+}
+
+// Function: Server side: map a region a client passed. Only a memfd sealed against shrinking is
+// taken, since a shrunk file would fault the server. `fd` is closed either way. Returns 0 on
+// success, -1 with *reason set for the client
+static inline int attachSharedRegion(SharedRegion *region, int fd, uint64_t size, const char **reason) {
+  struct stat info;
+  int seals = fd >= 0 ? fcntl(fd, F_GET_SEALS) : -1;
+  if (fd < 0) {
+    *reason = "no shared memory descriptor passed";
+  } else if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+    *reason = "shared memory must be sealed against shrinking";
+  } else if (fstat(fd, &info) < 0 || size == 0 || (uint64_t) info.st_size < size) {
+    *reason = "shared memory size mismatch";
+  } else {
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      *reason = "shared memory could not be mapped";
+      return -1;
+    }
+    if (region->base != NULL) {
+      munmap(region->base, region->size);
+    }
+    region->base = mapping;
+    region->size = size;
+    return 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return -1;
+}
+
+// Function: Unmap a region, if one is attached
+static inline void releaseSharedRegion(SharedRegion *region) {
+  if (region->base != NULL) {
+    munmap(region->base, region->size);
+  }
+  region->base = NULL;
+  region->size = 0;
+}
+
+// Function: Is [offset, offset + length) inside the region
+static inline int sharedRangeValid(const SharedRegion *region, uint64_t offset, uint64_t length) {
+  return region->base != NULL && offset <= region->size && length <= region->size - offset;
+}
+
+// Function: Is the socket a Unix domain socket (the only kind descriptors can be passed over)
+static inline int isUnixSocket(int socketFD) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  return getsockname(socketFD, (struct sockaddr *) &address, &length) == 0 && address.ss_family == AF_UNIX;
+}
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "otp_proto.h"
+#include "otp_service.h"
+#include "otp_metrics.h"
+#include "otp_event.h"
+
+// io_uring server mode (-u).
+//
+// The same per-connection state machine as the epoll mode (otp_event.h), driven
+// by completions instead of readiness. One multishot accept keeps delivering new
+// connections. Every connection has exactly one recv or send in flight, aimed
+// straight at its state machine's buffer. Each pass of the loop queues the
+// follow-up operations of every completion it reaped and submits them, together
+// with the wait for the next completions, in a single io_uring_enter(). A busy
+// loop therefore makes one syscall per batch rather than several per connection.
+// With -w N, N loops run in threads, each with its own ring, sharing the listen
+// socket or, with -s, each accepting on its own shard.
+//
+// Completions carry the EventConnection pointer; 0 marks the accept.
+// There is no liburing here, so the ring is set up with the raw syscalls and
+// the <linux/io_uring.h> layout.
+//
+// Registered buffers: each loop maps an arena of OTP_URING_SLOTS slots, each big
+// enough for a chunk pair and its trailer, and registers it with the ring once.
+// A framed connection borrows a slot as its buffer after the handshake, so its
+// chunk reads and replies run as READ_FIXED/WRITE_FIXED and the kernel skips
+// pinning and mapping the pages on every operation. Headers, handshakes and
+// newline-protocol messages stay on plain recv/send. Registered memory counts
+// against RLIMIT_MEMLOCK, so the arena shrinks until it fits; connections beyond
+// the free slots, or loops without an arena, fall back to plain recv/send too.
+//
+// Receives deliberately do not use provided-buffer multishot recv. Its data
+// lands in buffers the kernel picks and would be copied into the connection on
+// every chunk, and any bytes that arrive while a reply is still being sent would
+// have to be parked. A targeted recv into the connection's own slot needs neither.
+
+#define OTP_URING_ENTRIES 1024
+#define OTP_URING_ACCEPT 0   // user_data of the accept operation
+#define OTP_URING_SLOTS 64    // Registered slots per loop, at most
+#define OTP_URING_SLOT_SIZE (2 * OTP_CHUNK_SIZE + 4096)   // A chunk pair and trailer, in whole pages
+
+typedef struct {
+  int fd;
+  unsigned char *ring;        // SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+  size_t ringSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  unsigned toSubmit;          // Queued since the last io_uring_enter()
+  unsigned enterFlags;        // Extra flags every io_uring_enter() needs
+
+  char *arena;                // Registered as fixed buffer 0; NULL when registration failed
+  size_t arenaSize;
+  char *freeSlots[OTP_URING_SLOTS];
+  unsigned freeCount;
+} UringLoop;
+
+// -- Ring --
+// ----------------------------------------------------------------------------------------------
+
+static inline int uringEnter(UringLoop *loop, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, loop->fd, toSubmit, minComplete, flags | loop->enterFlags,
+                       NULL, 0);
+}
+
+// Function: Create a ring and map its queues. Returns 0 on success, -1 on error
+static inline int uringInit(UringLoop *loop, unsigned entries) {
+  struct io_uring_params params;
+  memset(loop, 0, sizeof(*loop));
+
+  // Only this thread submits; deferring task work to io_uring_enter() keeps completions off
+  // the hot path of whatever the thread is doing. Older kernels take no flags
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  loop->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (loop->fd < 0 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params));
+    loop->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (loop->fd < 0) {
+    return -1;
+  }
+  if (params.flags & IORING_SETUP_DEFER_TASKRUN) {
+    loop->enterFlags = IORING_ENTER_GETEVENTS;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = ENOSYS;
+    close(loop->fd);
+    return -1;
+  }
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  loop->ringSize = sqSize > cqSize ? sqSize : cqSize;
+  loop->ring = mmap(NULL, loop->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    loop->fd, IORING_OFF_SQ_RING);
+  loop->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  loop->sqes = mmap(NULL, loop->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    loop->fd, IORING_OFF_SQES);
+  if (loop->ring == MAP_FAILED || loop->sqes == MAP_FAILED) {
+    close(loop->fd);
+    return -1;
+  }
+
+  loop->sqHead = (unsigned *) (loop->ring + params.sq_off.head);
+  loop->sqTail = (unsigned *) (loop->ring + params.sq_off.tail);
+  loop->sqMask = *(unsigned *) (loop->ring + params.sq_off.ring_mask);
+  loop->sqEntries = params.sq_entries;
+  loop->sqArray = (unsigned *) (loop->ring + params.sq_off.array);
+  loop->cqHead = (unsigned *) (loop->ring + params.cq_off.head);
+  loop->cqTail = (unsigned *) (loop->ring + params.cq_off.tail);
+  loop->cqMask = *(unsigned *) (loop->ring + params.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *) (loop->ring + params.cq_off.cqes);
+  return 0;
+}
+
+// Function: Map this loop's slots and register them as fixed buffer 0. On ENOMEM (RLIMIT_MEMLOCK)
+// the arena is halved until it fits; without one the loop goes on with plain recv and send
+static inline void uringRegisterArena(UringLoop *loop) {
+  for (unsigned slots = OTP_URING_SLOTS; slots > 0; slots /= 2) {
+    size_t size = (size_t) slots * OTP_URING_SLOT_SIZE;
+    char *arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+      return;
+    }
+    struct iovec region = { .iov_base = arena, .iov_len = size };
+    if (syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_BUFFERS, &region, 1) == 0) {
+      loop->arena = arena;
+      loop->arenaSize = size;
+      for (unsigned i = 0; i < slots; i++) {
+        loop->freeSlots[i] = arena + (size_t) i * OTP_URING_SLOT_SIZE;
+      }
+      loop->freeCount = slots;
+      return;
+    }
+    int registerError = errno;
+    munmap(arena, size);
+    if (registerError != ENOMEM) {
+      return;
+    }
+  }
+}
+
+// Function: Is [data, data + length) inside the registered arena
+static inline int uringInArena(const UringLoop *loop, const char *data, size_t length) {
+  return loop->arena != NULL && data >= loop->arena && data + length <= loop->arena + loop->arenaSize;
+}
+
+// Function: Lend a connection a free slot as its buffer. Without one it keeps a heap buffer
+static inline void uringLendSlot(UringLoop *loop, EventConnection *conn) {
+  if (loop->freeCount == 0) {
+    return;
+  }
+  conn->buffer = conn->lentBuffer = loop->freeSlots[--loop->freeCount];
+  conn->capacity = OTP_URING_SLOT_SIZE;
+}
+
+// Function: Take back a connection's slot, once its buffer has moved to the heap or it is closing
+static inline void uringReturnSlot(UringLoop *loop, EventConnection *conn) {
+  loop->freeSlots[loop->freeCount++] = conn->lentBuffer;
+  if (conn->buffer == conn->lentBuffer) {
+    conn->buffer = NULL;
+    conn->capacity = 0;
+  }
+  conn->lentBuffer = NULL;
+}
+
+// Function: Close a connection with no operation in flight, returning its slot first
+static inline void uringCloseConnection(UringLoop *loop, EventConnection *conn) {
+  if (conn->lentBuffer != NULL) {
+    uringReturnSlot(loop, conn);
+  }
+  closeEventConnection(conn);
+}
+
+// Function: Claim the next submission slot, cleared. When the queue is full everything queued
+// so far is submitted first. Returns NULL only when the kernel refuses the submission
+static inline struct io_uring_sqe *uringNextSqe(UringLoop *loop) {
+  unsigned tail = *loop->sqTail;
+  if (tail - __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE) >= loop->sqEntries) {
+    if (uringEnter(loop, loop->toSubmit, 0, 0) < 0) {
+      return NULL;
+    }
+    loop->toSubmit = 0;
+  }
+
+  unsigned index = tail & loop->sqMask;
+  struct io_uring_sqe *sqe = &loop->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  loop->sqArray[index] = index;
+  __atomic_store_n(loop->sqTail, tail + 1, __ATOMIC_RELEASE);
+  loop->toSubmit++;
+  return sqe;
+}
+
+// Function: Queue a (multishot, when `multishot` is set) accept on the listen socket
+static inline int uringQueueAccept(UringLoop *loop, int listenSocket, int multishot) {
+  struct io_uring_sqe *sqe = uringNextSqe(loop);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenSocket;
+  sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+  sqe->user_data = OTP_URING_ACCEPT;
+  return 0;
+}
+
+// Function: Queue a connection's next operation: a recv into its state machine or the rest of
+// its pending write, as a fixed read or write when it lies in the arena. Returns 0 when one is in
+// flight, -1 when the connection is finished
+static inline int uringQueueNext(UringLoop *loop, EventConnection *conn) {
+  // A framed session gets its slot before its first request reserves a buffer
+  if (conn->lentBuffer != NULL && conn->buffer != conn->lentBuffer) {
+    uringReturnSlot(loop, conn);
+  } else if (conn->framed && conn->buffer == NULL) {
+    uringLendSlot(loop, conn);
+  }
+
+  char *target;
+  size_t wanted;
+  int need = nextEventRead(conn, &target, &wanted);
+  if (need < 0) {
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe = uringNextSqe(loop);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->fd = conn->fd;
+  sqe->user_data = (uint64_t) (uintptr_t) conn;
+  if (need == 0) {
+    const char *data = conn->writeData + conn->writeOffset;
+    size_t length = conn->writeLength - conn->writeOffset;
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = length;
+    if (uringInArena(loop, data, length)) {
+      // A plain write to the socket: SIGPIPE is ignored, so a gone peer is EPIPE as with MSG_NOSIGNAL
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->buf_index = 0;
+    } else {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    }
+  } else {
+    sqe->addr = (uint64_t) (uintptr_t) target;
+    sqe->len = wanted;
+    // Offset 0, as sockets require; the fixed read behaves like recv without flags
+    sqe->opcode = uringInArena(loop, target, wanted) ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+  }
+  return 0;
+}
+
+// -- Completions --
+// ----------------------------------------------------------------------------------------------
+
+// Function: Apply a connection's completed recv or send. Returns 0 while it goes on, -1 once
+// it is finished
+static inline int uringComplete(EventConnection *conn, const ServiceSpec *service, int result) {
+  if (result == -EINTR || result == -EAGAIN) {
+    return 0;  // Nothing happened; the same operation is queued again
+  }
+  if (result < 0) {
+    return -1;
+  }
+
+  if (conn->state == EV_WRITE) {
+    conn->writeOffset += result;
+    if (conn->writeOffset == conn->writeLength) {
+      completeEventWrite(conn);
+    }
+    return 0;
+  }
+
+  // The target is where nextEventRead() pointed this recv
+  char *target;
+  size_t wanted;
+  if (nextEventRead(conn, &target, &wanted) != 1) {
+    return -1;
+  }
+  return applyEventRead(conn, service, target, result);
+}
+
+// Function: Run one io_uring loop forever. The listen socket may be shared between loops
+static void *runUringLoop(void *arg) {
+  EventLoopArgs *args = arg;
+  if (args->cpuSlot >= 0) {
+    pinToCpuSlot(args->cpuSlot);
+  }
+  UringLoop loop;
+  if (uringInit(&loop, OTP_URING_ENTRIES) < 0) {
+    perror("ERROR creating io_uring");
+    exit(1);
+  }
+  uringRegisterArena(&loop);
+
+  int multishotAccept = 1;
+  if (uringQueueAccept(&loop, args->listenSocket, multishotAccept) < 0) {
+    perror("ERROR queueing accept");
+    exit(1);
+  }
+
+  while (1) {
+    // Submit everything the last batch queued and wait for at least one completion
+    if (uringEnter(&loop, loop.toSubmit, 1, IORING_ENTER_GETEVENTS) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR in io_uring_enter");
+      exit(1);
+    }
+    loop.toSubmit = 0;
+
+    unsigned head = *loop.cqHead;
+    unsigned tail = __atomic_load_n(loop.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &loop.cqes[head & loop.cqMask];
+      int result = cqe->res;
+      unsigned flags = cqe->flags;
+
+      if (cqe->user_data == OTP_URING_ACCEPT) {
+        if (result >= 0) {
+          EventConnection *conn = newEventConnection(result, args->maxConnections);
+          if (conn != NULL && uringQueueNext(&loop, conn) < 0) {
+            conn->failed = 1;
+            uringCloseConnection(&loop, conn);
+          }
+        } else if (result == -EINVAL && multishotAccept) {
+          multishotAccept = 0;  // Kernel without multishot accept: re-arm after every connection
+        } else if (result != -EINTR && result != -ECONNABORTED && result != -EAGAIN) {
+          fprintf(stderr, "ERROR on accept: %s\n", strerror(-result));
+        }
+        if (!(flags & IORING_CQE_F_MORE) && uringQueueAccept(&loop, args->listenSocket, multishotAccept) < 0) {
+          perror("ERROR queueing accept");
+          exit(1);
+        }
+        continue;
+      }
+
+      EventConnection *conn = (EventConnection *) (uintptr_t) cqe->user_data;
+      if (uringComplete(conn, args->service, result) < 0 || uringQueueNext(&loop, conn) < 0) {
+        uringCloseConnection(&loop, conn);
+      }
+    }
+    __atomic_store_n(loop.cqHead, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// Function: Serve with `loops` io_uring loops (one per thread), loop i accepting on listeners[i],
+// at most `maxConnections` clients at a time when it is set
+static inline void runUringServer(const int *listeners, int loops, int maxConnections, int pinLoops,
+                                  const ServiceSpec *service) {
+  prepareEventListen();
+  EventLoopArgs *args = makeEventLoopArgs(listeners, loops, maxConnections, pinLoops, service);
+  runEventLoops(loops, runUringLoop, args);
+  free(args);
+}
+
+#endif